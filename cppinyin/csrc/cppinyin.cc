@@ -22,8 +22,10 @@
 #include <algorithm>
 #include <cassert>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <limits>
 #include <numeric>
 #include <set>
@@ -36,17 +38,461 @@
 
 namespace cppinyin {
 
-void PinyinEncoder::Init(int32_t num_threads) {
-  if (num_threads <= 0) {
-    num_threads = std::thread::hardware_concurrency();
+namespace {
+
+template <Tone tone>
+using ToneConstant = std::integral_constant<Tone, tone>;
+
+// Calls f(tone, partial) with both as std::integral_constant.
+template <typename F> void DispatchFormat(Tone tone, bool partial, F &&f) {
+  switch (tone) {
+  case Tone::kNumber:
+    return partial ? f(ToneConstant<Tone::kNumber>(), std::true_type())
+                   : f(ToneConstant<Tone::kNumber>(), std::false_type());
+  case Tone::kNormal:
+    return partial ? f(ToneConstant<Tone::kNormal>(), std::true_type())
+                   : f(ToneConstant<Tone::kNormal>(), std::false_type());
+  case Tone::kNone:
+    return partial ? f(ToneConstant<Tone::kNone>(), std::true_type())
+                   : f(ToneConstant<Tone::kNone>(), std::false_type());
+  }
+}
+
+// The workspace of the Encode calls not given one.
+EncodeWorkspace &ThreadLocalWorkspace() {
+  thread_local EncodeWorkspace ws;
+  return ws;
+}
+
+// The chunk size of the batch calls, a few chunks per thread.
+size_t BatchGrain(size_t size, size_t concurrency) {
+  return std::max<size_t>(1, size / (std::max<size_t>(concurrency, 1) * 4));
+}
+
+// The number of UTF-8 characters of unit `u`, see PinyinEncoder::SplitWord.
+inline int32_t UnitChars(const char *str, const std::vector<int32_t> &offsets,
+                         int32_t u) {
+  return static_cast<uint8_t>(str[offsets[u]]) < 0x80
+             ? offsets[u + 1] - offsets[u]
+             : 1;
+}
+
+// Models of format v2: a ModelHeader, an array of SectionEntry, then the
+// sections, each aligned to kSectionAlignment bytes.
+constexpr uint32_t kByteOrderMark = 0x01020304;
+constexpr uint32_t kFormatVersion = 2;
+constexpr size_t kSectionAlignment = 64;
+
+struct ModelHeader {
+  // HEADER_V2, padded with zeros.
+  char magic[16];
+  uint32_t byte_order;
+  uint32_t version;
+  uint32_t num_sections;
+  // The CRC32C of the section directory.
+  uint32_t directory_crc;
+  char reserved[32];
+};
+static_assert(sizeof(ModelHeader) == 64, "ModelHeader must be 64 bytes");
+
+struct SectionEntry {
+  uint32_t id;
+  // The CRC32C of the section.
+  uint32_t crc;
+  uint64_t offset;
+  uint64_t size;
+};
+static_assert(sizeof(SectionEntry) == 24, "SectionEntry must be 24 bytes");
+
+// The sections of a model, loaders skip the sections they do not know.
+enum SectionId : uint32_t {
+  // A ModelMetadata.
+  kMetadataSection = 1,
+  // The float score of each key.
+  kScoresSection = 2,
+  // The uint32 reading of each key.
+  kKeyReadingsSection = 3,
+  // The uint32 offsets of the readings in kReadingIdsSection, plus the end.
+  kReadingOffsetsSection = 4,
+  // The uint16 syllable ids of the readings.
+  kReadingIdsSection = 5,
+  // The syllable inventory the ids index, as NUL terminated strings.
+  kSyllablesSection = 6,
+  // The double array units, for the models indexed by a DartsPhraseIndex.
+  kUnitsSection = 7,
+  // The name and the Data of an index other than darts.
+  kIndexNameSection = 8,
+  kIndexSection = 9,
+  kNumSectionIds = 10,
+};
+
+struct ModelMetadata {
+  uint32_t num_keys;
+  // The maximum number of characters of a key, 0 if unknown.
+  uint32_t max_key_len;
+  uint32_t num_syllables;
+  uint32_t reserved;
+};
+
+// A section to save.
+struct SectionData {
+  SectionId id;
+  const char *data;
+  size_t size;
+};
+
+template <typename T>
+SectionData MakeSection(SectionId id, const T *data, size_t size) {
+  return {id, reinterpret_cast<const char *>(data), size * sizeof(T)};
+}
+
+inline size_t AlignUp(size_t offset, size_t alignment) {
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+// Writes the zero bytes taking `offset` to a multiple of `alignment`.
+size_t WritePadding(std::ofstream &ofile, size_t offset, size_t alignment) {
+  static const char zeros[kSectionAlignment] = {};
+  size_t size = AlignUp(offset, alignment) - offset;
+  ofile.write(zeros, size);
+  return size;
+}
+
+template <typename T>
+size_t WriteArray(std::ofstream &ofile, const T *data, size_t size) {
+  ofile.write(reinterpret_cast<const char *>(data), size * sizeof(T));
+  return size * sizeof(T);
+}
+
+// Stores each distinct reading once.
+class ReadingInterner {
+public:
+  ReadingInterner(std::vector<uint32_t> *offsets, std::vector<uint16_t> *ids)
+      : offsets_(offsets), ids_(ids) {
+    offsets_->assign(1, 0);
+    ids_->clear();
+  }
+
+  // The index of the reading of the `size` syllables at `ids`.
+  uint32_t Add(const uint16_t *ids, size_t size) {
+    key_.assign(reinterpret_cast<const char *>(ids), size * sizeof(uint16_t));
+    auto iter = index_.find(key_);
+    if (iter != index_.end()) {
+      return iter->second;
+    }
+    uint32_t r = offsets_->size() - 1;
+    ids_->insert(ids_->end(), ids, ids + size);
+    offsets_->push_back(ids_->size());
+    index_.emplace(key_, r);
+    return r;
+  }
+
+private:
+  std::vector<uint32_t> *offsets_;
+  std::vector<uint16_t> *ids_;
+  std::unordered_map<std::string, uint32_t> index_;
+  std::string key_;
+};
+
+// Syllable spellings to ids, looked up without building strings.
+class SyllableTable {
+public:
+  explicit SyllableTable(const std::unordered_map<std::string, int32_t> &ids) {
+    size_t capacity = 1;
+    while (capacity < 2 * ids.size()) {
+      capacity *= 2;
+    }
+    slots_.assign(capacity, -1);
+    for (const auto &item : ids) {
+      size_t slot = Hash(item.first.data(), item.first.size()) & (capacity - 1);
+      while (slots_[slot] != -1) {
+        slot = (slot + 1) & (capacity - 1);
+      }
+      slots_[slot] = entries_.size();
+      entries_.push_back(item);
+    }
+  }
+
+  // The id of the syllable spelled by the `size` bytes at `s`, -1 if none.
+  int32_t Find(const char *s, size_t size) const {
+    size_t mask = slots_.size() - 1;
+    for (size_t slot = Hash(s, size) & mask; slots_[slot] != -1;
+         slot = (slot + 1) & mask) {
+      const auto &entry = entries_[slots_[slot]];
+      if (entry.first.size() == size &&
+          std::memcmp(entry.first.data(), s, size) == 0) {
+        return entry.second;
+      }
+    }
+    return -1;
+  }
+
+private:
+  // FNV-1a.
+  static size_t Hash(const char *s, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i) {
+      hash = (hash ^ static_cast<uint8_t>(s[i])) * 1099511628211ull;
+    }
+    return hash;
+  }
+
+  std::vector<std::pair<std::string, int32_t>> entries_;
+  std::vector<int32_t> slots_;
+};
+
+// The entries of a part of a text dictionary, see PinyinEncoder::Build.
+struct VocabChunk {
+  // The keys, pointing into the text.
+  std::vector<const char *> keys;
+  std::vector<size_t> lengths;
+  std::vector<float> scores;
+  // The syllables of entry i are ids[j] for j in [offsets[i], offsets[i + 1]).
+  std::vector<uint32_t> offsets;
+  std::vector<uint16_t> ids;
+  int32_t max_key_len = 0;
+  // The first bad line, `unknown` the spelling that is not a syllable.
+  std::string bad_line;
+  bool has_bad_line = false;
+  std::string unknown;
+};
+
+// The texts parsed by a task are at least this long.
+constexpr size_t kMinVocabChunk = 64 << 10;
+
+// Parses the lines in [p, end) into `chunk`.
+void ParseVocabChunk(const char *p, const char *end, const SyllableTable &table,
+                     VocabChunk *chunk) {
+  chunk->offsets.assign(1, 0);
+  std::vector<int32_t> char_offsets;
+  while (p != end) {
+    const char *eol = static_cast<const char *>(std::memchr(p, '\n', end - p));
+    if (eol == nullptr) {
+      eol = end;
+    }
+    const char *line = p;
+    p = eol == end ? end : eol + 1;
+    // The next field of the line, nullptr at its end.
+    const char *q = line;
+    auto next_field = [&q, eol](const char **field_end) -> const char * {
+      while (q != eol && IsSpace(*q)) {
+        ++q;
+      }
+      if (q == eol) {
+        return nullptr;
+      }
+      const char *field = q;
+      while (q != eol && !IsSpace(*q)) {
+        ++q;
+      }
+      *field_end = q;
+      return field;
+    };
+    const char *key_end = nullptr;
+    const char *key = next_field(&key_end);
+    if (key == nullptr) {
+      // Blank lines are skipped.
+      continue;
+    }
+    const char *score_end = nullptr;
+    const char *score_begin = next_field(&score_end);
+    float score = 0;
+    bool valid =
+        score_begin != nullptr && ParseFloat(score_begin, score_end, &score);
+    int32_t num_values = 0;
+    const char *value_end = nullptr;
+    while (valid) {
+      const char *value = next_field(&value_end);
+      if (value == nullptr) {
+        break;
+      }
+      ++num_values;
+      // Both number tone and normal tone are stored as syllable ids
+      int32_t id = table.Find(value, value_end - value);
+      if (id == -1) {
+        chunk->unknown.assign(value, value_end);
+        break;
+      }
+      chunk->ids.push_back(id);
+    }
+    if (num_values == 0 || !chunk->unknown.empty()) {
+      chunk->bad_line.assign(line, eol);
+      chunk->has_bad_line = true;
+      return;
+    }
+    chunk->keys.push_back(key);
+    chunk->lengths.push_back(key_end - key);
+    chunk->scores.push_back(score);
+    chunk->offsets.push_back(chunk->ids.size());
+    SplitUtf8(key, key_end - key, &char_offsets);
+    chunk->max_key_len =
+        std::max<int32_t>(chunk->max_key_len, char_offsets.size() - 1);
   }
-  pool_ = std::make_unique<ThreadPool>(num_threads);
+}
+
+// Exits if `chunk` has a bad line.
+void CheckVocabChunk(const VocabChunk &chunk) {
+  CPY_ASSERT(chunk.unknown.empty(),
+             "PinyinEncoder: " << chunk.unknown
+                               << " is not in the NORMAL_TO_TONE map, line: "
+                               << chunk.bad_line);
+  if (chunk.has_bad_line) {
+    std::cerr << "Each line in vocab should contain at lease three items "
+                 "(seperate by space), "
+                 "the first one is Chinese word/character, the second one is "
+                 "score, the others are the corresponding pinyins given : "
+              << chunk.bad_line << std::endl;
+    exit(-1);
+  }
+}
+
+} // namespace
+
+Tone ParseTone(const std::string &tone) {
+  if (tone == "number") {
+    return Tone::kNumber;
+  } else if (tone == "normal") {
+    return Tone::kNormal;
+  }
+  CPY_ASSERT(tone == "none",
+             "tone should be one of 'number', 'none' and 'normal'");
+  return Tone::kNone;
+}
+
+template <typename T> void PinyinEncoder::Retire(const T *old) {
+  RcuSynchronize();
+  delete old;
+  // The cached results of the older versions are never found again.
+  ClearCache();
+}
+
+void PinyinEncoder::Init(std::shared_ptr<Executor> executor) {
+  executor_ = executor ? std::move(executor) : DefaultExecutor();
   tone_to_normal_.reserve(NORMAL_TO_TONE.size());
   for (const auto &item : NORMAL_TO_TONE) {
     tone_to_normal_[item.second] = item.first;
     auto value = RemoveNumberTone(item.second);
     no_tone_set_.insert(value);
   }
+  syllables_.reserve(NORMAL_TO_TONE.size());
+  for (const auto &item : NORMAL_TO_TONE) {
+    syllables_.push_back(item.second);
+  }
+  std::sort(syllables_.begin(), syllables_.end());
+  // Readings store syllable ids in 16 bits.
+  CPY_ASSERT(syllables_.size() <= std::numeric_limits<uint16_t>::max(),
+             "Too many syllables");
+  syllable_ids_.reserve(2 * syllables_.size());
+  for (size_t i = 0; i < syllables_.size(); ++i) {
+    syllable_ids_[syllables_[i]] = i;
+    syllable_ids_[tone_to_normal_.at(syllables_[i])] = i;
+  }
+  InitForms();
+  InitInventories();
+  // An empty model, until one is loaded.
+  auto model = std::make_shared<Model>();
+  model->reading_offset_storage.assign(1, 0);
+  model->UseStorage();
+  const Layers *old = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(layers_mutex_);
+    layer_entries_.push_back(Layer{"", 0, 0, std::move(model)});
+    old = PublishLayers();
+  }
+  Retire(old);
+}
+
+PinyinEncoder::~PinyinEncoder() {
+  delete layers_.load();
+  delete user_words_.load();
+}
+
+void PinyinEncoder::InitForms() {
+  const int32_t kNumber = static_cast<int32_t>(Tone::kNumber);
+  const int32_t kNormal = static_cast<int32_t>(Tone::kNormal);
+  const int32_t kNone = static_cast<int32_t>(Tone::kNone);
+  forms_.resize(syllables_.size());
+  for (size_t i = 0; i < syllables_.size(); ++i) {
+    const auto &number = syllables_[i];
+    const auto &normal = tone_to_normal_.at(number);
+    auto &forms = forms_[i];
+    forms.pinyin[kNumber] = number;
+    forms.pinyin[kNormal] = normal;
+    forms.pinyin[kNone] = RemoveTone(number);
+
+    forms.initial[kNumber] = GetInitial(number);
+    forms.final_t[kNumber] = number.substr(forms.initial[kNumber].size());
+    forms.initial[kNormal] = GetInitial(normal);
+    forms.final_t[kNormal] = normal.substr(forms.initial[kNormal].size());
+    forms.initial[kNone] = forms.initial[kNumber];
+    forms.final_t[kNone] = RemoveTone(forms.final_t[kNumber]);
+  }
+}
+
+void PinyinEncoder::InitInventories() {
+  const Tone tones[] = {Tone::kNumber, Tone::kNormal, Tone::kNone};
+  const std::string tone_names[] = {"number", "normal", "none"};
+  std::vector<std::string> pinyins;
+  auto find_id = [](const std::unordered_map<std::string, int32_t> &ids,
+                    const std::string &s) -> int32_t {
+    auto iter = ids.find(s);
+    return iter == ids.end() ? -1 : iter->second;
+  };
+  size_t num_initials = AllInitials().size();
+  for (int32_t t = 0; t < 3; ++t) {
+    for (int32_t p = 0; p < 2; ++p) {
+      inventories_[t][p] = AllPinyin(tone_names[t], p);
+      auto &ids = inventory_ids_[t][p];
+      ids.reserve(inventories_[t][p].size());
+      for (size_t i = 0; i < inventories_[t][p].size(); ++i) {
+        ids.emplace(inventories_[t][p][i], i);
+      }
+    }
+    // A string can be both an initial and a final, look them up separately.
+    const auto &partial_inventory = inventories_[t][1];
+    std::unordered_map<std::string, int32_t> initial_ids;
+    std::unordered_map<std::string, int32_t> final_ids;
+    for (size_t i = 0; i < partial_inventory.size(); ++i) {
+      if (i < num_initials) {
+        initial_ids.emplace(partial_inventory[i], i);
+      } else {
+        final_ids.emplace(partial_inventory[i], i);
+      }
+    }
+
+    syllable_to_id_[t].resize(syllables_.size());
+    syllable_to_partial_ids_[t].resize(syllables_.size());
+    for (size_t i = 0; i < syllables_.size(); ++i) {
+      pinyins.clear();
+      AppendPinyin(i, tones[t], false, &pinyins);
+      syllable_to_id_[t][i] = find_id(inventory_ids_[t][0], pinyins[0]);
+
+      pinyins.clear();
+      AppendPinyin(i, tones[t], true, &pinyins);
+      if (pinyins.size() == 2) {
+        syllable_to_partial_ids_[t][i] = std::make_pair(
+            find_id(initial_ids, pinyins[0]), find_id(final_ids, pinyins[1]));
+      } else {
+        syllable_to_partial_ids_[t][i] =
+            std::make_pair(kNoInitial, find_id(final_ids, pinyins[0]));
+      }
+    }
+  }
+}
+
+const std::vector<std::string> &
+PinyinEncoder::SyllableInventory(const std::string &tone /*=number*/,
+                                 bool partial /*=false*/) const {
+  return inventories_[static_cast<int32_t>(ParseTone(tone))][partial];
+}
+
+int32_t PinyinEncoder::PinyinToId(const std::string &s,
+                                  const std::string &tone /*=number*/,
+                                  bool partial /*=false*/) const {
+  const auto &ids =
+      inventory_ids_[static_cast<int32_t>(ParseTone(tone))][partial];
+  auto iter = ids.find(s);
+  return iter == ids.end() ? -1 : iter->second;
 }
 
 std::vector<std::string>
@@ -139,69 +585,351 @@ bool PinyinEncoder::ValidPinyin(const std::string &s,
   }
 }
 
-void PinyinEncoder::Build(std::istream &is) {
-  LoadVocab(is);
+void PinyinEncoder::Build(std::istream &is, Model *model) const {
+  MappedFile text(is);
+  Build(text.Data(), text.Size(), model);
+}
+
+void PinyinEncoder::Build(const char *text, size_t size, Model *model) const {
+  // Chunks of whole lines, a few per thread.
+  size_t concurrency = std::max<size_t>(executor_->Concurrency(), 1);
+  size_t chunk_size = std::max(kMinVocabChunk, size / (concurrency * 4));
+  std::vector<std::pair<const char *, const char *>> bounds;
+  const char *end = text + size;
+  for (const char *p = text; p != end;) {
+    const char *next = end;
+    if (static_cast<size_t>(end - p) > chunk_size) {
+      const char *eol = static_cast<const char *>(
+          std::memchr(p + chunk_size, '\n', end - p - chunk_size));
+      next = eol == nullptr ? end : eol + 1;
+    }
+    bounds.emplace_back(p, next);
+    p = next;
+  }
+  SyllableTable table(syllable_ids_);
+  std::vector<VocabChunk> chunks(bounds.size());
+  executor_->ParallelFor(0, chunks.size(), 1, [&](size_t first, size_t last) {
+    for (size_t c = first; c < last; ++c) {
+      ParseVocabChunk(bounds[c].first, bounds[c].second, table, &chunks[c]);
+    }
+  });
 
-  std::vector<const char *> keys(tokens_.size());
-  std::vector<size_t> length(tokens_.size());
-  std::vector<int32_t> values(tokens_.size());
+  // Concatenates the chunks, interning the readings.
+  model->score_storage.clear();
+  model->key_reading_storage.clear();
+  ReadingInterner interner(&model->reading_offset_storage,
+                           &model->reading_id_storage);
+  std::vector<const char *> keys;
+  std::vector<size_t> lengths;
+  model->max_key_len = 0;
+  for (const auto &chunk : chunks) {
+    CheckVocabChunk(chunk);
+    for (size_t i = 0; i < chunk.keys.size(); ++i) {
+      model->score_storage.push_back(chunk.scores[i]);
+      model->key_reading_storage.push_back(
+          interner.Add(chunk.ids.data() + chunk.offsets[i],
+                       chunk.offsets[i + 1] - chunk.offsets[i]));
+    }
+    keys.insert(keys.end(), chunk.keys.begin(), chunk.keys.end());
+    lengths.insert(lengths.end(), chunk.lengths.begin(), chunk.lengths.end());
+    model->max_key_len = std::max(model->max_key_len, chunk.max_key_len);
+  }
 
+  // Stable, so the first of duplicated keys is kept.
+  std::vector<int32_t> values(keys.size());
   std::iota(values.begin(), values.end(), 0);
+  ParallelStableSort(
+      &values,
+      [&keys, &lengths](int32_t i1, int32_t i2) {
+        int32_t c =
+            std::memcmp(keys[i1], keys[i2], std::min(lengths[i1], lengths[i2]));
+        return c != 0 ? c < 0 : lengths[i1] < lengths[i2];
+      },
+      executor_.get());
+  std::vector<const char *> sorted_keys(keys.size());
+  std::vector<size_t> sorted_lengths(keys.size());
+  for (size_t i = 0; i < values.size(); ++i) {
+    sorted_keys[i] = keys[values[i]];
+    sorted_lengths[i] = lengths[values[i]];
+  }
 
-  std::stable_sort(values.begin(), values.end(),
-                   [&tokens = tokens_](size_t i1, size_t i2) {
-                     return tokens[i1] < tokens[i2];
-                   });
+  // The indexes take distinct keys, the first of equal ones is kept.
+  size_t num_keys = 0;
+  for (size_t i = 0; i < values.size(); ++i) {
+    if (num_keys > 0 && sorted_lengths[num_keys - 1] == lengths[values[i]] &&
+        std::memcmp(sorted_keys[num_keys - 1], keys[values[i]],
+                    lengths[values[i]]) == 0) {
+      continue;
+    }
+    sorted_keys[num_keys] = keys[values[i]];
+    sorted_lengths[num_keys] = lengths[values[i]];
+    values[num_keys] = values[i];
+    num_keys += 1;
+  }
+  model->index = NewPhraseIndex(phrase_index_);
+  model->index->Build(num_keys, sorted_keys.data(), sorted_lengths.data(),
+                      values.data());
+  model->UseStorage();
+  model->InitByteTables();
+}
 
-  for (int32_t i = 0; i < values.size(); ++i) {
-    keys[i] = tokens_[values[i]].c_str();
-    length[i] = tokens_[values[i]].size();
+void PinyinEncoder::Model::UseStorage() {
+  scores = ArrayView<float>(score_storage);
+  key_readings = ArrayView<uint32_t>(key_reading_storage);
+  reading_offsets = ArrayView<uint32_t>(reading_offset_storage);
+  reading_ids = ArrayView<uint16_t>(reading_id_storage);
+  mapped.reset();
+}
+
+void PinyinEncoder::Model::InitByteTables() {
+  index->ByteTables(key_bytes, key_starts);
+  ascii_in_keys = std::any_of(key_bytes, key_bytes + 0x80,
+                              [](bool in_keys) { return in_keys; });
+}
+
+int32_t PinyinEncoder::SplitWord(const char *str, int32_t size,
+                                 const Snapshot &snapshot,
+                                 std::vector<int32_t> *offsets,
+                                 std::vector<int32_t> *codepoints) const {
+  const Layers &layers = *snapshot.layers;
+  const UserWords *user = snapshot.user;
+  auto in_keys = [&layers, user](uint8_t c) {
+    return layers.key_bytes[c] || (user != nullptr && user->key_bytes[c]);
+  };
+  bool ascii_in_keys =
+      layers.ascii_in_keys || (user != nullptr && user->ascii_in_keys);
+  bool decode = layers.codepoints;
+  offsets->clear();
+  codepoints->clear();
+  int32_t num_chars = 0;
+  int32_t i = 0;
+  while (i < size) {
+    offsets->push_back(i);
+    uint8_t c = static_cast<uint8_t>(str[i]);
+    if (c >= 0x80 || in_keys(c)) {
+      int32_t end = i + Utf8CharLen(str + i, size - i);
+      if (decode) {
+        codepoints->push_back(DecodeUtf8(str + i, end - i));
+      }
+      i = end;
+      num_chars += 1;
+      continue;
+    }
+    // A run of ASCII bytes used by no key is one unit.
+    int32_t end = i + 1;
+    if (!ascii_in_keys) {
+      end = i + AsciiPrefixLength(str + i, size - i);
+    } else {
+      while (end < size && static_cast<uint8_t>(str[end]) < 0x80 &&
+             !in_keys(static_cast<uint8_t>(str[end]))) {
+        ++end;
+      }
+    }
+    if (decode) {
+      codepoints->push_back(DecodeUtf8(str + i, end - i));
+    }
+    num_chars += end - i;
+    i = end;
   }
+  offsets->push_back(size);
+  return num_chars;
+}
 
-  da_.build(keys.size(), keys.data(), length.data(), values.data());
-  tokens_.clear();
+template <typename F>
+void PinyinEncoder::ParallelFor(size_t size, F &&f) const {
+  executor_->ParallelFor(0, size, BatchGrain(size, executor_->Concurrency()),
+                         [&f](size_t first, size_t last) {
+                           for (size_t i = first; i < last; ++i) {
+                             f(i);
+                           }
+                         });
 }
 
-void PinyinEncoder::GetDag(const std::string &str, DagType *dag) const {
-  dag->resize(str.size());
-  for (int32_t i = 0; i < str.size(); ++i) {
-    int32_t MAX_HIT = str.size() - i;
-    const char *query = str.data() + i;
-    std::vector<Darts::DoubleArray::result_pair_type> results(MAX_HIT);
-    std::size_t num_matches =
-        da_.commonPrefixSearch(query, results.data(), MAX_HIT);
-    std::vector<DagItem> items;
-    for (int32_t j = 0; j < num_matches; ++j) {
-      int32_t idx = results[j].value;
-      int32_t length = results[j].length;
-      items.push_back(std::make_tuple(scores_[idx], i + length, idx));
+template <typename F>
+void PinyinEncoder::ForEachWord(const char *str, int32_t size,
+                                const Snapshot &snapshot, EncodeWorkspace *ws,
+                                F &&f) const {
+  const char *end = str + size;
+  const char *p = str;
+  int32_t char_base = 0;
+  while (true) {
+    // Whitespaces are single byte characters.
+    const char *begin = p;
+    while (p != end && IsSpace(*p)) {
+      ++p;
     }
-    (*dag)[i] = items;
+    char_base += p - begin;
+    if (p == end) {
+      break;
+    }
+    begin = p;
+    while (p != end && !IsSpace(*p)) {
+      ++p;
+    }
+    int32_t num_chars = WordRoute(begin, p - begin, snapshot, ws);
+    f(begin, static_cast<int32_t>(begin - str), char_base);
+    char_base += num_chars;
   }
 }
 
-void PinyinEncoder::CalcDp(const std::string &str, const DagType &dag,
-                           std::vector<DagItem> *route) const {
-  route->resize(str.size() + 1);
-  (*route)[str.size()] = std::make_tuple(0.0, 0, 0);
-  for (int32_t i = str.size() - 1; i >= 0; i--) {
+template <typename F>
+void PinyinEncoder::ForEachMatch(const WordUnits &word, int32_t num_units,
+                                 const Snapshot &snapshot, int32_t i,
+                                 F &&f) const {
+  const auto &layers = snapshot.layers->layers;
+  const UserWords *user = snapshot.user;
+  uint8_t first = static_cast<uint8_t>(word.str[word.offsets[i]]);
+  // The tries with keys starting at unit i, by decreasing priority.
+  struct Walk {
+    const PhraseIndex *index;
+    int32_t tag;
+    int32_t max_end;
+  };
+  Walk walks[kMaxLayers + 1];
+  int32_t num_walks = 0;
+  auto start = [&](const PhraseIndex &index, const bool *key_starts,
+                   int32_t max_key_len, int32_t tag) {
+    if (!key_starts[first]) {
+      return;
+    }
+    int32_t end = num_units - i > max_key_len ? i + max_key_len : num_units;
+    walks[num_walks++] = Walk{&index, tag, end};
+  };
+  if (user != nullptr) {
+    start(user->index, user->key_starts, user->max_key_len, kUserWord);
+  }
+  for (std::size_t l = 0; l < layers.size(); ++l) {
+    const Model &model = *layers[l].model;
+    start(*model.index, model.key_starts, model.max_key_len,
+          static_cast<int32_t>(l) << kLayerShift);
+  }
+  // Keys are valid UTF-8, they only end on unit boundaries.
+  if (num_walks == 1) {
+    // Usually a single index has keys starting here.
+    int32_t tag = walks[0].tag;
+    auto report = [&f, tag](int32_t end, int32_t value) {
+      f(end, value | tag);
+    };
+    walks[0].index->ForEachPrefix(word, i, walks[0].max_end, report);
+    return;
+  }
+  // By end then priority, the first one at each end hiding the others.
+  struct Match {
+    int32_t end;
+    int32_t walk;
+    int32_t idx;
+  };
+  thread_local std::vector<Match> matches;
+  matches.clear();
+  for (int32_t w = 0; w < num_walks; ++w) {
+    auto add = [w, &walks](int32_t end, int32_t value) {
+      matches.push_back(Match{end, w, value | walks[w].tag});
+    };
+    walks[w].index->ForEachPrefix(word, i, walks[w].max_end, add);
+  }
+  std::sort(matches.begin(), matches.end(), [](const Match &a, const Match &b) {
+    return a.end != b.end ? a.end < b.end : a.walk < b.walk;
+  });
+  for (std::size_t m = 0; m < matches.size(); ++m) {
+    if (m == 0 || matches[m].end != matches[m - 1].end) {
+      f(matches[m].end, matches[m].idx);
+    }
+  }
+}
+
+void PinyinEncoder::CalcRoute(const char *str, const Snapshot &snapshot,
+                              EncodeWorkspace *ws) const {
+  const WordUnits word{str, ws->offsets.data(), ws->codepoints.data()};
+  auto &route = ws->route;
+  int32_t num_units = ws->offsets.size() - 1;
+  route.resize(num_units + 1);
+  route[num_units] = std::make_tuple(0.0, 0, 0);
+  // Right to left dynamic programming.
+  for (int32_t i = num_units - 1; i >= 0; i--) {
     float max_score = -std::numeric_limits<float>::infinity();
     int32_t max_idx = -1;
     int32_t index = 0;
-    for (const auto &item : dag[i]) {
-      float score =
-          std::get<0>(item) + std::get<0>((*route)[std::get<1>(item)]);
+    ForEachMatch(word, num_units, snapshot, i, [&](int32_t end, int32_t idx) {
+      float score = Score(snapshot, idx) + std::get<0>(route[end]);
       if (score > max_score) {
         max_score = score;
-        max_idx = std::get<1>(item);
-        index = std::get<2>(item);
-      } else if (score == max_score) {
-        if (max_idx >= std::get<1>(item)) {
-          max_idx = std::get<1>(item);
-          index = std::get<2>(item);
-        }
-      } else {
-        continue;
+        max_idx = end;
+        index = idx;
+      }
+    });
+    route[i] = std::make_tuple(
+        max_score == -std::numeric_limits<float>::infinity() ? 0 : max_score,
+        max_idx, index);
+  }
+}
+
+int32_t PinyinEncoder::WordRoute(const char *str, int32_t size,
+                                 const Snapshot &snapshot,
+                                 EncodeWorkspace *ws) const {
+  if (route_cache_ == nullptr) {
+    int32_t num_chars =
+        SplitWord(str, size, snapshot, &(ws->offsets), &(ws->codepoints));
+    CalcRoute(str, snapshot, ws);
+    return num_chars;
+  }
+  // The versions of the model and of the user words, then the word.
+  auto &key = ws->route_key;
+  AssignVersions(snapshot, &key);
+  key.append(str, size);
+  int32_t num_chars = 0;
+  bool hit = route_cache_->Lookup(key, [ws, &num_chars](const CachedRoute &r) {
+    ws->offsets.assign(r.offsets.begin(), r.offsets.end());
+    ws->route.assign(r.route.begin(), r.route.end());
+    num_chars = r.num_chars;
+  });
+  if (hit) {
+    return num_chars;
+  }
+  num_chars =
+      SplitWord(str, size, snapshot, &(ws->offsets), &(ws->codepoints));
+  CalcRoute(str, snapshot, ws);
+  CachedRoute value;
+  value.offsets = ws->offsets;
+  value.route = ws->route;
+  value.num_chars = num_chars;
+  size_t charge = sizeof(CachedRoute) + 2 * key.size() +
+                  value.offsets.size() * sizeof(int32_t) +
+                  value.route.size() * sizeof(RouteItem);
+  route_cache_->Insert(key, std::move(value), charge);
+  return num_chars;
+}
+
+void PinyinEncoder::MatchUnits(const WordUnits &word, int32_t num_units,
+                               const Snapshot &snapshot, int32_t begin,
+                               int32_t end, WordMatches *matches) const {
+  auto &keys = matches->keys;
+  for (int32_t i = begin; i < end; ++i) {
+    ForEachMatch(word, num_units, snapshot, i, [&keys](int32_t e, int32_t idx) {
+      keys.emplace_back(e, idx);
+    });
+    matches->begins.push_back(keys.size());
+  }
+}
+
+void PinyinEncoder::CalcRoute(const Snapshot &snapshot,
+                              const WordMatches &matches,
+                              std::vector<RouteItem> *route) const {
+  int32_t num_units = matches.begins.size() - 1;
+  route->resize(num_units + 1);
+  (*route)[num_units] = std::make_tuple(0.0, 0, 0);
+  // As the other CalcRoute, so that both choose the same keys.
+  for (int32_t i = num_units - 1; i >= 0; i--) {
+    float max_score = -std::numeric_limits<float>::infinity();
+    int32_t max_idx = -1;
+    int32_t index = 0;
+    for (int32_t j = matches.begins[i]; j < matches.begins[i + 1]; ++j) {
+      int32_t end = matches.keys[j].first;
+      int32_t idx = matches.keys[j].second;
+      float score = Score(snapshot, idx) + std::get<0>((*route)[end]);
+      if (score > max_score) {
+        max_score = score;
+        max_idx = end;
+        index = idx;
       }
     }
     (*route)[i] = std::make_tuple(
@@ -210,78 +938,219 @@ void PinyinEncoder::CalcDp(const std::string &str, const DagType &dag,
   }
 }
 
-void PinyinEncoder::Cut(const std::string &str,
-                        const std::vector<DagItem> &route,
-                        const std::string &tone, bool partial,
-                        std::vector<std::string> *ostrs,
-                        std::vector<std::string> *segs) const {
-  ostrs->clear();
-  segs->clear();
+int32_t PinyinEncoder::StablePrefix(const Snapshot &snapshot,
+                                    const std::vector<RouteItem> &route,
+                                    const WordMatches &matches,
+                                    std::vector<int32_t> *anchors) const {
+  int32_t num_units = matches.begins.size() - 1;
+  int32_t max_key_len = snapshot.layers->max_key_len;
+  if (snapshot.user != nullptr) {
+    max_key_len = std::max(max_key_len, snapshot.user->max_key_len);
+  }
+  if (max_key_len >= num_units) {
+    return 0;
+  }
+  // The keys starting before unit `fixed` end before the last unit.
+  int32_t fixed = num_units - max_key_len;
+  // route[i] scores as a constant plus route[anchor[i]]. The decision at a
+  // unit is stable when all its candidates share an anchor.
+  constexpr int32_t kFixed = -1;
+  constexpr int32_t kUnset = -2;
+  anchors->resize(num_units + 1);
+  std::vector<int32_t> &anchor = *anchors;
+  for (int32_t i = fixed; i <= num_units; ++i) {
+    anchor[i] = i;
+  }
+  for (int32_t i = fixed - 1; i >= 0; --i) {
+    if (std::get<1>(route[i]) == -1) {
+      anchor[i] = kFixed;
+      continue;
+    }
+    int32_t a = kUnset;
+    for (int32_t j = matches.begins[i]; j < matches.begins[i + 1]; ++j) {
+      int32_t end = matches.keys[j].first;
+      a = a == kUnset || a == anchor[end] ? anchor[end] : i;
+    }
+    anchor[i] = a;
+  }
+  // Follows the path from unit 0 while its decisions are stable.
+  int32_t pos = 0;
+  while (pos < fixed) {
+    int32_t next = std::get<1>(route[pos]);
+    if (next == -1) {
+      int32_t end = pos;
+      while (end < fixed && std::get<1>(route[end]) == -1) {
+        ++end;
+      }
+      if (end == fixed) {
+        break;
+      }
+      pos = end;
+      continue;
+    }
+    if (anchor[pos] == pos) {
+      break;
+    }
+    pos = next;
+  }
+  return pos;
+}
+
+void PinyinEncoder::CutWord(const char *str,
+                            const std::vector<int32_t> &offsets,
+                            const std::vector<RouteItem> &route,
+                            const Snapshot &snapshot,
+                            const EncodeOptions &options, int32_t base,
+                            std::vector<std::string> *ostrs,
+                            std::vector<Segment> *segs) const {
+  DispatchFormat(options.tone, options.partial, [&](auto tone, auto partial) {
+    this->Cut<decltype(tone)::value, decltype(partial)::value>(
+        str, offsets, route, snapshot, base, options.char_offset, ostrs,
+        segs);
+  });
+}
+
+template <Tone tone, bool partial>
+void PinyinEncoder::Cut(const char *str,
+                        const std::vector<int32_t> &offsets,
+                        const std::vector<RouteItem> &route,
+                        const Snapshot &snapshot, int32_t base,
+                        bool char_offset, std::vector<std::string> *ostrs,
+                        std::vector<Segment> *segs) const {
+  int32_t num_units = offsets.size() - 1;
+  // Appends the segment of units [begin, end).
+  auto add_segment = [&](int32_t begin, int32_t end, int32_t begin_char,
+                         int32_t end_char) {
+    int32_t token = ostrs->size();
+    if (char_offset) {
+      segs->push_back({base + begin_char, base + end_char, token});
+    } else {
+      segs->push_back({base + offsets[begin], base + offsets[end], token});
+    }
+  };
   int32_t i = 0;
-  int32_t fail_bytes = 0;
-  while (i < str.size()) {
-    int32_t next_index = std::get<1>(route[i]);
+  // The characters in [fail_begin, i) are emitted as they are.
+  int32_t fail_begin = 0;
+  // The number of characters before unit i and before unit fail_begin.
+  int32_t char_pos = 0;
+  int32_t fail_char = 0;
+  while (i <= num_units) {
+    int32_t next_index = i == num_units ? num_units : std::get<1>(route[i]);
     if (next_index == -1) {
-      fail_bytes += 1;
+      char_pos += UnitChars(str, offsets, i);
       i += 1;
-    } else {
-      if (fail_bytes != 0) {
-        ostrs->emplace_back(str.substr(i - fail_bytes, fail_bytes));
-        segs->emplace_back(str.substr(i - fail_bytes, fail_bytes));
-      }
-      fail_bytes = 0;
-      for (const auto &value : values_[std::get<2>(route[i])]) {
-        auto value_t = value;
-        if (tone == "normal") {
-          if (tone_to_normal_.find(value) != tone_to_normal_.end()) {
-            value_t = tone_to_normal_.at(value);
-          } else {
-            std::cerr << "PinyinEncoder: " << value
-                      << " is not in the NORMAL_TO_TONE map. " << std::endl;
-          }
-        }
-        if (partial) {
-          auto initial = GetInitial(value_t);
-          auto final_t = value_t.substr(initial.size());
-          if (tone == "none") {
-            final_t = RemoveTone(final_t);
-          }
-          if (!initial.empty()) {
-            ostrs->push_back(initial);
-          }
-          ostrs->push_back(final_t);
-        } else {
-          if (tone == "none") {
-            ostrs->push_back(RemoveTone(value_t));
-          } else {
-            ostrs->push_back(value_t);
-          }
-        }
+      continue;
+    }
+    if (fail_begin != i) {
+      if (segs != nullptr) {
+        add_segment(fail_begin, i, fail_char, char_pos);
       }
-      segs->emplace_back(str.substr(i, next_index - i));
-      i = next_index;
+      ostrs->emplace_back(str + offsets[fail_begin],
+                          offsets[i] - offsets[fail_begin]);
+    }
+    if (i == num_units) {
+      break;
+    }
+    if (segs != nullptr) {
+      add_segment(i, next_index, char_pos, char_pos + next_index - i);
     }
+    for (auto syllable : Reading(snapshot, std::get<2>(route[i]))) {
+      AppendPinyin<tone, partial>(syllable, ostrs);
+    }
+    // Dictionary words are made of single character units.
+    char_pos += next_index - i;
+    i = next_index;
+    fail_begin = i;
+    fail_char = char_pos;
   }
-  if (fail_bytes != 0) {
-    ostrs->emplace_back(str.substr(i - fail_bytes, fail_bytes));
-    segs->emplace_back(str.substr(i - fail_bytes, fail_bytes));
+}
+
+template <Tone tone, bool partial>
+void PinyinEncoder::AppendPinyin(int32_t syllable,
+                                 std::vector<std::string> *ostrs) const {
+  const int32_t t = static_cast<int32_t>(tone);
+  const auto &forms = forms_[syllable];
+  if (partial) {
+    if (!forms.initial[t].empty()) {
+      ostrs->push_back(forms.initial[t]);
+    }
+    ostrs->push_back(forms.final_t[t]);
+  } else {
+    ostrs->push_back(forms.pinyin[t]);
   }
 }
 
-void PinyinEncoder::EncodeBase(const std::string &str,
-                               std::vector<DagItem> *route) const {
-  DagType dag;
-  GetDag(str, &dag);
-  CalcDp(str, dag, route);
+void PinyinEncoder::AppendPinyin(int32_t syllable, Tone tone, bool partial,
+                                 std::vector<std::string> *ostrs) const {
+  DispatchFormat(tone, partial, [&](auto tone_t, auto partial_t) {
+    this->AppendPinyin<decltype(tone_t)::value, decltype(partial_t)::value>(
+        syllable, ostrs);
+  });
 }
 
-void PinyinEncoder::EncodeBase(const std::string &str,
-                               std::vector<std::string> *ostrs,
-                               const std::string &tone, bool partial,
-                               std::vector<std::string> *segs) const {
-  std::vector<DagItem> route;
-  EncodeBase(str, &route);
-  Cut(str, route, tone, partial, ostrs, segs);
+template <bool partial>
+void PinyinEncoder::CutIds(const char *str,
+                           const std::vector<int32_t> &offsets,
+                           const std::vector<RouteItem> &route,
+                           const Snapshot &snapshot, Tone tone, int32_t base,
+                           bool char_offset,
+                           std::vector<int32_t> *ids,
+                           std::vector<Segment> *segs) const {
+  int32_t num_units = offsets.size() - 1;
+  const auto &syllable_to_id = syllable_to_id_[static_cast<int32_t>(tone)];
+  const auto &syllable_to_partial_ids =
+      syllable_to_partial_ids_[static_cast<int32_t>(tone)];
+  auto add_segment = [&](int32_t begin, int32_t end, int32_t begin_char,
+                         int32_t end_char) {
+    int32_t token = ids->size();
+    if (char_offset) {
+      segs->push_back({base + begin_char, base + end_char, token});
+    } else {
+      segs->push_back({base + offsets[begin], base + offsets[end], token});
+    }
+  };
+  int32_t i = 0;
+  // A run of characters not covered by the dictionary is one token.
+  int32_t fail_begin = 0;
+  // The number of characters before unit i and before unit fail_begin.
+  int32_t char_pos = 0;
+  int32_t fail_char = 0;
+  while (i <= num_units) {
+    int32_t next_index = i == num_units ? num_units : std::get<1>(route[i]);
+    if (next_index == -1) {
+      char_pos += UnitChars(str, offsets, i);
+      i += 1;
+      continue;
+    }
+    if (fail_begin != i) {
+      if (segs != nullptr) {
+        add_segment(fail_begin, i, fail_char, char_pos);
+      }
+      ids->push_back(-1);
+    }
+    if (i == num_units) {
+      break;
+    }
+    if (segs != nullptr) {
+      add_segment(i, next_index, char_pos, char_pos + next_index - i);
+    }
+    for (auto syllable : Reading(snapshot, std::get<2>(route[i]))) {
+      if (partial) {
+        const auto &pair = syllable_to_partial_ids[syllable];
+        if (pair.first != kNoInitial) {
+          ids->push_back(pair.first);
+        }
+        ids->push_back(pair.second);
+      } else {
+        ids->push_back(syllable_to_id[syllable]);
+      }
+    }
+    // Dictionary words are made of single character units.
+    char_pos += next_index - i;
+    i = next_index;
+    fail_begin = i;
+    fail_char = char_pos;
+  }
 }
 
 void PinyinEncoder::Encode(const std::string &str,
@@ -289,30 +1158,122 @@ void PinyinEncoder::Encode(const std::string &str,
                            const std::string &tone /*=number*/,
                            bool partial /*=false*/,
                            std::vector<std::string> *segs /*=nullptr*/) const {
-  CPY_ASSERT(tone == "number" || tone == "none" || tone == "normal",
-             "tone should be one of 'number', 'none' and 'normal'");
-  ostrs->clear();
-  std::vector<std::string> substrs;
-  std::string word;
-  std::istringstream iss(str);
-  while (iss >> word) {
-    substrs.push_back(word);
+  Encode(str, nullptr, ostrs, tone, partial, segs);
+}
+
+void PinyinEncoder::Encode(const std::string &str, EncodeWorkspace *ws,
+                           std::vector<std::string> *ostrs,
+                           const std::string &tone /*=number*/,
+                           bool partial /*=false*/,
+                           std::vector<std::string> *segs /*=nullptr*/) const {
+  EncodeOptions options;
+  options.tone = ParseTone(tone);
+  options.partial = partial;
+  if (segs == nullptr) {
+    return Encode(str, options, ws, ostrs);
   }
-  std::vector<std::vector<std::string>> subostrs(substrs.size());
-  std::vector<std::vector<std::string>> subsegs(substrs.size());
-  for (int32_t i = 0; i < subostrs.size(); ++i) {
-    EncodeBase(substrs[i], &(subostrs[i]), tone, partial, &(subsegs[i]));
+  if (ws == nullptr) {
+    ws = &ThreadLocalWorkspace();
   }
+  Encode(str, options, ws, ostrs, &(ws->segments));
+  segs->clear();
+  for (const auto &seg : ws->segments) {
+    segs->emplace_back(str, seg.begin, seg.end - seg.begin);
+  }
+}
+
+void PinyinEncoder::Encode(const std::string &str,
+                           std::vector<std::string> *ostrs,
+                           std::vector<Segment> *segs,
+                           const std::string &tone /*=number*/,
+                           bool partial /*=false*/,
+                           bool char_offset /*=false*/) const {
+  Encode(str, nullptr, ostrs, segs, tone, partial, char_offset);
+}
 
-  for (int32_t i = 0; i < subostrs.size(); ++i) {
-    ostrs->insert(ostrs->end(), subostrs[i].begin(), subostrs[i].end());
+void PinyinEncoder::Encode(const std::string &str, EncodeWorkspace *ws,
+                           std::vector<std::string> *ostrs,
+                           std::vector<Segment> *segs,
+                           const std::string &tone /*=number*/,
+                           bool partial /*=false*/,
+                           bool char_offset /*=false*/) const {
+  EncodeOptions options;
+  options.tone = ParseTone(tone);
+  options.partial = partial;
+  options.char_offset = char_offset;
+  Encode(str, options, ws, ostrs, segs);
+}
+
+void PinyinEncoder::Encode(const std::string &str,
+                           const EncodeOptions &options, EncodeWorkspace *ws,
+                           std::vector<std::string> *ostrs,
+                           std::vector<Segment> *segs /*=nullptr*/) const {
+  Encode(str.data(), str.size(), options, ws, ostrs, segs);
+}
+
+void PinyinEncoder::Encode(const char *str, size_t size,
+                           const EncodeOptions &options, EncodeWorkspace *ws,
+                           std::vector<std::string> *ostrs,
+                           std::vector<Segment> *segs /*=nullptr*/) const {
+  if (ws == nullptr) {
+    ws = &ThreadLocalWorkspace();
+  }
+  RcuReadGuard guard;
+  Snapshot snapshot = CurrentSnapshot();
+  if (cache_ == nullptr) {
+    return EncodeUncached(str, size, options, snapshot, ws, ostrs, segs);
+  }
+  // The versions, the options and whether segments are wanted, the input.
+  auto &key = ws->cache_key;
+  AssignVersions(snapshot, &key);
+  key.push_back(static_cast<char>(options.tone));
+  key.push_back(options.partial);
+  key.push_back(segs == nullptr ? 0 : (options.char_offset ? 2 : 1));
+  key.append(str, size);
+  bool hit = cache_->Lookup(key, [ostrs, segs](const CachedEncode &value) {
+    ostrs->assign(value.tokens.begin(), value.tokens.end());
+    if (segs != nullptr) {
+      segs->assign(value.segments.begin(), value.segments.end());
+    }
+  });
+  if (hit) {
+    return;
+  }
+  EncodeUncached(str, size, options, snapshot, ws, ostrs, segs);
+  CachedEncode value;
+  value.tokens = *ostrs;
+  size_t charge = sizeof(CachedEncode) + 2 * key.size() +
+                  value.tokens.size() * sizeof(std::string);
+  for (const auto &token : value.tokens) {
+    charge += token.size();
+  }
+  if (segs != nullptr) {
+    value.segments = *segs;
+    charge += value.segments.size() * sizeof(Segment);
   }
+  cache_->Insert(key, std::move(value), charge);
+}
+
+void PinyinEncoder::EncodeUncached(const char *str, size_t size,
+                                   const EncodeOptions &options,
+                                   const Snapshot &snapshot,
+                                   EncodeWorkspace *ws,
+                                   std::vector<std::string> *ostrs,
+                                   std::vector<Segment> *segs) const {
+  ostrs->clear();
   if (segs != nullptr) {
     segs->clear();
-    for (int32_t i = 0; i < subsegs.size(); ++i) {
-      segs->insert(segs->end(), subsegs[i].begin(), subsegs[i].end());
-    }
   }
+  bool char_offset = options.char_offset;
+  DispatchFormat(options.tone, options.partial, [&](auto tone, auto partial) {
+    ForEachWord(str, size, snapshot, ws,
+                [&](const char *word, int32_t byte_base, int32_t char_base) {
+                  this->Cut<decltype(tone)::value, decltype(partial)::value>(
+                      word, ws->offsets, ws->route, snapshot,
+                      char_offset ? char_base : byte_base, char_offset, ostrs,
+                      segs);
+                });
+  });
 }
 
 void PinyinEncoder::Encode(
@@ -320,65 +1281,86 @@ void PinyinEncoder::Encode(
     std::vector<std::vector<std::string>> *ostrs,
     const std::string &tone /*=number*/, bool partial /*=false*/,
     std::vector<std::vector<std::string>> *segs /*=nullptr*/) const {
-  CPY_ASSERT(tone == "number" || tone == "none" || tone == "normal",
-             "tone should be one of 'number', 'none' and 'normal'");
+  ParseTone(tone);
   ostrs->resize(strs.size());
   if (segs != nullptr) {
     segs->resize(strs.size());
   }
-  std::vector<std::future<void>> results;
-  for (int32_t i = 0; i < strs.size(); ++i) {
-    results.emplace_back(pool_->enqueue([this, i, &strs, ostrs, tone, partial,
-                                         segs] {
-      if (segs != nullptr) {
-        return this->Encode(strs[i], &((*ostrs)[i]), tone, partial,
-                            &((*segs)[i]));
-      } else {
-        return this->Encode(strs[i], &((*ostrs)[i]), tone, partial, nullptr);
-      }
-    }));
+  ParallelFor(strs.size(),
+              [this, &strs, ostrs, &tone, partial, segs](size_t i) {
+                this->Encode(strs[i], &((*ostrs)[i]), tone, partial,
+                             segs != nullptr ? &((*segs)[i]) : nullptr);
+              });
+}
+
+void PinyinEncoder::EncodeIds(const std::string &str,
+                              std::vector<int32_t> *ids,
+                              const std::string &tone /*=number*/,
+                              bool partial /*=false*/,
+                              std::vector<Segment> *segs /*=nullptr*/,
+                              bool char_offset /*=false*/) const {
+  EncodeIds(str, nullptr, ids, tone, partial, segs, char_offset);
+}
+
+void PinyinEncoder::EncodeIds(const std::string &str, EncodeWorkspace *ws,
+                              std::vector<int32_t> *ids,
+                              const std::string &tone /*=number*/,
+                              bool partial /*=false*/,
+                              std::vector<Segment> *segs /*=nullptr*/,
+                              bool char_offset /*=false*/) const {
+  EncodeOptions options;
+  options.tone = ParseTone(tone);
+  options.partial = partial;
+  options.char_offset = char_offset;
+  EncodeIds(str, options, ws, ids, segs);
+}
+
+void PinyinEncoder::EncodeIds(const std::string &str,
+                              const EncodeOptions &options,
+                              EncodeWorkspace *ws, std::vector<int32_t> *ids,
+                              std::vector<Segment> *segs /*=nullptr*/) const {
+  EncodeIds(str.data(), str.size(), options, ws, ids, segs);
+}
+
+void PinyinEncoder::EncodeIds(const char *str, size_t size,
+                              const EncodeOptions &options,
+                              EncodeWorkspace *ws, std::vector<int32_t> *ids,
+                              std::vector<Segment> *segs /*=nullptr*/) const {
+  if (ws == nullptr) {
+    ws = &ThreadLocalWorkspace();
   }
-  for (auto &&result : results) {
-    result.get();
+  ids->clear();
+  if (segs != nullptr) {
+    segs->clear();
   }
+  RcuReadGuard guard;
+  Snapshot snapshot = CurrentSnapshot();
+  Tone tone = options.tone;
+  bool char_offset = options.char_offset;
+  ForEachWord(str, size, snapshot, ws,
+              [&](const char *word, int32_t byte_base, int32_t char_base) {
+                int32_t base = char_offset ? char_base : byte_base;
+                if (options.partial) {
+                  CutIds<true>(word, ws->offsets, ws->route, snapshot, tone,
+                               base, char_offset, ids, segs);
+                } else {
+                  CutIds<false>(word, ws->offsets, ws->route, snapshot, tone,
+                                base, char_offset, ids, segs);
+                }
+              });
 }
 
-void PinyinEncoder::LoadVocab(std::istream &is) {
-  tokens_.clear();
-  scores_.clear();
-  values_.clear();
-  std::string line;
-  std::string token;
-  std::string value;
-  float score;
-  while (std::getline(is, line)) {
-    std::istringstream iss(line);
-    iss >> token >> score;
-    tokens_.push_back(token);
-    scores_.push_back(score);
-    std::vector<std::string> values;
-    while (iss >> value) {
-      // Always convert to tone in internal
-      if (!std::isdigit(value.back())) {
-        if (NORMAL_TO_TONE.find(value) == NORMAL_TO_TONE.end()) {
-          std::cerr << "PinyinEncoder: " << value
-                    << " is not in the NORMAL_TO_TONE map. " << std::endl;
-        } else {
-          value = NORMAL_TO_TONE.at(value);
-        }
-      }
-      values.push_back(value);
-    }
-    if (values.empty()) {
-      std::cerr << "Each line in vocab should contain at lease three items "
-                   "(seperate by space), "
-                   "the first one is Chinese word/character, the second one is "
-                   "score, the others are the corresponding pinyins given : "
-                << line.c_str() << std::endl;
-      exit(-1);
-    }
-    values_.emplace_back(std::move(values));
-  }
+void PinyinEncoder::EncodeIds(const std::vector<std::string> &strs,
+                              std::vector<std::vector<int32_t>> *ids,
+                              const std::string &tone /*=number*/,
+                              bool partial /*=false*/) const {
+  EncodeOptions options;
+  options.tone = ParseTone(tone);
+  options.partial = partial;
+  ids->resize(strs.size());
+  ParallelFor(strs.size(), [this, &strs, ids, &options](size_t i) {
+    this->EncodeIds(strs[i], options, nullptr, &((*ids)[i]));
+  });
 }
 
 std::string PinyinEncoder::GetInitial(const std::string &s) const {
@@ -449,143 +1431,614 @@ std::string PinyinEncoder::ToInitial(const std::string &s) const {
   if (s.empty()) {
     return s;
   }
-  if (tone_to_normal_.count(s) == 0 && NORMAL_TO_TONE.count(s) == 0) {
+  auto iter = syllable_ids_.find(s);
+  if (iter == syllable_ids_.end()) {
     std::cerr << "ToInitial: " << s << " is not a valid pinyin. " << std::endl;
     return std::string();
   }
-  return GetInitial(s);
+  int32_t id = iter->second;
+  // The initial of some syllables depends on the form, e.g. m1 and m̄.
+  Tone tone = syllables_[id] == s ? Tone::kNumber : Tone::kNormal;
+  return forms_[id].initial[static_cast<int32_t>(tone)];
 }
 
 void PinyinEncoder::ToInitials(const std::vector<std::string> &strs,
                                std::vector<std::string> *ostrs) const {
-  ostrs->clear();
-  for (const auto &s : strs) {
-    ostrs->push_back(ToInitial(s));
-  }
+  ostrs->resize(strs.size());
+  ParallelFor(strs.size(), [this, &strs, ostrs](size_t i) {
+    (*ostrs)[i] = this->ToInitial(strs[i]);
+  });
 }
 
 std::string PinyinEncoder::ToFinal(const std::string &s,
                                    const std::string &tone /*=number*/) const {
-  CPY_ASSERT(tone == "number" || tone == "none" || tone == "normal",
-             "tone should be one of 'number', 'none' and 'normal'");
+  return ToFinal(s, ParseTone(tone));
+}
+
+std::string PinyinEncoder::ToFinal(const std::string &s, Tone tone) const {
   if (s.empty()) {
     return s;
   }
-  std::string value;
-  if (tone_to_normal_.find(s) != tone_to_normal_.end()) {
-    value = s;
-  } else if (NORMAL_TO_TONE.find(s) != NORMAL_TO_TONE.end()) {
-    value = NORMAL_TO_TONE.at(s);
-  } else {
+  auto iter = syllable_ids_.find(s);
+  if (iter == syllable_ids_.end()) {
     std::cerr << "ToFinal: " << s << " is not a valid pinyin. " << std::endl;
     return std::string();
   }
-  if (tone == "none") {
-    value = RemoveTone(value);
-  } else if (tone == "normal") {
-    value = tone_to_normal_.at(value);
-  } else {
-    // tone == "number"
-    // Do nothing, value is already in number tone
-  }
-  auto initial = GetInitial(value);
-  auto final_t = value.substr(initial.size());
-  return final_t;
+  return forms_[iter->second].final_t[static_cast<int32_t>(tone)];
 }
 
 void PinyinEncoder::ToFinals(const std::vector<std::string> &strs,
                              std::vector<std::string> *ostrs,
                              const std::string &tone /*=number*/
 ) const {
-  CPY_ASSERT(tone == "number" || tone == "none" || tone == "normal",
-             "tone should be one of 'number', 'none' and 'normal'");
-  ostrs->clear();
-  for (const auto &s : strs) {
-    ostrs->push_back(ToFinal(s, tone));
-  }
-}
-
-size_t PinyinEncoder::SaveValues(const std::string &model_path) const {
-  std::ofstream of(model_path, std::ofstream::binary);
-  size_t offset = 0;
-
-  // Write header
-  offset += WriteHeader(of);
-
-  // Save scores_
-  offset += WriteUint32(of, scores_.size());
-  for (const auto score : scores_) {
-    offset += WriteFloat(of, score);
-  }
-  // Save values_
-  offset += WriteUint32(of, values_.size());
-  for (const auto &value : values_) {
-    offset += WriteUint32(of, value.size());
-    for (const auto &v : value) {
-      offset += WriteString(of, v);
-    }
-  }
-  of.close();
-  return offset;
+  Tone tone_t = ParseTone(tone);
+  ostrs->resize(strs.size());
+  ParallelFor(strs.size(), [this, &strs, ostrs, tone_t](size_t i) {
+    (*ostrs)[i] = this->ToFinal(strs[i], tone_t);
+  });
 }
 
-size_t PinyinEncoder::LoadValues(std::istream &ifile) {
+size_t PinyinEncoder::LoadValues(std::istream &ifile, Model *model) const {
   size_t offset = 0;
   uint32_t size;
 
-  // Load scores_
+  // Load the scores
   offset += ReadUint32(ifile, &size);
-  scores_.resize(size);
+  model->score_storage.resize(size);
   for (uint32_t i = 0; i < size; ++i) {
-    offset += ReadFloat(ifile, &(scores_[i]));
+    offset += ReadFloat(ifile, &(model->score_storage[i]));
   }
 
-  // Load values_
+  // Load the readings
   offset += ReadUint32(ifile, &size);
-  values_.resize(size);
+  model->key_reading_storage.resize(size);
+  ReadingInterner interner(&model->reading_offset_storage,
+                           &model->reading_id_storage);
+  std::vector<uint16_t> reading;
   uint32_t sub_size;
   std::string value;
   for (uint32_t i = 0; i < size; ++i) {
     offset += ReadUint32(ifile, &sub_size);
-    values_[i].resize(sub_size);
+    reading.clear();
     for (uint32_t j = 0; j < sub_size; ++j) {
       offset += ReadString(ifile, &value);
-      // Always convert to number tone in internal
-      if (!std::isdigit(value.back())) {
-        if (NORMAL_TO_TONE.find(value) == NORMAL_TO_TONE.end()) {
-          std::cerr << "PinyinEncoder: " << value
-                    << " is not in the NORMAL_TO_TONE map. " << std::endl;
-        } else {
-          value = NORMAL_TO_TONE.at(value);
-        }
-      }
-      values_[i][j] = value;
+      // Both number tone and normal tone are stored as syllable ids
+      auto iter = syllable_ids_.find(value);
+      CPY_ASSERT(iter != syllable_ids_.end(),
+                 "PinyinEncoder: " << value
+                                   << " is not in the NORMAL_TO_TONE map.");
+      reading.push_back(iter->second);
     }
+    model->key_reading_storage[i] =
+        interner.Add(reading.data(), reading.size());
   }
   return offset;
 }
 
-void PinyinEncoder::Load(const std::string &model_path) {
-  std::ifstream ifile(model_path, std::ifstream::binary);
-  Load(ifile);
+void PinyinEncoder::EnableCache(size_t capacity, int32_t num_shards /*=16*/) {
+  if (capacity == 0) {
+    cache_.reset();
+  } else {
+    cache_ = std::make_unique<ShardedLruCache<CachedEncode>>(capacity,
+                                                             num_shards);
+  }
+}
+
+CacheStats PinyinEncoder::GetCacheStats() const {
+  return cache_ == nullptr ? CacheStats() : cache_->Stats();
+}
+
+void PinyinEncoder::EnableRouteCache(size_t capacity,
+                                     int32_t num_shards /*=16*/) {
+  if (capacity == 0) {
+    route_cache_.reset();
+  } else {
+    route_cache_ =
+        std::make_unique<ShardedLruCache<CachedRoute>>(capacity, num_shards);
+  }
+}
+
+CacheStats PinyinEncoder::GetRouteCacheStats() const {
+  return route_cache_ == nullptr ? CacheStats() : route_cache_->Stats();
+}
+
+void PinyinEncoder::ClearCache() {
+  if (cache_ != nullptr) {
+    cache_->Clear();
+  }
+  if (route_cache_ != nullptr) {
+    route_cache_->Clear();
+  }
+}
+
+bool PinyinEncoder::AddUserWord(const std::string &word, float score,
+                                const std::vector<std::string> &pinyins) {
+  if (word.empty() || pinyins.empty() ||
+      std::any_of(word.begin(), word.end(), IsSpace)) {
+    return false;
+  }
+  UserEntry entry;
+  entry.score = score;
+  for (const auto &pinyin : pinyins) {
+    auto iter = syllable_ids_.find(pinyin);
+    if (iter == syllable_ids_.end()) {
+      return false;
+    }
+    entry.syllables.push_back(iter->second);
+  }
+  const UserWords *old = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(user_mutex_);
+    user_entries_[word] = std::move(entry);
+    old = PublishUserWords();
+  }
+  Retire(old);
+  return true;
+}
+
+void PinyinEncoder::LoadUserWords(const std::string &path) {
+  MappedFile text(path);
+  VocabChunk chunk;
+  ParseVocabChunk(text.Data(), text.Data() + text.Size(),
+                  SyllableTable(syllable_ids_), &chunk);
+  CheckVocabChunk(chunk);
+  const UserWords *old = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(user_mutex_);
+    for (size_t i = 0; i < chunk.keys.size(); ++i) {
+      UserEntry &entry =
+          user_entries_[std::string(chunk.keys[i], chunk.lengths[i])];
+      entry.score = chunk.scores[i];
+      entry.syllables.assign(chunk.ids.begin() + chunk.offsets[i],
+                             chunk.ids.begin() + chunk.offsets[i + 1]);
+    }
+    old = PublishUserWords();
+  }
+  Retire(old);
+}
+
+bool PinyinEncoder::RemoveUserWord(const std::string &word) {
+  const UserWords *old = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(user_mutex_);
+    if (user_entries_.erase(word) == 0) {
+      return false;
+    }
+    old = PublishUserWords();
+  }
+  Retire(old);
+  return true;
+}
+
+void PinyinEncoder::ClearUserWords() {
+  const UserWords *old = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(user_mutex_);
+    user_entries_.clear();
+    old = PublishUserWords();
+  }
+  Retire(old);
+}
+
+size_t PinyinEncoder::NumUserWords() const {
+  std::lock_guard<std::mutex> lock(user_mutex_);
+  return user_entries_.size();
+}
+
+const PinyinEncoder::UserWords *PinyinEncoder::PublishUserWords() {
+  std::unique_ptr<UserWords> words;
+  if (!user_entries_.empty()) {
+    words = std::make_unique<UserWords>();
+    words->version = ++user_version_;
+    std::vector<const char *> keys;
+    std::vector<size_t> lengths;
+    std::vector<int32_t> values;
+    std::vector<int32_t> char_offsets;
+    words->reading_offsets.assign(1, 0);
+    // std::map iterates in the byte order the double array takes.
+    for (const auto &item : user_entries_) {
+      values.push_back(keys.size());
+      keys.push_back(item.first.data());
+      lengths.push_back(item.first.size());
+      words->scores.push_back(item.second.score);
+      words->reading_ids.insert(words->reading_ids.end(),
+                                item.second.syllables.begin(),
+                                item.second.syllables.end());
+      words->reading_offsets.push_back(words->reading_ids.size());
+      SplitUtf8(item.first.data(), item.first.size(), &char_offsets);
+      words->max_key_len =
+          std::max<int32_t>(words->max_key_len, char_offsets.size() - 1);
+    }
+    words->index.Build(keys.size(), keys.data(), lengths.data(),
+                       values.data());
+    words->index.ByteTables(words->key_bytes, words->key_starts);
+    words->ascii_in_keys =
+        std::any_of(words->key_bytes, words->key_bytes + 0x80,
+                    [](bool in_keys) { return in_keys; });
+  }
+  return user_words_.exchange(words.release());
+}
+
+bool PinyinEncoder::SetPhraseIndex(const std::string &name) {
+  if (NewPhraseIndex(name) == nullptr) {
+    return false;
+  }
+  phrase_index_ = name;
+  return true;
+}
+
+bool PinyinEncoder::AddLayer(const std::string &name, const std::string &path,
+                             int32_t priority, float score_offset /*=0*/,
+                             bool verify_checksums /*=true*/) {
+  if (name.empty()) {
+    return false;
+  }
+  // Read before taking the lock.
+  auto model = std::make_shared<Model>();
+  ReadModel(path, verify_checksums, model.get());
+  const Layers *old = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(layers_mutex_);
+    // A replaced layer counts as added last.
+    auto has_name = [&](const Layer &layer) { return layer.name == name; };
+    auto it =
+        std::find_if(layer_entries_.begin(), layer_entries_.end(), has_name);
+    if (it != layer_entries_.end()) {
+      layer_entries_.erase(it);
+    }
+    layer_entries_.push_back(
+        Layer{name, priority, score_offset, std::move(model)});
+    old = PublishLayers();
+  }
+  Retire(old);
+  return true;
+}
+
+bool PinyinEncoder::RemoveLayer(const std::string &name) {
+  const Layers *old = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(layers_mutex_);
+    auto has_name = [&](const Layer &layer) { return layer.name == name; };
+    auto it = std::find_if(layer_entries_.begin() + 1, layer_entries_.end(),
+                           has_name);
+    if (it == layer_entries_.end()) {
+      return false;
+    }
+    layer_entries_.erase(it);
+    old = PublishLayers();
+  }
+  Retire(old);
+  return true;
+}
+
+void PinyinEncoder::ClearLayers() {
+  const Layers *old = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(layers_mutex_);
+    layer_entries_.resize(1);
+    old = PublishLayers();
+  }
+  Retire(old);
+}
+
+size_t PinyinEncoder::NumLayers() const {
+  std::lock_guard<std::mutex> lock(layers_mutex_);
+  return layer_entries_.size() - 1;
+}
+
+const PinyinEncoder::Layers *PinyinEncoder::PublishLayers() {
+  CPY_ASSERT(layer_entries_.size() <= kMaxLayers, "Too many layers");
+  auto layers = std::make_unique<Layers>();
+  layers->version = ++layers_version_;
+  // Later added first among equal priorities.
+  layers->layers.assign(layer_entries_.rbegin(), layer_entries_.rend());
+  std::stable_sort(layers->layers.begin(), layers->layers.end(),
+                   [](const Layer &a, const Layer &b) {
+                     return a.priority > b.priority;
+                   });
+  for (std::size_t l = 0; l < layers->layers.size(); ++l) {
+    const Model &model = *layers->layers[l].model;
+    CPY_ASSERT(model.scores.size() <= static_cast<std::size_t>(kKeyMask) + 1,
+               "Too many keys in a layer");
+    if (layers->layers[l].name.empty()) {
+      layers->base = l;
+    }
+    layers->max_key_len = std::max(layers->max_key_len, model.max_key_len);
+    for (int32_t c = 0; c < 256; ++c) {
+      layers->key_bytes[c] = layers->key_bytes[c] || model.key_bytes[c];
+    }
+    layers->ascii_in_keys = layers->ascii_in_keys || model.ascii_in_keys;
+    // The empty model of Init has no index.
+    if (model.index != nullptr && model.index->UsesCodepoints()) {
+      layers->codepoints = true;
+    }
+  }
+  return layers_.exchange(layers.release());
+}
+
+void PinyinEncoder::Publish(std::unique_ptr<Model> model) {
+  const Layers *old = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(layers_mutex_);
+    layer_entries_[0].model = std::move(model);
+    old = PublishLayers();
+  }
+  Retire(old);
+}
+
+void PinyinEncoder::Load(const std::string &model_path,
+                         bool verify_checksums /*=true*/) {
+  auto model = std::make_unique<Model>();
+  ReadModel(model_path, verify_checksums, model.get());
+  Publish(std::move(model));
 }
 
 void PinyinEncoder::Load(std::istream &is) {
+  auto model = std::make_unique<Model>();
+  ReadModel(is, model.get());
+  Publish(std::move(model));
+}
+
+void PinyinEncoder::ReadModel(const std::string &model_path,
+                              bool verify_checksums, Model *model) const {
+  std::string value;
+  {
+    std::ifstream ifile(model_path, std::ifstream::binary);
+    ReadHeader(ifile, &value);
+  }
+  if (value == HEADER_V2) {
+    return LoadMapped(std::make_unique<MappedFile>(model_path),
+                      verify_checksums, model);
+  }
+  std::ifstream ifile(model_path, std::ifstream::binary);
+  if (value != HEADER && ifile.is_open()) {
+    // A text dictionary, parsed from the mapped file.
+    MappedFile text(model_path);
+    return Build(text.Data(), text.Size(), model);
+  }
+  ReadModel(ifile, model);
+}
+
+void PinyinEncoder::ReadModel(std::istream &is, Model *model) const {
   std::string value;
   ReadHeader(is, &value);
 
+  if (value == HEADER_V2) {
+    is.clear();
+    is.seekg(0, std::ios::beg);
+    return LoadMapped(std::make_unique<MappedFile>(is), true, model);
+  }
+
   if (HEADER != value) {
+    is.clear();
     is.seekg(0, std::ios::beg);
-    return Build(is);
+    return Build(is, model);
   }
 
-  size_t offset = LoadValues(is) + value.size();
-  da_.open(is, offset);
+  size_t offset = LoadValues(is, model) + value.size();
+  auto index = std::make_unique<DartsPhraseIndex>();
+  index->darts().open(is, offset);
+  model->index = std::move(index);
+  model->UseStorage();
+  model->InitByteTables();
+}
+
+void PinyinEncoder::LoadMapped(std::unique_ptr<MappedFile> file,
+                               bool verify_checksums, Model *model) const {
+  const char *data = file->Data();
+  size_t size = file->Size();
+  ModelHeader header;
+  CPY_ASSERT(size >= sizeof(header), "Truncated model");
+  std::memcpy(&header, data, sizeof(header));
+  CPY_ASSERT(header.byte_order == kByteOrderMark,
+             "The model was saved on a machine of another byte order");
+  CPY_ASSERT(header.version == kFormatVersion,
+             "Unsupported model version " << header.version);
+  CPY_ASSERT(header.num_sections <=
+                 (size - sizeof(header)) / sizeof(SectionEntry),
+             "Truncated model");
+  std::vector<SectionEntry> directory(header.num_sections);
+  std::memcpy(directory.data(), data + sizeof(header),
+              directory.size() * sizeof(SectionEntry));
+  CPY_ASSERT(Crc32c(data + sizeof(header),
+                    directory.size() * sizeof(SectionEntry)) ==
+                 header.directory_crc,
+             "Checksum mismatch in the section directory");
+
+  ArrayView<char> sections[kNumSectionIds];
+  for (const auto &entry : directory) {
+    CPY_ASSERT(entry.offset % kSectionAlignment == 0 && entry.offset <= size &&
+                   entry.size <= size - entry.offset,
+               "Truncated model");
+    if (entry.id == 0 || entry.id >= kNumSectionIds) {
+      continue;
+    }
+    const char *p = data + entry.offset;
+    // The small sections are always checked, the others on request.
+    if (verify_checksums || entry.id == kMetadataSection ||
+        entry.id == kSyllablesSection) {
+      CPY_ASSERT(Crc32c(p, entry.size) == entry.crc,
+                 "Checksum mismatch in section " << entry.id);
+    }
+    sections[entry.id] = ArrayView<char>(p, entry.size);
+  }
+  for (uint32_t id = kMetadataSection; id < kUnitsSection; ++id) {
+    CPY_ASSERT(sections[id].data() != nullptr, "Missing section " << id);
+  }
+  CPY_ASSERT(sections[kUnitsSection].data() != nullptr ||
+                 (sections[kIndexNameSection].data() != nullptr &&
+                  sections[kIndexSection].data() != nullptr),
+             "Missing section " << kUnitsSection);
+  // The number of elements of `element_size` bytes in section `id`.
+  auto count = [&sections](SectionId id, size_t element_size) {
+    CPY_ASSERT(sections[id].size() % element_size == 0,
+               "Invalid size of section " << id);
+    return sections[id].size() / element_size;
+  };
+
+  ModelMetadata metadata;
+  CPY_ASSERT(sections[kMetadataSection].size() >= sizeof(metadata),
+             "Invalid size of section " << kMetadataSection);
+  std::memcpy(&metadata, sections[kMetadataSection].data(), sizeof(metadata));
+  uint32_t num_keys = metadata.num_keys;
+  uint32_t num_syllables = metadata.num_syllables;
+  CPY_ASSERT(count(kScoresSection, sizeof(float)) == num_keys &&
+                 count(kKeyReadingsSection, sizeof(uint32_t)) == num_keys,
+             "The model does not have a score and a reading per key");
+  size_t num_readings = count(kReadingOffsetsSection, sizeof(uint32_t));
+  CPY_ASSERT(num_readings > 0, "Invalid reading offsets");
+  num_readings -= 1;
+
+  model->scores = ArrayView<float>(
+      reinterpret_cast<const float *>(sections[kScoresSection].data()),
+      num_keys);
+  model->key_readings = ArrayView<uint32_t>(
+      reinterpret_cast<const uint32_t *>(sections[kKeyReadingsSection].data()),
+      num_keys);
+  model->reading_offsets = ArrayView<uint32_t>(
+      reinterpret_cast<const uint32_t *>(
+          sections[kReadingOffsetsSection].data()),
+      num_readings + 1);
+  model->reading_ids = ArrayView<uint16_t>(
+      reinterpret_cast<const uint16_t *>(sections[kReadingIdsSection].data()),
+      count(kReadingIdsSection, sizeof(uint16_t)));
+  // Checked whether or not the checksums are.
+  for (uint32_t k = 0; k < num_keys; ++k) {
+    CPY_ASSERT(model->key_readings[k] < num_readings, "Invalid key readings");
+  }
+  for (size_t r = 0; r < num_readings; ++r) {
+    CPY_ASSERT(model->reading_offsets[r] <= model->reading_offsets[r + 1],
+               "Invalid reading offsets");
+  }
+  CPY_ASSERT(model->reading_offsets[num_readings] <=
+                 model->reading_ids.size(),
+             "Invalid reading offsets");
+  for (uint16_t id : model->reading_ids) {
+    CPY_ASSERT(id < num_syllables, "Invalid syllable id");
+  }
+
+  // Mapped to the ids of this encoder unless it has the same syllables.
+  std::vector<std::string> saved_syllables;
+  std::vector<int32_t> id_map;
+  bool same_syllables = num_syllables == syllables_.size();
+  const char *p = sections[kSyllablesSection].begin();
+  const char *end = sections[kSyllablesSection].end();
+  for (uint32_t i = 0; i < num_syllables; ++i) {
+    const char *nul = static_cast<const char *>(std::memchr(p, '\0', end - p));
+    CPY_ASSERT(nul != nullptr, "Truncated syllables");
+    std::string syllable(p, nul);
+    p = nul + 1;
+    same_syllables = same_syllables && syllables_[i] == syllable;
+    auto iter = syllable_ids_.find(syllable);
+    id_map.push_back(iter == syllable_ids_.end() ? -1 : iter->second);
+    saved_syllables.push_back(std::move(syllable));
+  }
+  if (!same_syllables) {
+    auto &offsets = model->reading_offset_storage;
+    auto &ids = model->reading_id_storage;
+    offsets.assign(1, 0);
+    for (uint32_t r = 0; r < num_readings; ++r) {
+      for (uint32_t j = model->reading_offsets[r];
+           j < model->reading_offsets[r + 1]; ++j) {
+        uint16_t id = model->reading_ids[j];
+        CPY_ASSERT(id_map[id] != -1,
+                   "PinyinEncoder: " << saved_syllables[id]
+                                     << " is not in the NORMAL_TO_TONE map.");
+        ids.push_back(id_map[id]);
+      }
+      offsets.push_back(ids.size());
+    }
+    model->reading_offsets = ArrayView<uint32_t>(offsets);
+    model->reading_ids = ArrayView<uint16_t>(ids);
+  }
+
+  if (sections[kUnitsSection].data() != nullptr) {
+    model->index = std::make_unique<DartsPhraseIndex>();
+    model->index->Map(sections[kUnitsSection].data(),
+                      sections[kUnitsSection].size());
+  } else {
+    std::string name(sections[kIndexNameSection].begin(),
+                      sections[kIndexNameSection].end());
+    model->index = NewPhraseIndex(name);
+    CPY_ASSERT(model->index != nullptr, "Unknown phrase index " << name);
+    model->index->Map(sections[kIndexSection].data(),
+                      sections[kIndexSection].size());
+  }
+  model->mapped = std::move(file);
+  model->max_key_len = metadata.max_key_len == 0
+                           ? std::numeric_limits<int32_t>::max()
+                           : metadata.max_key_len;
+  model->InitByteTables();
 }
 
 void PinyinEncoder::Save(const std::string &model_path) const {
-  SaveValues(model_path);
-  da_.save(model_path.c_str(), "ab", 0);
+  RcuReadGuard guard;
+  const Layers &layers = *layers_.load();
+  const Model &model = *layers.layers[layers.base].model;
+  std::string syllables;
+  for (const auto &syllable : syllables_) {
+    syllables.append(syllable);
+    syllables.push_back('\0');
+  }
+  ModelMetadata metadata = {};
+  metadata.num_keys = model.scores.size();
+  metadata.max_key_len =
+      model.max_key_len == std::numeric_limits<int32_t>::max()
+          ? 0
+          : static_cast<uint32_t>(model.max_key_len);
+  metadata.num_syllables = syllables_.size();
+  std::string index_name = model.index->Name();
+  ArrayView<char> index_data = model.index->Data();
+  std::vector<SectionData> sections = {
+      MakeSection(kMetadataSection, &metadata, 1),
+      MakeSection(kScoresSection, model.scores.data(), model.scores.size()),
+      MakeSection(kKeyReadingsSection, model.key_readings.data(),
+                  model.key_readings.size()),
+      MakeSection(kReadingOffsetsSection, model.reading_offsets.data(),
+                  model.reading_offsets.size()),
+      MakeSection(kReadingIdsSection, model.reading_ids.data(),
+                  model.reading_ids.size()),
+      MakeSection(kSyllablesSection, syllables.data(), syllables.size()),
+  };
+  if (index_name == "darts") {
+    // As before the other indexes, so that older loaders read the model.
+    sections.push_back(
+        MakeSection(kUnitsSection, index_data.data(), index_data.size()));
+  } else {
+    sections.push_back(
+        MakeSection(kIndexNameSection, index_name.data(), index_name.size()));
+    sections.push_back(
+        MakeSection(kIndexSection, index_data.data(), index_data.size()));
+  }
+  const size_t num_sections = sections.size();
+
+  std::vector<SectionEntry> directory(num_sections);
+  uint64_t offset = sizeof(ModelHeader) + num_sections * sizeof(SectionEntry);
+  for (size_t i = 0; i < num_sections; ++i) {
+    offset = AlignUp(offset, kSectionAlignment);
+    directory[i].id = sections[i].id;
+    directory[i].crc = Crc32c(sections[i].data, sections[i].size);
+    directory[i].offset = offset;
+    directory[i].size = sections[i].size;
+    offset += sections[i].size;
+  }
+  ModelHeader header = {};
+  std::memcpy(header.magic, HEADER_V2, std::strlen(HEADER_V2));
+  header.byte_order = kByteOrderMark;
+  header.version = kFormatVersion;
+  header.num_sections = num_sections;
+  header.directory_crc =
+      Crc32c(reinterpret_cast<const char *>(directory.data()),
+             directory.size() * sizeof(SectionEntry));
+
+  std::ofstream of(model_path, std::ofstream::binary);
+  size_t pos = WriteArray(of, &header, 1);
+  pos += WriteArray(of, directory.data(), directory.size());
+  for (const auto &section : sections) {
+    pos += WritePadding(of, pos, kSectionAlignment);
+    pos += WriteArray(of, section.data, section.size);
+  }
+  CPY_ASSERT(of.good(), "Failed to write " << model_path);
 }
 
 } // namespace cppinyin
@@ -20,12 +20,19 @@
 #define CPPINYIN_CSRC_CPPINYIN_H_
 
 #include "cppinyin/csrc/cppinyin.h"
-#include "cppinyin/csrc/darts.h"
+#include "cppinyin/csrc/executor.h"
+#include "cppinyin/csrc/lru_cache.h"
+#include "cppinyin/csrc/phrase_index.h"
 #include "cppinyin/csrc/pinyin.h"
-#include "cppinyin/csrc/threadpool.h"
+#include "cppinyin/csrc/rcu.h"
 #include "cppinyin/csrc/utils.h"
+#include <atomic>
 #include <cstdlib>
 #include <fstream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <tuple>
 #include <unordered_map>
@@ -35,30 +42,113 @@
 
 namespace cppinyin {
 
+// A segment of the encoder input, either a dictionary word or a run of
+// characters not covered by the dictionary.
+struct Segment {
+  // The segment is [begin, end) of the input, counted in bytes or in UTF-8
+  // characters depending on how Encode was asked.
+  int32_t begin;
+  int32_t end;
+  // Index of the first output token (pinyin or id) of the segment.
+  int32_t token;
+};
+
+// How the tones of the pinyins are written.
+enum class Tone : int32_t {
+  // e.g. zhong1
+  kNumber = 0,
+  // e.g. zhōng
+  kNormal = 1,
+  // e.g. zhong
+  kNone = 2,
+};
+
+// Parses "number", "normal" and "none", aborts on any other string.
+Tone ParseTone(const std::string &tone);
+
+struct EncodeOptions {
+  Tone tone = Tone::kNumber;
+  // Whether to split the pinyins into initials and finals.
+  bool partial = false;
+  // Whether Segment offsets are counted in UTF-8 characters or in bytes.
+  bool char_offset = false;
+};
+
+// Scratch buffers of PinyinEncoder::Encode, kept between calls.
+// A workspace must not be shared by concurrent Encode calls.
+struct EncodeWorkspace {
+  // <path score, index into offsets, index into tokens>
+  using RouteItem = std::tuple<float, int32_t, int32_t>;
+
+  // Byte offsets of the units of the word, see PinyinEncoder::SplitWord.
+  std::vector<int32_t> offsets;
+  // The code points of the units of the word, see DecodeUtf8.
+  std::vector<int32_t> codepoints;
+  // The best path computed by dynamic programming, see CalcRoute.
+  std::vector<RouteItem> route;
+  // Segments of the input, the string segments are sliced from them.
+  std::vector<Segment> segments;
+  // The key of the input in the result cache and of the current word in the
+  // route cache.
+  std::string cache_key;
+  std::string route_key;
+};
+
+class StreamingEncoder;
+
 class PinyinEncoder {
-  // <token score, index into input str, index into tokens>
-  using DagItem = std::tuple<float, int32_t, int32_t>;
-  using DagType = std::vector<std::vector<DagItem>>;
+  using RouteItem = EncodeWorkspace::RouteItem;
+
+  friend class StreamingEncoder;
+
+  static constexpr int32_t kNoInitial = -2;
+
+  // All the ways a syllable is written, the arrays are indexed by Tone.
+  struct SyllableForms {
+    std::string pinyin[3];
+    // The initial and the final when written in partial mode, the initial
+    // may be empty.
+    std::string initial[3];
+    std::string final_t[3];
+  };
 
 public:
+  // The constructors taking `num_threads` give the encoder a private
+  // ThreadPoolExecutor of that many threads, started by the first batch call.
   PinyinEncoder(const std::string &vocab_path,
                 int32_t num_threads = std::thread::hardware_concurrency()) {
-    Init(num_threads);
-    auto is = std::fstream(vocab_path);
-    Load(is);
+    Init(std::make_shared<ThreadPoolExecutor>(num_threads));
+    Load(vocab_path);
   }
 
   PinyinEncoder(std::istream &is,
                 int32_t num_threads = std::thread::hardware_concurrency()) {
-    Init(num_threads);
+    Init(std::make_shared<ThreadPoolExecutor>(num_threads));
     Load(is);
   }
 
   PinyinEncoder(int32_t num_threads = std::thread::hardware_concurrency()) {
-    Init(num_threads);
+    Init(std::make_shared<ThreadPoolExecutor>(num_threads));
   }
 
-  ~PinyinEncoder() {}
+  // The constructors taking an executor run the batch calls on it, a null
+  // executor meaning DefaultExecutor().
+  PinyinEncoder(const std::string &vocab_path,
+                std::shared_ptr<Executor> executor) {
+    Init(std::move(executor));
+    Load(vocab_path);
+  }
+
+  PinyinEncoder(std::istream &is, std::shared_ptr<Executor> executor) {
+    Init(std::move(executor));
+    Load(is);
+  }
+
+  explicit PinyinEncoder(std::shared_ptr<Executor> executor) {
+    Init(std::move(executor));
+  }
+
+  ~PinyinEncoder();
 
   std::vector<std::string> AllPinyin(const std::string &tone = "number",
                                      bool partial = false) const;
@@ -67,69 +157,477 @@ public:
 
   std::vector<std::string> AllFinals(const std::string &tone = "number") const;
 
+  // Returns the inventory EncodeIds draws its ids from, the id of a pinyin is
+  // its index in the inventory. The inventory is the same as
+  // AllPinyin(tone, partial), in partial mode the initials come first, then
+  // the finals.
+  const std::vector<std::string> &
+  SyllableInventory(const std::string &tone = "number",
+                    bool partial = false) const;
+
+  // Returns the id of pinyin `s` in SyllableInventory(tone, partial), or -1
+  // if `s` is not in the inventory.
+  int32_t PinyinToId(const std::string &s, const std::string &tone = "number",
+                     bool partial = false) const;
+
   bool ValidPinyin(const std::string &s, const std::string &tone = "") const;
 
   void Encode(const std::string &str, std::vector<std::string> *ostrs,
               const std::string &tone = "number", bool partial = false,
               std::vector<std::string> *segs = nullptr) const;
 
+  // The same as above, but uses the buffers in `ws` instead of the thread
+  // local workspace.
+  void Encode(const std::string &str, EncodeWorkspace *ws,
+              std::vector<std::string> *ostrs,
+              const std::string &tone = "number", bool partial = false,
+              std::vector<std::string> *segs = nullptr) const;
+
+  // Outputs the segments as offsets into `str` instead of substrings, they
+  // are in UTF-8 characters if `char_offset` is true, otherwise in bytes.
+  void Encode(const std::string &str, std::vector<std::string> *ostrs,
+              std::vector<Segment> *segs, const std::string &tone = "number",
+              bool partial = false, bool char_offset = false) const;
+
+  void Encode(const std::string &str, EncodeWorkspace *ws,
+              std::vector<std::string> *ostrs, std::vector<Segment> *segs,
+              const std::string &tone = "number", bool partial = false,
+              bool char_offset = false) const;
+
+  // The overloads above are thin wrappers of this one. If `ws` is nullptr,
+  // the thread local workspace is used.
+  void Encode(const std::string &str, const EncodeOptions &options,
+              EncodeWorkspace *ws, std::vector<std::string> *ostrs,
+              std::vector<Segment> *segs = nullptr) const;
+
+  // Encodes the `size` bytes at `str`, which need not be null terminated,
+  // e.g. a line of a larger buffer.
+  void Encode(const char *str, size_t size, const EncodeOptions &options,
+              EncodeWorkspace *ws, std::vector<std::string> *ostrs,
+              std::vector<Segment> *segs = nullptr) const;
+
   void Encode(const std::vector<std::string> &strs,
               std::vector<std::vector<std::string>> *ostrs,
               const std::string &tone = "number", bool partial = false,
               std::vector<std::vector<std::string>> *segs = nullptr) const;
 
+  // Like Encode, but outputs the ids of the pinyins in
+  // SyllableInventory(tone, partial) instead of strings. There is exactly one
+  // id for each token Encode would output, tokens that are not in the
+  // inventory (i.e. the characters not covered by the dictionary) are -1.
+  void EncodeIds(const std::string &str, std::vector<int32_t> *ids,
+                 const std::string &tone = "number", bool partial = false,
+                 std::vector<Segment> *segs = nullptr,
+                 bool char_offset = false) const;
+
+  void EncodeIds(const std::string &str, EncodeWorkspace *ws,
+                 std::vector<int32_t> *ids, const std::string &tone = "number",
+                 bool partial = false, std::vector<Segment> *segs = nullptr,
+                 bool char_offset = false) const;
+
+  void EncodeIds(const std::string &str, const EncodeOptions &options,
+                 EncodeWorkspace *ws, std::vector<int32_t> *ids,
+                 std::vector<Segment> *segs = nullptr) const;
+
+  void EncodeIds(const char *str, size_t size, const EncodeOptions &options,
+                 EncodeWorkspace *ws, std::vector<int32_t> *ids,
+                 std::vector<Segment> *segs = nullptr) const;
+
+  void EncodeIds(const std::vector<std::string> &strs,
+                 std::vector<std::vector<int32_t>> *ids,
+                 const std::string &tone = "number",
+                 bool partial = false) const;
+
   std::string ToInitial(const std::string &s) const;
   void ToInitials(const std::vector<std::string> &strs,
                   std::vector<std::string> *ostrs) const;
 
   std::string ToFinal(const std::string &s,
                       const std::string &tone = "number") const;
+  std::string ToFinal(const std::string &s, Tone tone) const;
   void ToFinals(const std::vector<std::string> &strs,
                 std::vector<std::string> *ostrs,
                 const std::string &tone = "number") const;
 
-  void Load(const std::string &model_path);
+  // Loads a text dictionary or a binary model of format v1 or v2. A model
+  // saved by Save is memory mapped when loaded from a path, and its large
+  // sections are checksummed only if `verify_checksums`. Aborts on corrupted
+  // models. Other threads may encode meanwhile, with the old model.
+  void Load(const std::string &model_path, bool verify_checksums = true);
   void Load(std::istream &is);
 
+  // Switches a live encoder to another dictionary or model, the same as
+  // Load.
+  void Reload(const std::string &model_path, bool verify_checksums = true) {
+    Load(model_path, verify_checksums);
+  }
+
+  // Saves the current model in format v2, see LoadMapped. The layers added
+  // with AddLayer are not saved.
   void Save(const std::string &model_path) const;
 
-private:
-  void Init(int32_t num_threads);
+  // Sets the kind of PhraseIndex the keys of the dictionaries built from
+  // text are looked up with from now on, see NewPhraseIndex. The binary
+  // models keep the index they were saved with. Returns false, changing
+  // nothing, for an unknown kind. Must not be called concurrently with Load
+  // or AddLayer.
+  bool SetPhraseIndex(const std::string &name);
+
+  // Layers are dictionaries looked up besides the model of Load, which is
+  // the layer of priority 0 and offset 0. A key of several layers is taken
+  // from the one of highest priority, the last added among equals, and
+  // scored with its offset. User words come above all layers. Layers may be
+  // changed while other threads encode, up to kMaxLayers of 2^24 keys each.
+
+  // Adds the dictionary or model at `path`, see Load, as the layer `name`,
+  // replacing the layer of that name if any. Returns false, adding nothing,
+  // if the name is empty.
+  bool AddLayer(const std::string &name, const std::string &path,
+                int32_t priority, float score_offset = 0,
+                bool verify_checksums = true);
+
+  // Returns false if there is no such layer.
+  bool RemoveLayer(const std::string &name);
+
+  void ClearLayers();
+
+  // The number of layers added with AddLayer.
+  size_t NumLayers() const;
+
+  static constexpr int32_t kMaxLayers = 64;
+
+  // Caches the results of Encode, up to about `capacity` bytes over
+  // `num_shards` shards. A capacity of 0 drops the cache. Must not be called
+  // concurrently with Encode.
+  void EnableCache(size_t capacity, int32_t num_shards = 16);
 
-  void Build(std::istream &is);
+  // The counters of the result cache, all zero if it is disabled.
+  CacheStats GetCacheStats() const;
 
-  void LoadVocab(std::istream &is);
+  // Caches the routes of whitespace separated words, up to about `capacity`
+  // bytes, whatever the rest of the text and the options. A capacity of 0
+  // drops the cache. Must not be called concurrently with Encode.
+  void EnableRouteCache(size_t capacity, int32_t num_shards = 16);
 
-  void EncodeBase(const std::string &str, std::vector<DagItem> *route) const;
+  // The counters of the route cache, all zero if it is disabled.
+  CacheStats GetRouteCacheStats() const;
 
-  void EncodeBase(const std::string &str, std::vector<std::string> *ostrs,
-                  const std::string &tone, bool partial,
-                  std::vector<std::string> *segs) const;
+  // Empties the result and the route caches, Load does it too.
+  void ClearCache();
 
-  void GetDag(const std::string &str, DagType *dag) const;
+  // User words replace the dictionary entry of the same key, and are scored
+  // against the other keys. They may be changed while other threads encode.
+  // Each change rebuilds their trie, so add long lists with LoadUserWords.
 
-  void CalcDp(const std::string &str, const DagType &dag,
-              std::vector<DagItem> *route) const;
+  // Adds a user word, or replaces the user word of the same key. `pinyins`
+  // are its syllables, in number or normal tone. Returns false, adding
+  // nothing, if the word is empty or contains whitespace, or if one of the
+  // pinyins is not a syllable.
+  bool AddUserWord(const std::string &word, float score,
+                   const std::vector<std::string> &pinyins);
 
-  void Cut(const std::string &str, const std::vector<DagItem> &route,
-           const std::string &tone, bool partial,
-           std::vector<std::string> *ostrs,
-           std::vector<std::string> *segs) const;
+  // Adds the entries of a text dictionary as user words, the later entries
+  // replacing the earlier ones of the same key. Aborts on malformed lines like
+  // Load.
+  void LoadUserWords(const std::string &path);
+
+  // Returns false if there is no such user word.
+  bool RemoveUserWord(const std::string &word);
+
+  void ClearUserWords();
+
+  size_t NumUserWords() const;
+
+private:
+  // Route indexes are v | (l << kLayerShift) for key v of layer l.
+  static constexpr int32_t kLayerShift = 24;
+  static constexpr int32_t kKeyMask = (1 << kLayerShift) - 1;
+  static constexpr int32_t kUserWord = 1 << 30;
+
+  // A dictionary, immutable once published in a layer.
+  struct Model {
+    // The keys, a DartsPhraseIndex for the models of format v1.
+    std::unique_ptr<PhraseIndex> index;
+    // Characters of the longest key, unknown for models of format v1.
+    int32_t max_key_len = std::numeric_limits<int32_t>::max();
+    // Whether byte c appears in a key, and whether a key starts with it.
+    bool key_bytes[256] = {};
+    bool key_starts[256] = {};
+    bool ascii_in_keys = false;
+    // Indexed by key value, viewing either the *_storage vectors or mapped.
+    ArrayView<float> scores;
+    ArrayView<uint32_t> key_readings;
+    ArrayView<uint32_t> reading_offsets;
+    ArrayView<uint16_t> reading_ids;
+    std::vector<float> score_storage;
+    std::vector<uint32_t> key_reading_storage;
+    std::vector<uint32_t> reading_offset_storage;
+    std::vector<uint16_t> reading_id_storage;
+    std::unique_ptr<MappedFile> mapped;
+
+    // Points the views at the *_storage vectors.
+    void UseStorage();
+
+    // Computes key_bytes, key_starts and ascii_in_keys from index.
+    void InitByteTables();
+
+    // The syllables of the key whose value is `index`.
+    ArrayView<uint16_t> Reading(int32_t index) const {
+      uint32_t r = key_readings[index];
+      return ArrayView<uint16_t>(reading_ids.data() + reading_offsets[r],
+                                 reading_offsets[r + 1] - reading_offsets[r]);
+    }
+  };
+
+  // An immutable snapshot of the user words.
+  struct UserWords {
+    // Part of the cache keys, see AssignVersions.
+    uint64_t version = 0;
+    DartsPhraseIndex index;
+    std::vector<float> scores;
+    std::vector<uint32_t> reading_offsets;
+    std::vector<uint16_t> reading_ids;
+    int32_t max_key_len = 0;
+    bool key_bytes[256] = {};
+    bool key_starts[256] = {};
+    bool ascii_in_keys = false;
+  };
+
+  struct Layer {
+    // Empty for the model of Load.
+    std::string name;
+    int32_t priority;
+    float score_offset;
+    std::shared_ptr<const Model> model;
+  };
+
+  // The layers, immutable once published in layers_.
+  struct Layers {
+    // Part of the cache keys, see AssignVersions.
+    uint64_t version = 0;
+    // By decreasing priority.
+    std::vector<Layer> layers;
+    // The position in layers of the model of Load.
+    int32_t base = 0;
+    // Merged from the models.
+    int32_t max_key_len = 0;
+    bool key_bytes[256] = {};
+    bool ascii_in_keys = false;
+    // Whether an index UsesCodepoints.
+    bool codepoints = false;
+  };
+
+  // What an encoding call reads, valid under its RcuReadGuard.
+  struct Snapshot {
+    const Layers *layers;
+    // nullptr if there are no user words.
+    const UserWords *user;
+  };
+
+  // A user word, as kept for the next snapshot.
+  struct UserEntry {
+    float score;
+    std::vector<uint16_t> syllables;
+  };
+
+  // The cached result of an Encode call.
+  struct CachedEncode {
+    std::vector<std::string> tokens;
+    std::vector<Segment> segments;
+  };
+
+  // The cached units and route of a word.
+  struct CachedRoute {
+    std::vector<int32_t> offsets;
+    std::vector<RouteItem> route;
+    int32_t num_chars;
+  };
+
+  void EncodeUncached(const char *str, size_t size,
+                      const EncodeOptions &options, const Snapshot &snapshot,
+                      EncodeWorkspace *ws, std::vector<std::string> *ostrs,
+                      std::vector<Segment> *segs) const;
+
+  void Init(std::shared_ptr<Executor> executor);
+
+  // Calls f(i) for each i in [0, size) on executor_.
+  template <typename F> void ParallelFor(size_t size, F &&f) const;
+
+  void Build(std::istream &is, Model *model) const;
+
+  // Builds `model` from the text dictionary of `size` bytes at `text`.
+  void Build(const char *text, size_t size, Model *model) const;
+
+  // Reads a dictionary or a model into `model`, see Load.
+  void ReadModel(const std::string &model_path, bool verify_checksums,
+                 Model *model) const;
+  void ReadModel(std::istream &is, Model *model) const;
+
+  // Makes `model` the model of Load.
+  void Publish(std::unique_ptr<Model> model);
+
+  // Publishes layer_entries_, under layers_mutex_, and returns the old layers.
+  const Layers *PublishLayers();
+
+  // Frees `old` once no reader uses it, to be called without the lock.
+  template <typename T> void Retire(const T *old);
+
+  // The current layers and user words, to be called under an RcuReadGuard.
+  Snapshot CurrentSnapshot() const {
+    return Snapshot{layers_.load(), user_words_.load()};
+  }
+
+  // Publishes user_entries_, under user_mutex_, and returns the old words.
+  const UserWords *PublishUserWords();
+
+  // Computes the route of each word into `ws`, then calls
+  // f(word, byte_base, char_base).
+  template <typename F>
+  void ForEachWord(const char *str, int32_t size, const Snapshot &snapshot,
+                   EncodeWorkspace *ws, F &&f) const;
+
+  // Splits a word into characters and runs of ASCII in no key, returns its
+  // number of characters.
+  int32_t SplitWord(const char *str, int32_t size, const Snapshot &snapshot,
+                    std::vector<int32_t> *offsets,
+                    std::vector<int32_t> *codepoints) const;
+
+  // Calls f(end, index) for each key of the units [i, end), by increasing end.
+  template <typename F>
+  void ForEachMatch(const WordUnits &word, int32_t num_units,
+                    const Snapshot &snapshot, int32_t i, F &&f) const;
+
+  // Computes ws->route from ws->offsets and ws->codepoints.
+  void CalcRoute(const char *str, const Snapshot &snapshot,
+                 EncodeWorkspace *ws) const;
+
+  // SplitWord and CalcRoute through the route cache.
+  int32_t WordRoute(const char *str, int32_t size, const Snapshot &snapshot,
+                    EncodeWorkspace *ws) const;
+
+  // The <end, index> keys at unit i are keys[begins[i]..begins[i + 1]).
+  struct WordMatches {
+    std::vector<std::pair<int32_t, int32_t>> keys;
+    std::vector<int32_t> begins = {0};
+  };
+
+  // Appends the keys of the units [begin, end) to `matches`.
+  void MatchUnits(const WordUnits &word, int32_t num_units,
+                  const Snapshot &snapshot, int32_t begin, int32_t end,
+                  WordMatches *matches) const;
+
+  // CalcRoute from the keys in `matches` instead of the tries.
+  void CalcRoute(const Snapshot &snapshot, const WordMatches &matches,
+                 std::vector<RouteItem> *route) const;
+
+  // The number of leading units whose tokens appended text can not change.
+  int32_t StablePrefix(const Snapshot &snapshot,
+                       const std::vector<RouteItem> &route,
+                       const WordMatches &matches,
+                       std::vector<int32_t> *anchors) const;
+
+  // Cut with the format given at runtime.
+  void CutWord(const char *str, const std::vector<int32_t> &offsets,
+               const std::vector<RouteItem> &route, const Snapshot &snapshot,
+               const EncodeOptions &options, int32_t base,
+               std::vector<std::string> *ostrs,
+               std::vector<Segment> *segs) const;
+
+  // Outputs the tokens of a word given its route, `base` being its offset.
+  template <Tone tone, bool partial>
+  void Cut(const char *str, const std::vector<int32_t> &offsets,
+           const std::vector<RouteItem> &route, const Snapshot &snapshot,
+           int32_t base, bool char_offset, std::vector<std::string> *ostrs,
+           std::vector<Segment> *segs) const;
+
+  template <bool partial>
+  void CutIds(const char *str, const std::vector<int32_t> &offsets,
+              const std::vector<RouteItem> &route, const Snapshot &snapshot,
+              Tone tone, int32_t base, bool char_offset,
+              std::vector<int32_t> *ids, std::vector<Segment> *segs) const;
+
+  // Appends syllables_[syllable] in the given format.
+  template <Tone tone, bool partial>
+  void AppendPinyin(int32_t syllable, std::vector<std::string> *ostrs) const;
+
+  void AppendPinyin(int32_t syllable, Tone tone, bool partial,
+                    std::vector<std::string> *ostrs) const;
+
+  void InitForms();
+
+  void InitInventories();
 
   std::string GetInitial(const std::string &s) const;
 
   std::string RemoveTone(const std::string &s) const;
 
-  size_t SaveValues(const std::string &model_path) const;
-  size_t LoadValues(std::istream &ifile);
+  // Loads the scores and the readings of a model of format v1.
+  size_t LoadValues(std::istream &ifile, Model *model) const;
+
+  // Maps a model of format v2, see SectionId in cppinyin.cc.
+  void LoadMapped(std::unique_ptr<MappedFile> file, bool verify_checksums,
+                  Model *model) const;
+
+  // The score and the syllables of a route index.
+  static float Score(const Snapshot &snapshot, int32_t index) {
+    if (index & kUserWord) {
+      return snapshot.user->scores[index & ~kUserWord];
+    }
+    const Layer &layer = snapshot.layers->layers[index >> kLayerShift];
+    return layer.model->scores[index & kKeyMask] + layer.score_offset;
+  }
+
+  static ArrayView<uint16_t> Reading(const Snapshot &snapshot,
+                                     int32_t index) {
+    if (!(index & kUserWord)) {
+      return snapshot.layers->layers[index >> kLayerShift].model->Reading(
+          index & kKeyMask);
+    }
+    index &= ~kUserWord;
+    const UserWords *user = snapshot.user;
+    uint32_t begin = user->reading_offsets[index];
+    return ArrayView<uint16_t>(user->reading_ids.data() + begin,
+                               user->reading_offsets[index + 1] - begin);
+  }
+
+  // Sets `key` to the versions of `snapshot`, the prefix of the cache keys.
+  static void AssignVersions(const Snapshot &snapshot, std::string *key) {
+    uint64_t versions[2] = {
+        snapshot.layers->version,
+        snapshot.user != nullptr ? snapshot.user->version : 0};
+    key->assign(reinterpret_cast<const char *>(versions), sizeof(versions));
+  }
 
   std::unordered_map<std::string, std::string> tone_to_normal_;
   std::unordered_set<std::string> no_tone_set_;
-  std::vector<std::string> tokens_;
-  std::vector<float> scores_;
-  std::vector<std::vector<std::string>> values_;
-  std::unique_ptr<ThreadPool> pool_;
-  Darts::DoubleArray da_;
+  // The syllables in number tone, sorted.
+  std::vector<std::string> syllables_;
+  // Both tone forms of a syllable to its index in syllables_.
+  std::unordered_map<std::string, int32_t> syllable_ids_;
+  // The renderings of syllables_[i].
+  std::vector<SyllableForms> forms_;
+  // SyllableInventory(tone, partial).
+  std::vector<std::string> inventories_[3][2];
+  std::unordered_map<std::string, int32_t> inventory_ids_[3][2];
+  // Ids of the syllables in inventories_[tone][0].
+  std::vector<int32_t> syllable_to_id_[3];
+  // Ids of the initials and the finals in inventories_[tone][1].
+  std::vector<std::pair<int32_t, int32_t>> syllable_to_partial_ids_[3];
+  std::shared_ptr<Executor> executor_;
+  // The kind of index Build builds, see SetPhraseIndex.
+  std::string phrase_index_ = "darts";
+  std::unique_ptr<ShardedLruCache<CachedEncode>> cache_;
+  std::unique_ptr<ShardedLruCache<CachedRoute>> route_cache_;
+  // Changed under layers_mutex_, read under an RcuReadGuard.
+  mutable std::mutex layers_mutex_;
+  std::vector<Layer> layer_entries_;
+  uint64_t layers_version_ = 0;
+  std::atomic<const Layers *> layers_{nullptr};
+  // Changed under user_mutex_, read like the layers.
+  mutable std::mutex user_mutex_;
+  std::map<std::string, UserEntry> user_entries_;
+  uint64_t user_version_ = 0;
+  std::atomic<const UserWords *> user_words_{nullptr};
 };
 
 } // namespace cppinyin
@@ -0,0 +1,249 @@
+/**
+ * Copyright      2024    Wei Kang (wkang@pku.edu.cn)
+ *
+ * See LICENSE for clarification regarding multiple authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Encodes a text file line by line, for corpora too large for the Python
+// command line tool. The input is memory mapped and cut into chunks of whole
+// lines, which are encoded in parallel. The output of a window of chunks is
+// written, in input order, while the next window is encoded.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "cppinyin/csrc/cppinyin.h"
+#include "cppinyin/csrc/executor.h"
+#include "cppinyin/csrc/utils.h"
+
+namespace {
+
+const char *kUsage = R"(Encode each line of a file into pinyins.
+
+Usage: cppinyin-cli [options] <dict or model> <input> [<output>]
+
+The input and the output may be "-" for stdin and stdout, the output
+defaults to stdout. Each output line is the input line, a tab and the
+space separated pinyins, as written by `cppinyin encode`.
+
+Options:
+  --tone=number|normal|none  The tone of the pinyins (default: number).
+  --partial                  Split the pinyins into initials and finals.
+  --pinyin-only              Write only the pinyins of each line.
+  --num-threads=N            The number of threads (default: all cores).
+  --chunk-size=BYTES         The size of the chunks of lines encoded by a
+                             thread at a time (default: 4194304).
+)";
+
+struct CliOptions {
+  std::string model;
+  std::string input;
+  std::string output = "-";
+  cppinyin::EncodeOptions encode;
+  bool pinyin_only = false;
+  int32_t num_threads = std::thread::hardware_concurrency();
+  size_t chunk_size = 4 << 20;
+};
+
+bool StartsWith(const std::string &s, const char *prefix) {
+  return s.compare(0, std::strlen(prefix), prefix) == 0;
+}
+
+bool ParseArgs(int argc, char *argv[], CliOptions *options) {
+  std::vector<std::string> positional;
+  for (int32_t i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--partial") {
+      options->encode.partial = true;
+    } else if (arg == "--pinyin-only") {
+      options->pinyin_only = true;
+    } else if (StartsWith(arg, "--tone=")) {
+      std::string tone = arg.substr(7);
+      if (tone != "number" && tone != "normal" && tone != "none") {
+        std::cerr << "Invalid tone: " << tone << std::endl;
+        return false;
+      }
+      options->encode.tone = cppinyin::ParseTone(tone);
+    } else if (StartsWith(arg, "--num-threads=")) {
+      options->num_threads = std::atoi(arg.c_str() + 14);
+    } else if (StartsWith(arg, "--chunk-size=")) {
+      options->chunk_size = std::max(1LL, std::atoll(arg.c_str() + 13));
+    } else if (arg == "-" || !StartsWith(arg, "-")) {
+      positional.push_back(arg);
+    } else {
+      std::cerr << "Unknown option: " << arg << std::endl;
+      return false;
+    }
+  }
+  if (positional.size() < 2 || positional.size() > 3) {
+    return false;
+  }
+  options->model = positional[0];
+  options->input = positional[1];
+  if (positional.size() == 3) {
+    options->output = positional[2];
+  }
+  return true;
+}
+
+// Returns the end of the chunk starting at `begin`: the end of the line
+// holding its `chunk_size`-th byte.
+size_t ChunkEnd(const char *data, size_t size, size_t begin,
+                size_t chunk_size) {
+  if (size - begin <= chunk_size) {
+    return size;
+  }
+  const char *p = static_cast<const char *>(
+      std::memchr(data + begin + chunk_size, '\n', size - begin - chunk_size));
+  return p == nullptr ? size : p - data + 1;
+}
+
+// Appends the output lines of the lines in the `size` bytes at `data` to
+// `output`.
+void EncodeChunk(const cppinyin::PinyinEncoder &encoder,
+                 const CliOptions &options, const char *data, size_t size,
+                 std::vector<std::string> *tokens, std::string *output) {
+  const char *end = data + size;
+  const char *p = data;
+  while (p != end) {
+    const char *eol = static_cast<const char *>(std::memchr(p, '\n', end - p));
+    const char *next = eol == nullptr ? end : eol + 1;
+    if (eol == nullptr) {
+      eol = end;
+    }
+    // Strips the line as str.strip() does in the Python tool.
+    while (p != eol && cppinyin::IsSpace(*p)) {
+      ++p;
+    }
+    while (eol != p && cppinyin::IsSpace(eol[-1])) {
+      --eol;
+    }
+    encoder.Encode(p, eol - p, options.encode, nullptr, tokens);
+    if (!options.pinyin_only) {
+      output->append(p, eol - p);
+      output->push_back('\t');
+    }
+    for (size_t i = 0; i < tokens->size(); ++i) {
+      if (i != 0) {
+        output->push_back(' ');
+      }
+      output->append((*tokens)[i]);
+    }
+    output->push_back('\n');
+    p = next;
+  }
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  CliOptions options;
+  if (!ParseArgs(argc, argv, &options)) {
+    std::cerr << kUsage;
+    return 1;
+  }
+
+  auto executor =
+      std::make_shared<cppinyin::ThreadPoolExecutor>(options.num_threads);
+  cppinyin::PinyinEncoder encoder(options.model, executor);
+
+  std::unique_ptr<cppinyin::MappedFile> mapped;
+  std::string stdin_buffer;
+  const char *data = nullptr;
+  size_t size = 0;
+  if (options.input == "-") {
+    stdin_buffer.assign(std::istreambuf_iterator<char>(std::cin),
+                        std::istreambuf_iterator<char>());
+    data = stdin_buffer.data();
+    size = stdin_buffer.size();
+  } else {
+    mapped = std::make_unique<cppinyin::MappedFile>(options.input, true);
+    data = mapped->Data();
+    size = mapped->Size();
+  }
+
+  FILE *out = options.output == "-" ? stdout
+                                    : std::fopen(options.output.c_str(), "wb");
+  if (out == nullptr) {
+    std::cerr << "Failed to open " << options.output << std::endl;
+    return 1;
+  }
+
+  // The outputs of a window of chunks are written while the next window is
+  // encoded into the other set of buffers.
+  size_t window = executor->Concurrency() * 2;
+  std::vector<std::string> outputs[2];
+  outputs[0].resize(window);
+  outputs[1].resize(window);
+  std::future<bool> writing;
+  std::vector<std::pair<size_t, size_t>> chunks;
+  bool ok = true;
+  int32_t current = 0;
+  size_t pos = 0;
+  while (pos < size && ok) {
+    chunks.clear();
+    while (chunks.size() < window && pos < size) {
+      size_t end = ChunkEnd(data, size, pos, options.chunk_size);
+      chunks.emplace_back(pos, end);
+      pos = end;
+    }
+    auto &buffers = outputs[current];
+    executor->ParallelFor(0, chunks.size(), 1, [&](size_t first, size_t last) {
+      std::vector<std::string> tokens;
+      for (size_t c = first; c < last; ++c) {
+        buffers[c].clear();
+        EncodeChunk(encoder, options, data + chunks[c].first,
+                    chunks[c].second - chunks[c].first, &tokens, &buffers[c]);
+      }
+    });
+    if (writing.valid()) {
+      ok = writing.get();
+    }
+    size_t num_chunks = chunks.size();
+    writing = std::async(std::launch::async, [&buffers, num_chunks, out] {
+      for (size_t c = 0; c < num_chunks; ++c) {
+        if (std::fwrite(buffers[c].data(), 1, buffers[c].size(), out) !=
+            buffers[c].size()) {
+          return false;
+        }
+      }
+      return true;
+    });
+    current = 1 - current;
+  }
+  if (writing.valid()) {
+    ok = writing.get() && ok;
+  }
+  ok = std::fflush(out) == 0 && ok;
+  if (out != stdout) {
+    ok = std::fclose(out) == 0 && ok;
+  }
+  if (!ok) {
+    std::cerr << "Failed to write " << options.output << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -18,14 +18,21 @@
 
 #include "gtest/gtest.h"
 
+#include <atomic>
 #include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "cppinyin/csrc/cppinyin.h"
+#include "cppinyin/csrc/rcu.h"
 
 namespace cppinyin {
 
@@ -182,6 +189,464 @@ TEST(PinyinEncoder, TestEncodeBatch) {
             "love you z u g uo w o sh i zh ong g uo r en w o ai w o d e ");
 }
 
+TEST(PinyinEncoder, TestEncodeLargeBatch) {
+  std::string vocab_path = "cppinyin/python/cppinyin/resources/pinyin.raw";
+  PinyinEncoder processor(vocab_path, 4);
+
+  // Enough strings for the batch to be cut into many chunks.
+  std::vector<std::string> base({"我是中国人", "love you 祖国", "", "银行行长",
+                                 "重庆 一切"});
+  std::vector<std::string> strs;
+  for (int32_t i = 0; i < 1000; ++i) {
+    strs.push_back(base[i % base.size()]);
+  }
+
+  std::vector<std::vector<std::string>> pieces;
+  std::vector<std::vector<int32_t>> ids;
+  processor.Encode(strs, &pieces, "normal", true);
+  processor.EncodeIds(strs, &ids, "normal", true);
+  ASSERT_EQ(pieces.size(), strs.size());
+  ASSERT_EQ(ids.size(), strs.size());
+  std::vector<std::string> expected_pieces;
+  std::vector<int32_t> expected_ids;
+  for (size_t i = 0; i < strs.size(); ++i) {
+    processor.Encode(strs[i], &expected_pieces, "normal", true);
+    processor.EncodeIds(strs[i], &expected_ids, "normal", true);
+    EXPECT_EQ(pieces[i], expected_pieces);
+    EXPECT_EQ(ids[i], expected_ids);
+  }
+
+  std::vector<std::string> pinyins;
+  for (int32_t i = 0; i < 1000; ++i) {
+    pinyins.push_back(i % 2 ? "zhong1" : "guó");
+  }
+  std::vector<std::string> res;
+  processor.ToInitials(pinyins, &res);
+  ASSERT_EQ(res.size(), pinyins.size());
+  for (size_t i = 0; i < res.size(); ++i) {
+    EXPECT_EQ(res[i], i % 2 ? "zh" : "g");
+  }
+  processor.ToFinals(pinyins, &res, "none");
+  ASSERT_EQ(res.size(), pinyins.size());
+  for (size_t i = 0; i < res.size(); ++i) {
+    EXPECT_EQ(res[i], i % 2 ? "ong" : "uo");
+  }
+}
+
+TEST(PinyinEncoder, TestEncodeWorkspace) {
+  std::string vocab_path = "cppinyin/python/cppinyin/resources/pinyin.raw";
+  PinyinEncoder processor(vocab_path);
+
+  std::vector<std::string> strs({"我是中国 人我爱我的 love you 祖国", "中国",
+                                 "我是中国 人我爱我的 love you 祖国"});
+
+  EncodeWorkspace ws;
+  std::vector<std::string> pieces;
+  std::vector<std::string> segs;
+  std::vector<std::string> expected_pieces;
+  std::vector<std::string> expected_segs;
+  for (const auto &str : strs) {
+    processor.Encode(str, &ws, &pieces, "number", true, &segs);
+    processor.Encode(str, &expected_pieces, "number", true, &expected_segs);
+    EXPECT_EQ(pieces, expected_pieces);
+    EXPECT_EQ(segs, expected_segs);
+  }
+  EXPECT_EQ(segs, std::vector<std::string>({"我", "是", "中国", "人", "我", "爱",
+                                            "我", "的", "love", "you", "祖国"}));
+}
+
+TEST(PinyinEncoder, TestEncodeNonDictChars) {
+  std::string vocab_path = "cppinyin/python/cppinyin/resources/pinyin.raw";
+  PinyinEncoder processor(vocab_path);
+
+  std::vector<std::string> pieces;
+  std::vector<std::string> segs;
+  // "é" and "，" are not in the dictionary, the trailing byte is a truncated
+  // UTF-8 sequence.
+  processor.Encode("爱lové中国，祖国\xe4", &pieces, "number", false, &segs);
+  EXPECT_EQ(pieces, std::vector<std::string>({"ai4", "lové", "zhong1", "guo2",
+                                              "，", "zu3", "guo2", "\xe4"}));
+  EXPECT_EQ(segs, std::vector<std::string>(
+                      {"爱", "lové", "中国", "，", "祖国", "\xe4"}));
+
+  // A lead byte missing its continuation bytes is a character of its own, the
+  // characters after it are kept whole.
+  processor.Encode("\xe4是我", &pieces, "number", false, &segs);
+  EXPECT_EQ(pieces, std::vector<std::string>({"\xe4", "shi4", "wo3"}));
+  EXPECT_EQ(segs, std::vector<std::string>({"\xe4", "是", "我"}));
+  processor.Encode("中\xe5\x9b我", &pieces, "number", false, &segs);
+  EXPECT_EQ(pieces,
+            std::vector<std::string>({"zhong1", "\xe5\x9b", "wo3"}));
+}
+
+TEST(PinyinEncoder, TestEncodeIds) {
+  std::string vocab_path = "cppinyin/python/cppinyin/resources/pinyin.raw";
+  PinyinEncoder processor(vocab_path);
+
+  std::string str = "我是中国 人我爱我的 love you 祖国";
+  std::vector<std::string> pieces;
+  std::vector<int32_t> ids;
+  for (const auto &tone : {"number", "normal", "none"}) {
+    for (bool partial : {false, true}) {
+      processor.Encode(str, &pieces, tone, partial);
+      processor.EncodeIds(str, &ids, tone, partial);
+      const auto &inventory = processor.SyllableInventory(tone, partial);
+      EXPECT_EQ(inventory, processor.AllPinyin(tone, partial));
+      ASSERT_EQ(ids.size(), pieces.size());
+      for (size_t i = 0; i < ids.size(); ++i) {
+        if (pieces[i] == "love" || pieces[i] == "you") {
+          EXPECT_EQ(ids[i], -1);
+        } else {
+          ASSERT_GE(ids[i], 0);
+          EXPECT_EQ(inventory[ids[i]], pieces[i]);
+        }
+      }
+    }
+  }
+
+  int32_t id = processor.PinyinToId("zhōng", "normal");
+  ASSERT_GE(id, 0);
+  EXPECT_EQ(processor.SyllableInventory("normal")[id], "zhōng");
+  EXPECT_EQ(processor.PinyinToId("love"), -1);
+
+  std::vector<std::vector<int32_t>> batch_ids;
+  processor.EncodeIds({str, "祖国"}, &batch_ids, "none", true);
+  ASSERT_EQ(batch_ids.size(), 2);
+  processor.EncodeIds(str, &ids, "none", true);
+  EXPECT_EQ(batch_ids[0], ids);
+  EXPECT_EQ(batch_ids[1].size(), 4);
+}
+
+TEST(PinyinEncoder, TestEncodeSegments) {
+  std::string vocab_path = "cppinyin/python/cppinyin/resources/pinyin.raw";
+  PinyinEncoder processor(vocab_path);
+
+  std::string str = " 我是 lové中国";
+  std::vector<std::string> pieces;
+  std::vector<Segment> segs;
+  processor.Encode(str, &pieces, &segs, "number", true);
+  EXPECT_EQ(pieces, std::vector<std::string>(
+                        {"w", "o3", "sh", "i4", "lové", "zh", "ong1", "g",
+                         "uo2"}));
+  std::vector<std::vector<int32_t>> expected = {
+      {1, 4, 0}, {4, 7, 2}, {8, 13, 4}, {13, 19, 5}};
+  ASSERT_EQ(segs.size(), expected.size());
+  for (size_t i = 0; i < segs.size(); ++i) {
+    EXPECT_EQ(segs[i].begin, expected[i][0]);
+    EXPECT_EQ(segs[i].end, expected[i][1]);
+    EXPECT_EQ(segs[i].token, expected[i][2]);
+  }
+
+  std::vector<int32_t> ids;
+  processor.EncodeIds(str, &ids, "none", false, &segs, true);
+  EXPECT_EQ(ids.size(), 5);
+  expected = {{1, 2, 0}, {2, 3, 1}, {4, 8, 2}, {8, 10, 3}};
+  ASSERT_EQ(segs.size(), expected.size());
+  for (size_t i = 0; i < segs.size(); ++i) {
+    EXPECT_EQ(segs[i].begin, expected[i][0]);
+    EXPECT_EQ(segs[i].end, expected[i][1]);
+    EXPECT_EQ(segs[i].token, expected[i][2]);
+  }
+}
+
+TEST(PinyinEncoder, TestEncodeOptions) {
+  std::string vocab_path = "cppinyin/python/cppinyin/resources/pinyin.raw";
+  PinyinEncoder processor(vocab_path);
+
+  std::string str = "我是中国 人我爱我的 love you 祖国";
+  std::vector<std::string> pieces;
+  std::vector<std::string> expected;
+  EncodeOptions options;
+  for (const auto &tone : {"number", "normal", "none"}) {
+    for (bool partial : {false, true}) {
+      options.tone = ParseTone(tone);
+      options.partial = partial;
+      processor.Encode(str, options, nullptr, &pieces);
+      processor.Encode(str, &expected, tone, partial);
+      EXPECT_EQ(pieces, expected);
+    }
+  }
+  EXPECT_EQ(processor.ToFinal("zhōng", Tone::kNone), "ong");
+}
+
+TEST(PinyinEncoder, TestEncodeSpan) {
+  std::string vocab_path = "cppinyin/python/cppinyin/resources/pinyin.raw";
+  PinyinEncoder processor(vocab_path);
+
+  std::string buffer = "\t中国\r\n 祖国  \v我是中国人";
+  std::vector<std::string> pieces;
+  std::vector<Segment> segs;
+  // Stops in the middle of the buffer, after "我".
+  processor.Encode(buffer.data(), buffer.find("是"), EncodeOptions(), nullptr,
+                   &pieces, &segs);
+  EXPECT_EQ(pieces, std::vector<std::string>(
+                        {"zhong1", "guo2", "zu3", "guo2", "wo3"}));
+  ASSERT_EQ(segs.size(), 3);
+  EXPECT_EQ(buffer.substr(segs[2].begin, segs[2].end - segs[2].begin), "我");
+}
+
+TEST(PinyinEncoder, TestEncodeAsciiRuns) {
+  std::string vocab_path = "cppinyin/python/cppinyin/resources/pinyin.raw";
+  PinyinEncoder processor(vocab_path);
+
+  // ASCII runs longer than a SIMD block, with a non ASCII character past the
+  // first block.
+  std::string ascii(40, 'a');
+  std::string str = "中国" + ascii + "é" + ascii + "人民 " + ascii;
+  std::vector<std::string> pieces;
+  std::vector<Segment> segs;
+  processor.Encode(str, &pieces, &segs, "number", false, true);
+  EXPECT_EQ(pieces,
+            std::vector<std::string>({"zhong1", "guo2", ascii + "é" + ascii,
+                                      "ren2", "min2", ascii}));
+  std::vector<std::vector<int32_t>> expected = {
+      {0, 2, 0}, {2, 83, 2}, {83, 85, 3}, {86, 126, 5}};
+  ASSERT_EQ(segs.size(), expected.size());
+  for (size_t i = 0; i < segs.size(); ++i) {
+    EXPECT_EQ(segs[i].begin, expected[i][0]);
+    EXPECT_EQ(segs[i].end, expected[i][1]);
+    EXPECT_EQ(segs[i].token, expected[i][2]);
+  }
+
+  std::vector<int32_t> ids;
+  processor.EncodeIds(str, &ids, "number", false, &segs, true);
+  EXPECT_EQ(ids.size(), 6);
+  ASSERT_EQ(segs.size(), expected.size());
+  for (size_t i = 0; i < segs.size(); ++i) {
+    EXPECT_EQ(segs[i].begin, expected[i][0]);
+    EXPECT_EQ(segs[i].end, expected[i][1]);
+  }
+}
+
+TEST(PinyinEncoder, TestEncodeCache) {
+  std::string vocab_path = "cppinyin/python/cppinyin/resources/pinyin.raw";
+  PinyinEncoder processor(vocab_path);
+  processor.EnableCache(1 << 20, 4);
+
+  std::vector<std::string> pieces;
+  std::vector<std::string> segs;
+  processor.Encode("我是中国人", &pieces, "number", false, &segs);
+  processor.Encode("我是中国人", &pieces, "number", false, &segs);
+  EXPECT_EQ(pieces, std::vector<std::string>(
+                        {"wo3", "shi4", "zhong1", "guo2", "ren2"}));
+  EXPECT_EQ(segs,
+            std::vector<std::string>({"我", "是", "中国", "人"}));
+  // The options are a part of the key.
+  processor.Encode("我是中国人", &pieces, "normal", true);
+  EXPECT_EQ(pieces, std::vector<std::string>(
+                        {"w", "ǒ", "sh", "ì", "zh", "ōng", "g", "uó", "r",
+                         "én"}));
+  auto stats = processor.GetCacheStats();
+  EXPECT_EQ(stats.hits, 1);
+  EXPECT_EQ(stats.misses, 2);
+  EXPECT_EQ(stats.entries, 2);
+  EXPECT_EQ(stats.evictions, 0);
+
+  // The batch calls share the cache.
+  std::vector<std::string> strs(1000, "银行行长");
+  std::vector<std::vector<std::string>> batch;
+  processor.Encode(strs, &batch);
+  for (const auto &p : batch) {
+    EXPECT_EQ(p, std::vector<std::string>(
+                     {"yin2", "hang2", "xing2", "chang2"}));
+  }
+  stats = processor.GetCacheStats();
+  EXPECT_EQ(stats.hits + stats.misses, 1003);
+  EXPECT_GE(stats.hits, 1000 - std::thread::hardware_concurrency() - 1);
+
+  // A small cache evicts the least recently used results.
+  processor.EnableCache(2048, 1);
+  for (int32_t i = 0; i < 100; ++i) {
+    processor.Encode("我是中国人 " + std::to_string(i), &pieces);
+  }
+  stats = processor.GetCacheStats();
+  EXPECT_GT(stats.evictions, 0);
+  EXPECT_LE(stats.bytes, 2048);
+  EXPECT_EQ(stats.entries + stats.evictions, 100);
+
+  processor.ClearCache();
+  EXPECT_EQ(processor.GetCacheStats().entries, 0);
+  processor.EnableCache(0);
+  EXPECT_EQ(processor.GetCacheStats().misses, 0);
+}
+
+TEST(PinyinEncoder, TestEncodeRouteCache) {
+  std::string vocab_path = "cppinyin/python/cppinyin/resources/pinyin.raw";
+  PinyinEncoder processor(vocab_path);
+  PinyinEncoder cached(vocab_path);
+  cached.EnableRouteCache(1 << 20, 4);
+  // The result cache stays in front of the route cache.
+  cached.EnableCache(1 << 20, 4);
+
+  std::vector<std::string> strs = {"我是中国人 银行行长", "银行行长 我是中国人",
+                                   "银行行长", "hello 银行行长 我是中国人"};
+  std::vector<std::string> expected;
+  std::vector<std::string> pieces;
+  std::vector<Segment> expected_segs;
+  std::vector<Segment> segs;
+  for (const auto &str : strs) {
+    processor.Encode(str, &expected, &expected_segs, "normal", true, true);
+    cached.Encode(str, &pieces, &segs, "normal", true, true);
+    EXPECT_EQ(pieces, expected);
+    ASSERT_EQ(segs.size(), expected_segs.size());
+    for (size_t i = 0; i < segs.size(); ++i) {
+      EXPECT_EQ(segs[i].begin, expected_segs[i].begin);
+      EXPECT_EQ(segs[i].end, expected_segs[i].end);
+      EXPECT_EQ(segs[i].token, expected_segs[i].token);
+    }
+    std::vector<int32_t> ids;
+    std::vector<int32_t> expected_ids;
+    processor.EncodeIds(str, &expected_ids);
+    cached.EncodeIds(str, &ids);
+    EXPECT_EQ(ids, expected_ids);
+  }
+  // The words of the EncodeIds calls are all in the cache.
+  auto stats = cached.GetRouteCacheStats();
+  EXPECT_EQ(stats.entries, 3);
+  EXPECT_EQ(stats.misses, 3);
+  EXPECT_EQ(stats.hits, 4 + 9);
+  EXPECT_NEAR(stats.HitRatio(), 13.0 / 16, 1e-9);
+
+  cached.ClearCache();
+  EXPECT_EQ(cached.GetRouteCacheStats().entries, 0);
+  cached.EnableRouteCache(0);
+  EXPECT_EQ(cached.GetRouteCacheStats().HitRatio(), 0);
+}
+
+TEST(PinyinEncoder, TestUserWords) {
+  std::string vocab_path = "cppinyin/python/cppinyin/resources/pinyin.raw";
+  PinyinEncoder processor(vocab_path);
+  processor.EnableCache(1 << 20, 4);
+  processor.EnableRouteCache(1 << 20, 4);
+
+  std::vector<std::string> pieces;
+  std::vector<std::string> segs;
+  processor.Encode("银行行长", &pieces);
+  EXPECT_EQ(pieces, std::vector<std::string>(
+                        {"yin2", "hang2", "xing2", "chang2"}));
+
+  // A new key, scored against the keys of the dictionary.
+  EXPECT_TRUE(processor.AddUserWord("行长", -2.0, {"hang2", "zhǎng"}));
+  processor.Encode("银行行长", &pieces, "number", false, &segs);
+  EXPECT_EQ(pieces, std::vector<std::string>(
+                        {"yin2", "hang2", "hang2", "zhang3"}));
+  EXPECT_EQ(segs, std::vector<std::string>({"银行", "行长"}));
+
+  // A key of the dictionary, whose entry is replaced.
+  EXPECT_TRUE(processor.AddUserWord("中国", -7.0, {"zhong4", "guo2"}));
+  processor.Encode("我是中国人", &pieces);
+  EXPECT_EQ(pieces, std::vector<std::string>(
+                        {"wo3", "shi4", "zhong4", "guo2", "ren2"}));
+  std::vector<int32_t> ids;
+  processor.EncodeIds("中国", &ids);
+  EXPECT_EQ(ids, std::vector<int32_t>({processor.PinyinToId("zhong4"),
+                                       processor.PinyinToId("guo2")}));
+
+  // ASCII keys split the ASCII runs into characters.
+  EXPECT_TRUE(processor.AddUserWord("ok", -1.0, {"hao3"}));
+  processor.Encode("ok好 love", &pieces);
+  EXPECT_EQ(pieces, std::vector<std::string>({"hao3", "好", "love"}));
+
+  EXPECT_FALSE(processor.AddUserWord("", -1.0, {"hao3"}));
+  EXPECT_FALSE(processor.AddUserWord("好 的", -1.0, {"hao3", "de"}));
+  EXPECT_FALSE(processor.AddUserWord("好", -1.0, {}));
+  EXPECT_FALSE(processor.AddUserWord("好", -1.0, {"hao9"}));
+  EXPECT_EQ(processor.NumUserWords(), 3);
+
+  EXPECT_TRUE(processor.RemoveUserWord("中国"));
+  EXPECT_FALSE(processor.RemoveUserWord("中国"));
+  processor.Encode("我是中国人", &pieces);
+  EXPECT_EQ(pieces, std::vector<std::string>(
+                        {"wo3", "shi4", "zhong1", "guo2", "ren2"}));
+
+  std::string user_path = "cppinyin_test_user.raw";
+  {
+    std::ofstream ofile(user_path);
+    ofile << "中国 -7.0 zhōng guò\n\n行长 -2.0 háng zhǎng\n";
+  }
+  processor.LoadUserWords(user_path);
+  std::remove(user_path.c_str());
+  processor.Encode("中国银行行长", &pieces);
+  EXPECT_EQ(pieces,
+            std::vector<std::string>({"zhong1", "guo4", "yin2", "hang2",
+                                      "hang2", "zhang3"}));
+
+  // User words are kept by Load.
+  processor.Load(vocab_path);
+  EXPECT_EQ(processor.NumUserWords(), 3);
+  processor.ClearUserWords();
+  EXPECT_EQ(processor.NumUserWords(), 0);
+  processor.Encode("中国银行行长", &pieces);
+  EXPECT_EQ(pieces,
+            std::vector<std::string>({"zhong1", "guo2", "yin2", "hang2",
+                                      "xing2", "chang2"}));
+}
+
+TEST(PinyinEncoder, TestUserWordsConcurrentEncode) {
+  std::string vocab_path = "cppinyin/python/cppinyin/resources/pinyin.raw";
+  PinyinEncoder processor(vocab_path);
+  processor.EnableRouteCache(1 << 20, 4);
+
+  // Each Encode sees the user words either before or after a change, never a
+  // mix of them.
+  const std::vector<std::string> before = {"yin2", "hang2", "xing2", "chang2",
+                                           "zhong1", "guo2"};
+  const std::vector<std::string> after = {"yin2", "hang2", "hang2", "zhang3",
+                                          "zhong4", "guo2"};
+  std::atomic<bool> done(false);
+  std::vector<std::thread> threads;
+  std::atomic<int32_t> num_mixed(0);
+  for (int32_t t = 0; t < 4; ++t) {
+    threads.emplace_back([&]() {
+      std::vector<std::string> pieces;
+      while (!done.load()) {
+        processor.Encode("银行行长 中国", &pieces);
+        if (pieces != before && pieces != after) {
+          ++num_mixed;
+        }
+      }
+    });
+  }
+  std::string user_path = "cppinyin_test_concurrent_user.raw";
+  {
+    std::ofstream ofile(user_path);
+    ofile << "行长 -2.0 hang2 zhang3\n中国 -7.0 zhong4 guo2\n";
+  }
+  for (int32_t i = 0; i < 200; ++i) {
+    processor.LoadUserWords(user_path);
+    processor.ClearUserWords();
+  }
+  std::remove(user_path.c_str());
+  done.store(true);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(num_mixed.load(), 0);
+}
+
+TEST(PinyinEncoder, TestChangesDuringGracePeriod) {
+  PinyinEncoder processor;
+  std::atomic<bool> added(false);
+  std::thread writer;
+  {
+    // A reader holds the old user words, the writer waits for it after the
+    // change is published, without holding up the other changes.
+    RcuReadGuard guard;
+    writer = std::thread([&]() {
+      processor.AddUserWord("中国", -7.0, {"zhong1", "guo2"});
+      added.store(true);
+    });
+    while (processor.NumUserWords() == 0) {
+      std::this_thread::yield();
+    }
+    EXPECT_EQ(processor.NumLayers(), 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    EXPECT_FALSE(added.load());
+  }
+  writer.join();
+  EXPECT_TRUE(added.load());
+}
+
 TEST(PinyinEncoder, TestLoadFromNormal) {
   std::string vocab_path = "cppinyin/python/cppinyin/resources/pinyin.raw";
   PinyinEncoder processor(vocab_path);
@@ -219,42 +684,42 @@ TEST(PinyinEncoder, TestToInitialToFinal) {
 
   std::vector<std::string> res;
   processor.ToInitials(pinyins, &res);
-  for (int32_t i = 0; i < initials.size(); ++i) {
+  for (size_t i = 0; i < initials.size(); ++i) {
     EXPECT_EQ(res[i], initials[i]);
   }
 
   processor.ToInitials(pinyin_numbers, &res);
-  for (int32_t i = 0; i < initials.size(); ++i) {
+  for (size_t i = 0; i < initials.size(); ++i) {
     EXPECT_EQ(res[i], initials[i]);
   }
 
   processor.ToFinals(pinyins, &res, "normal");
-  for (int32_t i = 0; i < finals.size(); ++i) {
+  for (size_t i = 0; i < finals.size(); ++i) {
     EXPECT_EQ(res[i], finals[i]);
   }
 
   processor.ToFinals(pinyin_numbers, &res, "normal");
-  for (int32_t i = 0; i < finals.size(); ++i) {
+  for (size_t i = 0; i < finals.size(); ++i) {
     EXPECT_EQ(res[i], finals[i]);
   }
 
   processor.ToFinals(pinyins, &res, "number");
-  for (int32_t i = 0; i < finals_numbers.size(); ++i) {
+  for (size_t i = 0; i < finals_numbers.size(); ++i) {
     EXPECT_EQ(res[i], finals_numbers[i]);
   }
 
   processor.ToFinals(pinyin_numbers, &res, "number");
-  for (int32_t i = 0; i < finals_numbers.size(); ++i) {
+  for (size_t i = 0; i < finals_numbers.size(); ++i) {
     EXPECT_EQ(res[i], finals_numbers[i]);
   }
 
   processor.ToFinals(pinyins, &res, "none");
-  for (int32_t i = 0; i < finals_none.size(); ++i) {
+  for (size_t i = 0; i < finals_none.size(); ++i) {
     EXPECT_EQ(res[i], finals_none[i]);
   }
 
   processor.ToFinals(pinyin_numbers, &res, "none");
-  for (int32_t i = 0; i < finals_none.size(); ++i) {
+  for (size_t i = 0; i < finals_none.size(); ++i) {
     EXPECT_EQ(res[i], finals_none[i]);
   }
 }
@@ -293,6 +758,426 @@ TEST(PinyinEncoder, TestSaveLoad) {
             "wo3 shi4 zhong1 guo2 ren2 wo3 ai4 wo3 de love you zu3 guo2 ");
 }
 
+TEST(PinyinEncoder, TestBuildLargeVocab) {
+  // A dictionary large enough to be parsed in several chunks: all the pairs
+  // of 200 characters, with CRLF line ends and blank lines.
+  const char *syllables[] = {"mā", "ma2", "mǎ", "ma4", "ma"};
+  auto character = [](int32_t i) {
+    int32_t c = 0x4E00 + i;
+    std::string s;
+    s.push_back(static_cast<char>(0xE0 | (c >> 12)));
+    s.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+    s.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+    return s;
+  };
+  std::ostringstream oss;
+  for (int32_t i = 0; i < 200; ++i) {
+    oss << character(i) << " -10.5 " << syllables[i % 5] << "\n";
+  }
+  oss << "\n";
+  for (int32_t i = 0; i < 200; ++i) {
+    for (int32_t j = 0; j < 200; ++j) {
+      oss << character(i) << character(j) << "\t-5.25 " << syllables[i % 5]
+          << " " << syllables[j % 5] << "\r\n";
+    }
+  }
+  // A duplicated key, the first one is kept.
+  oss << character(0) << character(1) << " -1 ma4 mā\n";
+  std::string text = oss.str();
+  ASSERT_GT(text.size(), 512 << 10);
+
+  std::istringstream is(text);
+  PinyinEncoder processor(is, 4);
+  std::vector<std::string> pieces;
+  processor.Encode(character(0) + character(1), &pieces);
+  EXPECT_EQ(pieces, std::vector<std::string>({"ma1", "ma2"}));
+  processor.Encode(character(7) + character(199) + " " + character(23),
+                   &pieces);
+  EXPECT_EQ(pieces, std::vector<std::string>({"ma3", "ma", "ma4"}));
+
+  // Saved and loaded, the model is the same.
+  processor.Save("/tmp/pinyin_large.dict");
+  PinyinEncoder loaded("/tmp/pinyin_large.dict");
+  for (int32_t i = 0; i < 200; i += 7) {
+    std::string str = character(i) + character(199 - i) + " " + character(i);
+    std::vector<std::string> expected;
+    processor.Encode(str, &expected, "normal", true);
+    loaded.Encode(str, &pieces, "normal", true);
+    EXPECT_EQ(pieces, expected);
+  }
+}
+
+TEST(PinyinEncoder, TestParseFloat) {
+  auto parse = [](const std::string &text, float *value) {
+    return ParseFloat(text.data(), text.data() + text.size(), value);
+  };
+  float value = 0;
+  for (const std::string text : {"-5.25", "+3", ".5", "7.", "-1e2", "2E-3",
+                                 "0.123456789", "1.5e20", "-0"}) {
+    EXPECT_TRUE(parse(text, &value)) << text;
+    EXPECT_EQ(value, std::strtof(text.c_str(), nullptr)) << text;
+  }
+  // What `std::istream >> float` does not read, or not as a finite number.
+  for (const std::string text :
+       {"", "-", ".", "e5", "1e", "1e+", " 1", "1 ", "1.5x", "inf", "-inf",
+        "nan", "infinity", "0x1p3", "1e99", "-1e99", "1..5"}) {
+    EXPECT_FALSE(parse(text, &value)) << text;
+  }
+}
+
+TEST(PinyinEncoder, TestDuplicateKeys) {
+  // Of the lines with the same key, the first one is kept.
+  std::istringstream is("我 -5 wǒ\n"
+                        "我我 -7 qiè guó\n"
+                        "我我 -5 ér mín\n");
+  PinyinEncoder processor(is);
+  std::vector<std::string> pieces;
+  processor.Encode("我我", &pieces);
+  EXPECT_EQ(pieces, std::vector<std::string>({"qie4", "guo2"}));
+
+  processor.Save("/tmp/pinyin_duplicate.dict");
+  PinyinEncoder loaded("/tmp/pinyin_duplicate.dict");
+  loaded.Encode("我我", &pieces);
+  EXPECT_EQ(pieces, std::vector<std::string>({"qie4", "guo2"}));
+}
+
+TEST(PinyinEncoder, TestLoadMapped) {
+  std::string vocab_path = "cppinyin/python/cppinyin/resources/pinyin.raw";
+  PinyinEncoder processor_t(vocab_path);
+  processor_t.Save("/tmp/pinyin_mapped.dict");
+
+  // Loaded from a path the model is mapped, from a stream it is read.
+  PinyinEncoder processor_m("/tmp/pinyin_mapped.dict");
+  std::ifstream is("/tmp/pinyin_mapped.dict", std::ifstream::binary);
+  PinyinEncoder processor_s(is);
+
+  std::string str = "我是中国 人我爱我的 love you 银行行长";
+  std::vector<std::string> expected;
+  std::vector<std::string> pieces;
+  processor_t.Encode(str, &expected, "normal", true);
+  processor_m.Encode(str, &pieces, "normal", true);
+  EXPECT_EQ(pieces, expected);
+  processor_s.Encode(str, &pieces, "normal", true);
+  EXPECT_EQ(pieces, expected);
+
+  // A mapped model saves as the model it was loaded from.
+  processor_m.Save("/tmp/pinyin_mapped2.dict");
+  processor_m.Load("/tmp/pinyin_mapped2.dict");
+  processor_m.Encode(str, &pieces, "normal", true);
+  EXPECT_EQ(pieces, expected);
+}
+
+TEST(PinyinEncoder, TestReloadConcurrentEncode) {
+  std::string vocab_path = "cppinyin/python/cppinyin/resources/pinyin.raw";
+  std::string other_path = "cppinyin_test_reload.raw";
+  std::string model_path = "cppinyin_test_reload.dict";
+  {
+    std::ofstream ofile(other_path);
+    ofile << "银行 -1.0 yin2 xing2\n行长 -1.0 hang2 zhang3\n"
+          << "中国 -1.0 zhong4 guo2\n";
+  }
+  std::string str = "银行行长 中国";
+  std::vector<std::string> before;
+  std::vector<std::string> after;
+  PinyinEncoder(vocab_path).Encode(str, &before);
+  {
+    // The other model is mapped when reloaded.
+    PinyinEncoder other(other_path);
+    other.Encode(str, &after);
+    other.Save(model_path);
+  }
+  ASSERT_NE(before, after);
+
+  PinyinEncoder processor(vocab_path);
+  processor.EnableCache(1 << 20, 4);
+  processor.EnableRouteCache(1 << 20, 4);
+  // Each Encode sees one of the models, never a mix of them nor a freed one.
+  std::atomic<bool> done(false);
+  std::vector<std::thread> threads;
+  std::atomic<int32_t> num_mixed(0);
+  for (int32_t t = 0; t < 4; ++t) {
+    threads.emplace_back([&]() {
+      std::vector<std::string> pieces;
+      while (!done.load()) {
+        processor.Encode(str, &pieces);
+        if (pieces != before && pieces != after) {
+          ++num_mixed;
+        }
+      }
+    });
+  }
+  for (int32_t i = 0; i < 100; ++i) {
+    processor.Reload(model_path);
+    processor.Reload(vocab_path);
+  }
+  done.store(true);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(num_mixed.load(), 0);
+
+  std::vector<std::string> pieces;
+  processor.Encode(str, &pieces);
+  EXPECT_EQ(pieces, before);
+  processor.Reload(model_path);
+  processor.Encode(str, &pieces);
+  EXPECT_EQ(pieces, after);
+  std::remove(other_path.c_str());
+  std::remove(model_path.c_str());
+}
+
+TEST(PinyinEncoder, TestLayers) {
+  std::string vocab_path = "cppinyin/python/cppinyin/resources/pinyin.raw";
+  PinyinEncoder processor(vocab_path);
+  processor.EnableRouteCache(1 << 20, 4);
+  std::string domain_path = "cppinyin_test_domain.raw";
+  std::string custom_path = "cppinyin_test_custom.raw";
+  std::string custom_model_path = "cppinyin_test_custom.dict";
+  {
+    std::ofstream ofile(domain_path);
+    ofile << "行长 -1.0 hang2 zhang3\n中国 -7.0 zhong3 guo2\n";
+  }
+  {
+    std::ofstream ofile(custom_path);
+    ofile << "中国 -7.0 zhong4 guo2\n";
+  }
+  // A layer compiled on its own, mapped when added.
+  PinyinEncoder(custom_path).Save(custom_model_path);
+
+  std::string str = "银行行长 中国";
+  auto encode = [&]() {
+    std::vector<std::string> pieces;
+    processor.Encode(str, &pieces);
+    return pieces;
+  };
+  const std::vector<std::string> base = {"yin2",   "hang2",  "xing2",
+                                         "chang2", "zhong1", "guo2"};
+  EXPECT_EQ(encode(), base);
+  EXPECT_FALSE(processor.AddLayer("", domain_path, 1));
+
+  // Above the model, the layer hides its 中国 and adds 行长.
+  EXPECT_TRUE(processor.AddLayer("domain", domain_path, 1));
+  EXPECT_EQ(processor.NumLayers(), 1);
+  EXPECT_EQ(encode(), std::vector<std::string>({"yin2", "hang2", "hang2",
+                                                "zhang3", "zhong3", "guo2"}));
+
+  // Below the model, the layer only adds 行长.
+  EXPECT_TRUE(processor.AddLayer("domain", domain_path, -1));
+  EXPECT_EQ(processor.NumLayers(), 1);
+  EXPECT_EQ(encode(), std::vector<std::string>({"yin2", "hang2", "hang2",
+                                                "zhang3", "zhong1", "guo2"}));
+
+  // The score offset applies to the keys of the layer.
+  EXPECT_TRUE(processor.AddLayer("domain", domain_path, -1, -100));
+  EXPECT_EQ(encode(), base);
+
+  EXPECT_TRUE(processor.AddLayer("domain", domain_path, 1));
+  EXPECT_TRUE(processor.AddLayer("custom", custom_model_path, 2));
+  EXPECT_EQ(processor.NumLayers(), 2);
+  EXPECT_EQ(encode(), std::vector<std::string>({"yin2", "hang2", "hang2",
+                                                "zhang3", "zhong4", "guo2"}));
+  // Among equal priorities the layer added last comes first.
+  EXPECT_TRUE(processor.AddLayer("domain", domain_path, 2));
+  EXPECT_EQ(encode(), std::vector<std::string>({"yin2", "hang2", "hang2",
+                                                "zhang3", "zhong3", "guo2"}));
+
+  // User words are above all the layers.
+  EXPECT_TRUE(processor.AddUserWord("中国", -7.0, {"zhong1", "guo2"}));
+  EXPECT_EQ(encode(), std::vector<std::string>({"yin2", "hang2", "hang2",
+                                                "zhang3", "zhong1", "guo2"}));
+  processor.ClearUserWords();
+
+  // Load replaces the model only, and Save saves it without the layers.
+  processor.Load(custom_model_path);
+  EXPECT_EQ(processor.NumLayers(), 2);
+  std::string saved_path = "cppinyin_test_saved.dict";
+  processor.Save(saved_path);
+  std::vector<std::string> pieces;
+  PinyinEncoder(saved_path).Encode(str, &pieces);
+  EXPECT_EQ(pieces,
+            std::vector<std::string>({"银行行长", "zhong4", "guo2"}));
+  std::remove(saved_path.c_str());
+  EXPECT_FALSE(processor.RemoveLayer("other"));
+  EXPECT_TRUE(processor.RemoveLayer("domain"));
+  EXPECT_EQ(encode(),
+            std::vector<std::string>({"银行行长", "zhong4", "guo2"}));
+  processor.ClearLayers();
+  EXPECT_EQ(processor.NumLayers(), 0);
+  processor.Load(vocab_path);
+  EXPECT_EQ(encode(), base);
+  std::remove(domain_path.c_str());
+  std::remove(custom_path.c_str());
+  std::remove(custom_model_path.c_str());
+}
+
+TEST(PinyinEncoder, TestPhraseIndex) {
+  std::string vocab_path = "cppinyin/python/cppinyin/resources/pinyin.raw";
+  std::string str = "我是中国 人我爱我的 love you 银行行长 \x80长大\xe4\xb8 长大";
+  std::vector<std::string> expected;
+  PinyinEncoder(vocab_path).Encode(str, &expected, "normal", false);
+
+  PinyinEncoder processor;
+  EXPECT_FALSE(processor.SetPhraseIndex("unknown"));
+  for (const auto &name : PhraseIndexNames()) {
+    SCOPED_TRACE(name);
+    EXPECT_TRUE(processor.SetPhraseIndex(name));
+    processor.Load(vocab_path);
+    std::vector<std::string> pieces;
+    processor.Encode(str, &pieces, "normal", false);
+    EXPECT_EQ(pieces, expected);
+
+    // The model is saved and mapped with its index.
+    std::string path = "cppinyin_test_index_" + name + ".dict";
+    processor.Save(path);
+    PinyinEncoder mapped(path);
+    mapped.Encode(str, &pieces, "normal", false);
+    EXPECT_EQ(pieces, expected);
+
+    // Along with the layers and the user words, indexed by darts.
+    mapped.AddLayer("domain", vocab_path, 1);
+    mapped.AddUserWord("长大", -1.0, {"chang2", "da4"});
+    mapped.Encode(str, &pieces, "normal", false);
+    EXPECT_EQ(pieces.back(), "dà");
+    EXPECT_EQ(pieces[pieces.size() - 2], "cháng");
+    std::remove(path.c_str());
+  }
+}
+
+TEST(PinyinEncoderDeathTest, TestLoadCorruptedModel) {
+  std::string vocab_path = "cppinyin/python/cppinyin/resources/pinyin.raw";
+  std::string path = "/tmp/pinyin_corrupted.dict";
+  PinyinEncoder(vocab_path).Save(path);
+  std::string model;
+  {
+    std::ifstream is(path, std::ifstream::binary);
+    model.assign(std::istreambuf_iterator<char>(is),
+                 std::istreambuf_iterator<char>());
+  }
+  // Returns the start of section `id`. The section directory, entries of id,
+  // crc, offset and size, follows the 64 bytes header.
+  auto section = [&model](uint32_t id) {
+    uint32_t num_sections;
+    std::memcpy(&num_sections, model.data() + 24, 4);
+    for (uint32_t i = 0; i < num_sections; ++i) {
+      const char *entry = model.data() + 64 + 24 * i;
+      uint32_t entry_id;
+      uint64_t offset;
+      std::memcpy(&entry_id, entry, 4);
+      std::memcpy(&offset, entry + 8, 8);
+      if (entry_id == id) {
+        return &model[offset];
+      }
+    }
+    return static_cast<char *>(nullptr);
+  };
+  auto write = [&model, &path]() {
+    std::ofstream of(path, std::ofstream::binary);
+    of.write(model.data(), model.size());
+  };
+  // Flips a bit of the score of the first key.
+  char *scores = section(2);
+  ASSERT_NE(scores, nullptr);
+  scores[0] ^= 1;
+  write();
+  EXPECT_DEATH(PinyinEncoder processor(path), "Checksum mismatch");
+  // The large sections are not verified on request, e.g. for a fast start.
+  PinyinEncoder processor;
+  processor.Load(path, false);
+
+  // Their structure is checked anyway.
+  auto expect_invalid = [&path](const std::string &message) {
+    EXPECT_DEATH(
+        {
+          PinyinEncoder processor;
+          processor.Load(path, false);
+        },
+        message);
+  };
+  // The reading of the first key, and the end offset of the first reading.
+  const uint32_t invalid = 0xFFFFFF;
+  char *key_readings = section(3);
+  ASSERT_NE(key_readings, nullptr);
+  std::string saved(key_readings, 4);
+  std::memcpy(key_readings, &invalid, 4);
+  write();
+  expect_invalid("Invalid key readings");
+  std::memcpy(key_readings, saved.data(), 4);
+  char *reading_offsets = section(4);
+  ASSERT_NE(reading_offsets, nullptr);
+  std::memcpy(reading_offsets + 4, &invalid, 4);
+  write();
+  expect_invalid("Invalid reading offsets");
+}
+
+TEST(PinyinEncoderDeathTest, TestLoadUnknownSyllable) {
+  // A reading can not drop a syllable, a spelling that is not one fails the
+  // load of a dictionary and of a v1 model.
+  EXPECT_DEATH(
+      {
+        std::istringstream is("我 -5 wǒ\n中国 -7 zhong1 gwo2\n");
+        PinyinEncoder processor(is);
+      },
+      "gwo2 is not in the NORMAL_TO_TONE map");
+
+  std::string path = "/tmp/pinyin_unknown.dict";
+  {
+    std::ofstream of(path, std::ofstream::binary);
+    WriteHeader(of);
+    WriteUint32(of, 1);
+    WriteFloat(of, -1);
+    WriteUint32(of, 1);
+    WriteUint32(of, 2);
+    WriteString(of, "zhong1");
+    WriteString(of, "gwo2");
+  }
+  const char *keys[] = {"中国"};
+  size_t lengths[] = {6};
+  int32_t values[] = {0};
+  Darts::DoubleArray da;
+  da.build(1, keys, lengths, values);
+  da.save(path.c_str(), "ab");
+  EXPECT_DEATH(PinyinEncoder processor(path),
+               "gwo2 is not in the NORMAL_TO_TONE map");
+}
+
+TEST(PinyinEncoder, TestLoadLegacyModel) {
+  // A model of format v1: the scores, the readings as strings and the double
+  // array units.
+  std::string path = "/tmp/pinyin_legacy.dict";
+  {
+    std::ofstream of(path, std::ofstream::binary);
+    WriteHeader(of);
+    WriteUint32(of, 2);
+    WriteFloat(of, -1);
+    WriteFloat(of, -2);
+    WriteUint32(of, 2);
+    WriteUint32(of, 2);
+    WriteString(of, "zhong1");
+    WriteString(of, "guó");
+    WriteUint32(of, 1);
+    WriteString(of, "guo2");
+  }
+  const char *keys[] = {"中国", "国"};
+  size_t lengths[] = {6, 3};
+  int32_t values[] = {0, 1};
+  Darts::DoubleArray da;
+  da.build(2, keys, lengths, values);
+  da.save(path.c_str(), "ab");
+
+  PinyinEncoder processor(path);
+  std::vector<std::string> pieces;
+  processor.Encode("中国国 中", &pieces);
+  EXPECT_EQ(pieces,
+            std::vector<std::string>({"zhong1", "guo2", "guo2", "中"}));
+
+  // Saved again, it is a mapped model.
+  processor.Save(path);
+  PinyinEncoder processor_m(path);
+  processor_m.Encode("中国国 中", &pieces);
+  EXPECT_EQ(pieces,
+            std::vector<std::string>({"zhong1", "guo2", "guo2", "中"}));
+}
+
 TEST(PinyinEncoder, TestAllPinyin) {
   PinyinEncoder processor;
   std::ostringstream oss;
@@ -384,7 +1269,7 @@ TEST(PinyinEncoder, TestValidPinyin) {
       true, true, true, true, true, true, true, true, true, true,  true, true,
       true, true, true, true, true, true, true, true, true, true,  true};
 
-  for (int32_t i = 0; i < pinyins.size(); ++i) {
+  for (size_t i = 0; i < pinyins.size(); ++i) {
     EXPECT_EQ(processor.ValidPinyin(pinyins[i]), valids[i]);
   }
 
@@ -393,7 +1278,7 @@ TEST(PinyinEncoder, TestValidPinyin) {
   valids = {true, true, true,  true,  true, true, true,
             true, true, false, false, true, true};
 
-  for (int32_t i = 0; i < pinyins.size(); ++i) {
+  for (size_t i = 0; i < pinyins.size(); ++i) {
     EXPECT_EQ(processor.ValidPinyin(pinyins[i], "normal"), valids[i]);
   }
 
@@ -402,7 +1287,7 @@ TEST(PinyinEncoder, TestValidPinyin) {
   valids = {true, true, true,  true,  true, true, true,
             true, true, false, false, true, true};
 
-  for (int32_t i = 0; i < pinyins.size(); ++i) {
+  for (size_t i = 0; i < pinyins.size(); ++i) {
     EXPECT_EQ(processor.ValidPinyin(pinyins[i], "number"), valids[i]);
   }
 
@@ -411,7 +1296,7 @@ TEST(PinyinEncoder, TestValidPinyin) {
   valids = {true, true, true,  true, true, true, true,
             true, true, false, true, true, true};
 
-  for (int32_t i = 0; i < pinyins.size(); ++i) {
+  for (size_t i = 0; i < pinyins.size(); ++i) {
     EXPECT_EQ(processor.ValidPinyin(pinyins[i], "none"), valids[i]);
   }
 }
@@ -0,0 +1,82 @@
+/**
+ * Copyright      2024    Wei Kang (wkang@pku.edu.cn)
+ *
+ * See LICENSE for clarification regarding multiple authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "cppinyin/csrc/executor.h"
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+namespace cppinyin {
+
+void InlineExecutor::ParallelFor(
+    size_t begin, size_t end, size_t grain,
+    const std::function<void(size_t, size_t)> &f) {
+  grain = std::max<size_t>(grain, 1);
+  for (size_t first = begin; first < end; first += grain) {
+    f(first, std::min(end, first + grain));
+  }
+}
+
+ThreadPoolExecutor::ThreadPoolExecutor(int32_t num_threads)
+    : num_threads_(num_threads > 0 ? num_threads
+                                   : std::thread::hardware_concurrency()) {}
+
+ThreadPoolExecutor::ThreadPoolExecutor(
+    std::shared_ptr<WorkStealingThreadPool> pool)
+    : num_threads_(pool->size()), pool_(std::move(pool)) {}
+
+void ThreadPoolExecutor::ParallelFor(
+    size_t begin, size_t end, size_t grain,
+    const std::function<void(size_t, size_t)> &f) {
+  if (begin >= end) {
+    return;
+  }
+  grain = std::max<size_t>(grain, 1);
+  size_t num_chunks = (end - begin + grain - 1) / grain;
+  // A single chunk runs on the calling thread, without starting the pool.
+  if (num_chunks == 1) {
+    return f(begin, end);
+  }
+  Pool()->parallel_for(0, num_chunks, 1, [&](size_t c) {
+    size_t first = begin + c * grain;
+    f(first, std::min(end, first + grain));
+  });
+}
+
+std::shared_ptr<WorkStealingThreadPool> ThreadPoolExecutor::Pool() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!pool_) {
+    pool_ = std::make_shared<WorkStealingThreadPool>(num_threads_);
+  }
+  return pool_;
+}
+
+bool ThreadPoolExecutor::Started() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return pool_ != nullptr;
+}
+
+std::shared_ptr<Executor> DefaultExecutor() {
+  static std::shared_ptr<Executor> executor =
+      std::make_shared<ThreadPoolExecutor>(0);
+  return executor;
+}
+
+} // namespace cppinyin
@@ -0,0 +1,221 @@
+/**
+ * Copyright      2024    Wei Kang (wkang@pku.edu.cn)
+ *
+ * See LICENSE for clarification regarding multiple authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CPPINYIN_CSRC_EXECUTOR_H_
+#define CPPINYIN_CSRC_EXECUTOR_H_
+
+#include "cppinyin/csrc/work_stealing_pool.h"
+#include <algorithm>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
+#if defined(CPPINYIN_WITH_TBB)
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/partitioner.h>
+#include <tbb/task_arena.h>
+#endif
+
+namespace cppinyin {
+
+// Runs the batch calls of PinyinEncoder. Several encoders may share one
+// executor, so that a process holding many of them does not run more
+// threads than it has cores.
+class Executor {
+public:
+  virtual ~Executor() = default;
+
+  // Calls f(first, last) for chunks [first, last) of at most `grain` indexes
+  // covering [begin, end), possibly from several threads at once. Returns once
+  // all the chunks are done.
+  virtual void ParallelFor(size_t begin, size_t end, size_t grain,
+                           const std::function<void(size_t, size_t)> &f) = 0;
+
+  // The number of threads ParallelFor may run on at once, the calling thread
+  // included. It is used to size the chunks.
+  virtual size_t Concurrency() const = 0;
+};
+
+// Runs everything on the calling thread.
+class InlineExecutor : public Executor {
+public:
+  void ParallelFor(size_t begin, size_t end, size_t grain,
+                   const std::function<void(size_t, size_t)> &f) override;
+
+  size_t Concurrency() const override { return 1; }
+};
+
+// Runs on a WorkStealingThreadPool. The pool is either given, and may then
+// be shared with other code, or created with `num_threads` threads on the
+// first call to ParallelFor, so that an encoder never running a batch never
+// starts a thread.
+class ThreadPoolExecutor : public Executor {
+public:
+  // num_threads <= 0 means std::thread::hardware_concurrency().
+  explicit ThreadPoolExecutor(int32_t num_threads);
+
+  explicit ThreadPoolExecutor(std::shared_ptr<WorkStealingThreadPool> pool);
+
+  void ParallelFor(size_t begin, size_t end, size_t grain,
+                   const std::function<void(size_t, size_t)> &f) override;
+
+  size_t Concurrency() const override { return num_threads_ + 1; }
+
+  // Returns the pool, creating it if needed.
+  std::shared_ptr<WorkStealingThreadPool> Pool();
+
+  // Whether the pool has been created.
+  bool Started() const;
+
+private:
+  size_t num_threads_;
+  mutable std::mutex mutex_;
+  std::shared_ptr<WorkStealingThreadPool> pool_;
+};
+
+// The executor of the encoders not given one: a ThreadPoolExecutor of
+// std::thread::hardware_concurrency() threads shared by the whole process,
+// created on first use.
+std::shared_ptr<Executor> DefaultExecutor();
+
+// Sorts `v` like std::stable_sort, on `executor`: runs of the vector are
+// sorted in parallel, then merged pairwise, the pairs of a round in parallel.
+template <typename T, typename Compare>
+void ParallelStableSort(std::vector<T> *v, Compare comp, Executor *executor) {
+  // Runs shorter than this are not worth a task.
+  constexpr size_t kMinRun = 4096;
+  size_t size = v->size();
+  size_t num_runs = std::min(executor->Concurrency(), size / kMinRun);
+  if (num_runs <= 1) {
+    std::stable_sort(v->begin(), v->end(), comp);
+    return;
+  }
+  std::vector<size_t> bounds(num_runs + 1);
+  for (size_t r = 0; r <= num_runs; ++r) {
+    bounds[r] = size * r / num_runs;
+  }
+  executor->ParallelFor(0, num_runs, 1, [&](size_t first, size_t last) {
+    for (size_t r = first; r < last; ++r) {
+      std::stable_sort(v->begin() + bounds[r], v->begin() + bounds[r + 1],
+                       comp);
+    }
+  });
+  std::vector<T> buffer(size);
+  std::vector<T> *from = v;
+  std::vector<T> *to = &buffer;
+  while (bounds.size() > 2) {
+    size_t num_pairs = (bounds.size() - 1) / 2;
+    executor->ParallelFor(0, num_pairs, 1, [&](size_t first, size_t last) {
+      for (size_t p = first; p < last; ++p) {
+        // std::merge takes the elements of the first run first on ties, which
+        // keeps the sort stable.
+        std::merge(from->begin() + bounds[2 * p],
+                   from->begin() + bounds[2 * p + 1],
+                   from->begin() + bounds[2 * p + 1],
+                   from->begin() + bounds[2 * p + 2],
+                   to->begin() + bounds[2 * p], comp);
+      }
+    });
+    std::vector<size_t> merged;
+    for (size_t r = 0; r < bounds.size(); r += 2) {
+      merged.push_back(bounds[r]);
+    }
+    // An odd run out is moved as it is.
+    if (bounds.size() % 2 == 0) {
+      std::copy(from->begin() + bounds[bounds.size() - 2], from->end(),
+                to->begin() + bounds[bounds.size() - 2]);
+      merged.push_back(bounds.back());
+    }
+    bounds.swap(merged);
+    std::swap(from, to);
+  }
+  if (from != v) {
+    v->swap(buffer);
+  }
+}
+
+#if defined(_OPENMP)
+// Runs on the OpenMP thread team of the calling thread. Enabled by the
+// CPPINYIN_WITH_OPENMP cmake option.
+class OpenMPExecutor : public Executor {
+public:
+  void ParallelFor(size_t begin, size_t end, size_t grain,
+                   const std::function<void(size_t, size_t)> &f) override {
+    if (begin >= end) {
+      return;
+    }
+    grain = std::max<size_t>(grain, 1);
+    int64_t num_chunks = (end - begin + grain - 1) / grain;
+    std::exception_ptr error;
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int64_t c = 0; c < num_chunks; ++c) {
+      size_t first = begin + c * grain;
+      try {
+        f(first, std::min(end, first + grain));
+      } catch (...) {
+#pragma omp critical(cppinyin_executor_error)
+        if (!error) {
+          error = std::current_exception();
+        }
+      }
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  size_t Concurrency() const override { return omp_get_max_threads(); }
+};
+#endif
+
+#if defined(CPPINYIN_WITH_TBB)
+// Runs on the TBB task arena of the calling thread. Enabled by the
+// CPPINYIN_WITH_TBB cmake option.
+class TbbExecutor : public Executor {
+public:
+  void ParallelFor(size_t begin, size_t end, size_t grain,
+                   const std::function<void(size_t, size_t)> &f) override {
+    if (begin >= end) {
+      return;
+    }
+    // The default auto_partitioner may stop splitting above the grain,
+    // simple_partitioner keeps the chunks within it.
+    tbb::parallel_for(
+        tbb::blocked_range<size_t>(begin, end, std::max<size_t>(grain, 1)),
+        [&f](const tbb::blocked_range<size_t> &r) { f(r.begin(), r.end()); },
+        tbb::simple_partitioner());
+  }
+
+  size_t Concurrency() const override {
+    return tbb::this_task_arena::max_concurrency();
+  }
+};
+#endif
+
+} // namespace cppinyin
+
+#endif // CPPINYIN_CSRC_EXECUTOR_H_
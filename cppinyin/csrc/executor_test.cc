@@ -0,0 +1,159 @@
+/**
+ * Copyright      2024  Wei Kang (wkang@pku.edu.cn)
+ *
+ * See LICENSE for clarification regarding multiple authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "cppinyin/csrc/cppinyin.h"
+#include "cppinyin/csrc/executor.h"
+
+namespace cppinyin {
+
+void CheckCoverage(Executor *executor) {
+  for (size_t grain : {0, 1, 3, 100}) {
+    std::vector<int32_t> visits(100, 0);
+    executor->ParallelFor(0, visits.size(), grain,
+                          [&](size_t first, size_t last) {
+                            EXPECT_LT(first, last);
+                            EXPECT_LE(last - first, std::max<size_t>(grain, 1));
+                            for (size_t i = first; i < last; ++i) {
+                              visits[i] += 1;
+                            }
+                          });
+    for (auto v : visits) {
+      EXPECT_EQ(v, 1);
+    }
+  }
+}
+
+TEST(Executor, TestInlineExecutor) {
+  InlineExecutor executor;
+  CheckCoverage(&executor);
+  std::thread::id id;
+  executor.ParallelFor(0, 10, 1, [&](size_t, size_t) {
+    id = std::this_thread::get_id();
+  });
+  EXPECT_EQ(id, std::this_thread::get_id());
+}
+
+TEST(Executor, TestThreadPoolExecutor) {
+  ThreadPoolExecutor executor(3);
+  EXPECT_EQ(executor.Concurrency(), 4);
+  // The pool is started by the first call with more than one chunk.
+  EXPECT_FALSE(executor.Started());
+  executor.ParallelFor(0, 10, 10, [](size_t, size_t) {});
+  EXPECT_FALSE(executor.Started());
+  CheckCoverage(&executor);
+  EXPECT_TRUE(executor.Started());
+
+  auto pool = std::make_shared<WorkStealingThreadPool>(2);
+  ThreadPoolExecutor shared(pool);
+  EXPECT_TRUE(shared.Started());
+  EXPECT_EQ(shared.Pool(), pool);
+  CheckCoverage(&shared);
+}
+
+#if defined(_OPENMP)
+TEST(Executor, TestOpenMPExecutor) {
+  OpenMPExecutor executor;
+  EXPECT_GE(executor.Concurrency(), 1);
+  CheckCoverage(&executor);
+  EXPECT_THROW(executor.ParallelFor(0, 10, 1,
+                                    [](size_t first, size_t) {
+                                      if (first == 5) {
+                                        throw std::runtime_error("chunk 5");
+                                      }
+                                    }),
+               std::runtime_error);
+}
+#endif
+
+#if defined(CPPINYIN_WITH_TBB)
+TEST(Executor, TestTbbExecutor) {
+  TbbExecutor executor;
+  EXPECT_GE(executor.Concurrency(), 1);
+  CheckCoverage(&executor);
+  EXPECT_THROW(executor.ParallelFor(0, 10, 1,
+                                    [](size_t first, size_t) {
+                                      if (first == 5) {
+                                        throw std::runtime_error("chunk 5");
+                                      }
+                                    }),
+               std::runtime_error);
+}
+#endif
+
+TEST(Executor, TestParallelStableSort) {
+  ThreadPoolExecutor executor(4);
+  InlineExecutor inline_executor;
+  // Pairs of a key with many duplicates and of their original position.
+  for (size_t size : {0, 1, 1000, 50000, 100003}) {
+    std::vector<std::pair<int32_t, int32_t>> v(size);
+    uint32_t seed = 1;
+    for (size_t i = 0; i < size; ++i) {
+      seed = seed * 1103515245 + 12345;
+      v[i] = std::make_pair((seed >> 16) % 1000, i);
+    }
+    auto expected = v;
+    auto by_key = [](const std::pair<int32_t, int32_t> &a,
+                     const std::pair<int32_t, int32_t> &b) {
+      return a.first < b.first;
+    };
+    std::stable_sort(expected.begin(), expected.end(), by_key);
+    auto sorted = v;
+    ParallelStableSort(&sorted, by_key, &executor);
+    EXPECT_EQ(sorted, expected);
+    sorted = v;
+    ParallelStableSort(&sorted, by_key, &inline_executor);
+    EXPECT_EQ(sorted, expected);
+  }
+}
+
+TEST(Executor, TestEncoderExecutor) {
+  std::string vocab_path = "cppinyin/python/cppinyin/resources/pinyin.raw";
+  auto executor = std::make_shared<ThreadPoolExecutor>(2);
+  // Encoders sharing one executor, an encoder never running a batch never
+  // starts a thread.
+  PinyinEncoder encoder1(vocab_path, executor);
+  PinyinEncoder encoder2(vocab_path, executor);
+  PinyinEncoder inline_encoder(vocab_path, std::make_shared<InlineExecutor>());
+  PinyinEncoder default_encoder(vocab_path, nullptr);
+  EXPECT_FALSE(executor->Started());
+
+  std::vector<std::string> strs(100, "我是中国人");
+  std::vector<std::vector<std::string>> pieces;
+  std::vector<std::string> expected({"wo3", "shi4", "zhong1", "guo2", "ren2"});
+  for (auto *encoder :
+       {&encoder1, &encoder2, &inline_encoder, &default_encoder}) {
+    encoder->Encode(strs, &pieces);
+    ASSERT_EQ(pieces.size(), strs.size());
+    for (const auto &p : pieces) {
+      EXPECT_EQ(p, expected);
+    }
+  }
+  EXPECT_TRUE(executor->Started());
+}
+
+} // namespace cppinyin
@@ -0,0 +1,161 @@
+/**
+ * Copyright      2024    Wei Kang (wkang@pku.edu.cn)
+ *
+ * See LICENSE for clarification regarding multiple authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CPPINYIN_CSRC_LRU_CACHE_H_
+#define CPPINYIN_CSRC_LRU_CACHE_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace cppinyin {
+
+struct CacheStats {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t evictions = 0;
+  // The number of entries and their total charge.
+  size_t entries = 0;
+  size_t bytes = 0;
+
+  // The share of the lookups that hit, 0 before the first lookup.
+  double HitRatio() const {
+    uint64_t lookups = hits + misses;
+    return lookups == 0 ? 0 : static_cast<double>(hits) / lookups;
+  }
+};
+
+// A thread safe LRU cache from strings to values of type V, bounded by the
+// total charge of its entries, usually their size in bytes. The keys are
+// spread over shards, each with its own lock and its own share of the
+// capacity, so that concurrent lookups of different keys rarely contend.
+template <typename V> class ShardedLruCache {
+public:
+  ShardedLruCache(size_t capacity, int32_t num_shards)
+      : shards_(std::max<int32_t>(num_shards, 1)) {
+    for (auto &shard : shards_) {
+      shard.capacity = capacity / shards_.size();
+    }
+  }
+
+  // Calls f(value) with the value of `key`, under the lock of its shard, and
+  // returns true if the key is in the cache.
+  template <typename F> bool Lookup(const std::string &key, F &&f) {
+    Shard &shard = GetShard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto iter = shard.index.find(key);
+    if (iter == shard.index.end()) {
+      ++shard.misses;
+      return false;
+    }
+    ++shard.hits;
+    // Moves the entry to the front, the most recently used end.
+    shard.lru.splice(shard.lru.begin(), shard.lru, iter->second);
+    f(static_cast<const V &>(iter->second->value));
+    return true;
+  }
+
+  // Inserts or replaces the value of `key`, evicting the least recently used
+  // entries of its shard beyond the capacity. Values whose charge exceeds the
+  // capacity of a shard are not cached.
+  void Insert(const std::string &key, V value, size_t charge) {
+    Shard &shard = GetShard(key);
+    if (charge > shard.capacity) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto iter = shard.index.find(key);
+    if (iter != shard.index.end()) {
+      shard.bytes -= iter->second->charge;
+      shard.lru.erase(iter->second);
+      shard.index.erase(iter);
+    }
+    shard.lru.push_front(Entry{key, std::move(value), charge});
+    shard.index.emplace(key, shard.lru.begin());
+    shard.bytes += charge;
+    while (shard.bytes > shard.capacity) {
+      const Entry &last = shard.lru.back();
+      shard.bytes -= last.charge;
+      shard.index.erase(last.key);
+      shard.lru.pop_back();
+      ++shard.evictions;
+    }
+  }
+
+  void Clear() {
+    for (auto &shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      shard.index.clear();
+      shard.lru.clear();
+      shard.bytes = 0;
+    }
+  }
+
+  CacheStats Stats() const {
+    CacheStats stats;
+    for (const auto &shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      stats.hits += shard.hits;
+      stats.misses += shard.misses;
+      stats.evictions += shard.evictions;
+      stats.entries += shard.index.size();
+      stats.bytes += shard.bytes;
+    }
+    return stats;
+  }
+
+private:
+  struct Entry {
+    std::string key;
+    V value;
+    size_t charge;
+  };
+
+  struct Shard {
+    mutable std::mutex mutex;
+    // From the most to the least recently used.
+    std::list<Entry> lru;
+    std::unordered_map<std::string, typename std::list<Entry>::iterator>
+        index;
+    size_t capacity = 0;
+    size_t bytes = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+  };
+
+  Shard &GetShard(const std::string &key) {
+    // The low bits pick the bucket inside the shard, the high bits pick the
+    // shard, so that a shard does not get keys of a few buckets only.
+    size_t hash = std::hash<std::string>()(key);
+    return shards_[(hash >> 16) % shards_.size()];
+  }
+
+  std::vector<Shard> shards_;
+};
+
+} // namespace cppinyin
+
+#endif // CPPINYIN_CSRC_LRU_CACHE_H_
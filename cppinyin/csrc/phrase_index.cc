@@ -0,0 +1,763 @@
+/**
+ * Copyright      2024    Wei Kang (wkang@pku.edu.cn)
+ *
+ * See LICENSE for clarification regarding multiple authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "cppinyin/csrc/phrase_index.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+namespace cppinyin {
+
+namespace {
+
+// Appends the `size` bytes at `data` to `storage`, padded to whole uint32.
+void AppendBytes(const char *data, size_t size,
+                 std::vector<uint32_t> *storage) {
+  size_t begin = storage->size();
+  storage->resize(begin + (size + 3) / 4, 0);
+  if (size != 0) {
+    std::memcpy(storage->data() + begin, data, size);
+  }
+}
+
+ArrayView<char> BytesOf(ArrayView<uint32_t> data) {
+  return ArrayView<char>(reinterpret_cast<const char *>(data.data()),
+                         data.size() * 4);
+}
+
+ArrayView<uint32_t> WordsOf(const char *data, size_t size) {
+  CPY_ASSERT(reinterpret_cast<uintptr_t>(data) % 4 == 0 && size % 4 == 0,
+             "Misaligned phrase index");
+  return ArrayView<uint32_t>(reinterpret_cast<const uint32_t *>(data),
+                             size / 4);
+}
+
+// Sets the byte tables of PhraseIndex::ByteTables from the `size` bytes at
+// `bytes`, the keys one after the other, with the keys starting at the
+// offsets given by f(k) for k in [0, num_keys).
+template <typename F>
+void KeyByteTables(const uint8_t *bytes, size_t size, size_t num_keys, F &&f,
+                   bool *key_bytes, bool *key_starts) {
+  std::fill(key_bytes, key_bytes + 256, false);
+  std::fill(key_starts, key_starts + 256, false);
+  for (size_t j = 0; j < size; ++j) {
+    key_bytes[bytes[j]] = true;
+  }
+  for (size_t k = 0; k < num_keys; ++k) {
+    key_starts[bytes[f(k)]] = true;
+  }
+}
+
+// FNV-1a, extended byte by byte as the walk goes.
+constexpr uint32_t kFnvBasis = 2166136261u;
+
+inline uint32_t FnvExtend(uint32_t hash, const char *str, size_t size) {
+  for (size_t j = 0; j < size; ++j) {
+    hash = (hash ^ static_cast<uint8_t>(str[j])) * 16777619u;
+  }
+  return hash;
+}
+
+// The hash of a slot, never 0 which marks the empty slots.
+inline uint32_t SlotHash(uint32_t hash) { return hash == 0 ? 1 : hash; }
+
+// The bytes of a unit of at most 4 bytes packed big endian, so that the
+// units of a size sort as their bytes.
+inline uint32_t PackUnit(const char *str, size_t size) {
+  uint32_t packed = 0;
+  for (size_t j = 0; j < size; ++j) {
+    packed = (packed << 8) | static_cast<uint8_t>(str[j]);
+  }
+  return packed;
+}
+
+// Appends the UTF-8 bytes of `codepoint` to `out`.
+void EncodeUtf8(uint32_t codepoint, std::string *out) {
+  if (codepoint < 0x80) {
+    out->push_back(static_cast<char>(codepoint));
+  } else if (codepoint < 0x800) {
+    out->push_back(static_cast<char>(0xC0 | (codepoint >> 6)));
+    out->push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+  } else if (codepoint < 0x10000) {
+    out->push_back(static_cast<char>(0xE0 | (codepoint >> 12)));
+    out->push_back(static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F)));
+    out->push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+  } else {
+    out->push_back(static_cast<char>(0xF0 | (codepoint >> 18)));
+    out->push_back(static_cast<char>(0x80 | ((codepoint >> 12) & 0x3F)));
+    out->push_back(static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F)));
+    out->push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+  }
+}
+
+} // namespace
+
+void DartsPhraseIndex::Build(size_t num_keys, const char *const *keys,
+                             const size_t *lengths, const int32_t *values) {
+  da_.build(num_keys, keys, lengths, values);
+}
+
+int32_t DartsPhraseIndex::ExactMatch(const char *key, size_t length) const {
+  // A length of 0 would make Darts look for a NUL terminator.
+  if (length == 0) {
+    return -1;
+  }
+  int32_t value = da_.exactMatchSearch<int32_t>(key, length);
+  return value < 0 ? -1 : value;
+}
+
+void DartsPhraseIndex::ForEachPrefix(const WordUnits &word, int32_t i,
+                                     int32_t max_end, MatchCallback f) const {
+  std::size_t node_pos = 0;
+  std::size_t key_pos = word.offsets[i];
+  for (int32_t end = i + 1; end <= max_end; ++end) {
+    int32_t value =
+        da_.traverse(word.str, node_pos, key_pos, word.offsets[end]);
+    if (value == -2) {
+      return;
+    }
+    if (value >= 0) {
+      f(end, value);
+    }
+  }
+}
+
+void DartsPhraseIndex::ByteTables(bool *key_bytes, bool *key_starts) const {
+  std::fill(key_bytes, key_bytes + 256, false);
+  std::fill(key_starts, key_starts + 256, false);
+  // Every byte of a key labels a unit of the double array, the labels of leaf
+  // units have their high bit set and 0 is the key terminator.
+  const auto *units =
+      static_cast<const Darts::Details::DoubleArrayUnit *>(da_.array());
+  for (std::size_t i = 0; i < da_.size(); ++i) {
+    auto label = units[i].label();
+    if (label != 0 && label <= 0xFF) {
+      key_bytes[label] = true;
+    }
+  }
+  for (int32_t c = 1; c <= 0xFF; ++c) {
+    if (!key_bytes[c]) {
+      continue;
+    }
+    char byte = static_cast<char>(c);
+    std::size_t node_pos = 0;
+    std::size_t key_pos = 0;
+    key_starts[c] = da_.traverse(&byte, node_pos, key_pos, 1) != -2;
+  }
+}
+
+ArrayView<char> DartsPhraseIndex::Data() const {
+  return ArrayView<char>(static_cast<const char *>(da_.array()),
+                         da_.total_size());
+}
+
+void DartsPhraseIndex::Map(const char *data, size_t size) {
+  ArrayView<uint32_t> words = WordsOf(data, size);
+  CPY_ASSERT(!words.empty(), "Truncated phrase index");
+  // A walk reads the unit of each label, 0 to 0xFF, from the offset of a
+  // unit it reached, which is not a leaf, so all of them must be in the
+  // array. The unused units of a built array are zero and it has a multiple
+  // of 256 units, which passes as well.
+  const auto *units = reinterpret_cast<const Darts::Details::DoubleArrayUnit *>(
+      words.data());
+  for (size_t i = 0; i < words.size(); ++i) {
+    if ((units[i].label() >> 31) == 0) {
+      CPY_ASSERT(((i ^ units[i].offset()) | 0xFF) < words.size(),
+                 "Invalid phrase index");
+    }
+  }
+  da_.set_array(data, words.size());
+}
+
+void SortedPhraseIndex::Build(size_t num_keys, const char *const *keys,
+                              const size_t *lengths, const int32_t *values) {
+  storage_.assign(1, num_keys);
+  uint32_t offset = 0;
+  storage_.push_back(offset);
+  for (size_t k = 0; k < num_keys; ++k) {
+    offset += lengths[k];
+    storage_.push_back(offset);
+  }
+  storage_.insert(storage_.end(), values, values + num_keys);
+  std::string bytes;
+  bytes.reserve(offset);
+  for (size_t k = 0; k < num_keys; ++k) {
+    bytes.append(keys[k], lengths[k]);
+  }
+  AppendBytes(bytes.data(), bytes.size(), &storage_);
+  data_ = ArrayView<uint32_t>(storage_);
+  Init();
+}
+
+void SortedPhraseIndex::Init() {
+  CPY_ASSERT(data_.size() >= 2, "Truncated phrase index");
+  size_t num_keys = data_[0];
+  CPY_ASSERT(data_.size() >= 2 + 2 * num_keys, "Truncated phrase index");
+  key_offsets_ = ArrayView<uint32_t>(data_.data() + 1, num_keys + 1);
+  values_ = ArrayView<uint32_t>(data_.data() + 2 + num_keys, num_keys);
+  bytes_ = reinterpret_cast<const uint8_t *>(data_.data() + 2 + 2 * num_keys);
+  for (size_t k = 0; k < num_keys; ++k) {
+    CPY_ASSERT(key_offsets_[k] <= key_offsets_[k + 1], "Invalid phrase index");
+  }
+  CPY_ASSERT(key_offsets_[num_keys] <=
+                 (data_.size() - 2 - 2 * num_keys) * 4,
+             "Truncated phrase index");
+}
+
+int32_t SortedPhraseIndex::ExactMatch(const char *key, size_t length) const {
+  const uint8_t *k = reinterpret_cast<const uint8_t *>(key);
+  size_t lo = 0;
+  size_t hi = values_.size();
+  // The first key not less than `key`.
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    const uint8_t *p = bytes_ + key_offsets_[mid];
+    size_t size = key_offsets_[mid + 1] - key_offsets_[mid];
+    if (std::lexicographical_compare(p, p + size, k, k + length)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == values_.size() ||
+      key_offsets_[lo + 1] - key_offsets_[lo] != length ||
+      std::memcmp(bytes_ + key_offsets_[lo], key, length) != 0) {
+    return -1;
+  }
+  return values_[lo];
+}
+
+void SortedPhraseIndex::ForEachPrefix(const WordUnits &word, int32_t i,
+                                      int32_t max_end, MatchCallback f) const {
+  // The keys [lo, hi) start with the `depth` bytes walked so far. The keys
+  // of exactly that length come first among them.
+  size_t lo = 0;
+  size_t hi = values_.size();
+  size_t depth = 0;
+  // The byte of key k at `depth`, -1 if it is no longer.
+  auto byte_at = [this, &depth](size_t k) -> int32_t {
+    return key_offsets_[k] + depth < key_offsets_[k + 1]
+               ? bytes_[key_offsets_[k] + depth]
+               : -1;
+  };
+  for (int32_t end = i + 1; end <= max_end; ++end) {
+    for (int32_t j = word.offsets[end - 1]; j < word.offsets[end]; ++j) {
+      int32_t c = static_cast<uint8_t>(word.str[j]);
+      size_t first = lo;
+      size_t count = hi - lo;
+      while (count > 0) {
+        size_t step = count / 2;
+        if (byte_at(first + step) < c) {
+          first += step + 1;
+          count -= step + 1;
+        } else {
+          count = step;
+        }
+      }
+      size_t last = first;
+      count = hi - first;
+      while (count > 0) {
+        size_t step = count / 2;
+        if (byte_at(last + step) <= c) {
+          last += step + 1;
+          count -= step + 1;
+        } else {
+          count = step;
+        }
+      }
+      lo = first;
+      hi = last;
+      depth += 1;
+      if (lo == hi) {
+        return;
+      }
+    }
+    if (key_offsets_[lo] + depth == key_offsets_[lo + 1]) {
+      f(end, values_[lo]);
+    }
+  }
+}
+
+void SortedPhraseIndex::ByteTables(bool *key_bytes, bool *key_starts) const {
+  size_t num_keys = values_.size();
+  KeyByteTables(
+      bytes_, key_offsets_[num_keys], num_keys,
+      [this](size_t k) { return key_offsets_[k]; }, key_bytes, key_starts);
+}
+
+ArrayView<char> SortedPhraseIndex::Data() const { return BytesOf(data_); }
+
+void SortedPhraseIndex::Map(const char *data, size_t size) {
+  storage_.clear();
+  data_ = WordsOf(data, size);
+  Init();
+}
+
+void HashPhraseIndex::Build(size_t num_keys, const char *const *keys,
+                            const size_t *lengths, const int32_t *values) {
+  // The keys and their prefixes, with the value -1 for the prefixes only.
+  std::vector<Slot> entries;
+  std::string bytes;
+  for (size_t k = 0; k < num_keys; ++k) {
+    uint32_t offset = bytes.size();
+    bytes.append(keys[k], lengths[k]);
+    uint32_t hash = kFnvBasis;
+    size_t j = 0;
+    while (j < lengths[k]) {
+      size_t next = j + Utf8CharLen(keys[k] + j, lengths[k] - j);
+      hash = FnvExtend(hash, keys[k] + j, next - j);
+      j = next;
+      entries.push_back(Slot{SlotHash(hash), offset, static_cast<uint32_t>(j),
+                             j == lengths[k] ? values[k] : -1});
+    }
+  }
+  // A prefix shared by several keys, or equal to a key, is kept once, with
+  // the value of the key if any.
+  std::sort(entries.begin(), entries.end(),
+            [&bytes](const Slot &a, const Slot &b) {
+              int32_t c = bytes.compare(a.offset, a.length, bytes, b.offset,
+                                        b.length);
+              return c != 0 ? c < 0 : a.value > b.value;
+            });
+  auto same = [&bytes](const Slot &a, const Slot &b) {
+    return bytes.compare(a.offset, a.length, bytes, b.offset, b.length) == 0;
+  };
+  entries.erase(std::unique(entries.begin(), entries.end(), same),
+                entries.end());
+
+  // At most half full, so that probe sequences stay short.
+  uint32_t capacity = 1;
+  while (capacity < entries.size() * 2) {
+    capacity *= 2;
+  }
+  std::vector<Slot> slots(capacity, Slot{0, 0, 0, 0});
+  for (const auto &entry : entries) {
+    uint32_t s = entry.hash & (capacity - 1);
+    while (slots[s].hash != 0) {
+      s = (s + 1) & (capacity - 1);
+    }
+    slots[s] = entry;
+  }
+  storage_.assign(1, capacity);
+  AppendBytes(reinterpret_cast<const char *>(slots.data()),
+              slots.size() * sizeof(Slot), &storage_);
+  storage_.push_back(bytes.size());
+  AppendBytes(bytes.data(), bytes.size(), &storage_);
+  data_ = ArrayView<uint32_t>(storage_);
+  Init();
+}
+
+void HashPhraseIndex::Init() {
+  static_assert(sizeof(Slot) == 16, "Slot must be 16 bytes");
+  CPY_ASSERT(data_.size() >= 2, "Truncated phrase index");
+  size_t capacity = data_[0];
+  CPY_ASSERT(capacity != 0 && (capacity & (capacity - 1)) == 0 &&
+                 data_.size() >= 2 + capacity * 4,
+             "Invalid phrase index");
+  slots_ = reinterpret_cast<const Slot *>(data_.data() + 1);
+  mask_ = capacity - 1;
+  num_bytes_ = data_[1 + capacity * 4];
+  CPY_ASSERT(num_bytes_ <= (data_.size() - 2 - capacity * 4) * 4,
+             "Truncated phrase index");
+  bytes_ = reinterpret_cast<const char *>(data_.data() + 2 + capacity * 4);
+  // The strings of the slots are in bytes_, and an empty slot ends every
+  // probe sequence.
+  bool has_empty_slot = false;
+  for (size_t s = 0; s < capacity; ++s) {
+    if (slots_[s].hash == 0) {
+      has_empty_slot = true;
+    } else {
+      CPY_ASSERT(static_cast<uint64_t>(slots_[s].offset) + slots_[s].length <=
+                     num_bytes_,
+                 "Invalid phrase index");
+    }
+  }
+  CPY_ASSERT(has_empty_slot, "Invalid phrase index");
+}
+
+const HashPhraseIndex::Slot *HashPhraseIndex::Find(const char *str,
+                                                   uint32_t length,
+                                                   uint32_t hash) const {
+  hash = SlotHash(hash);
+  for (uint32_t s = hash & mask_; slots_[s].hash != 0; s = (s + 1) & mask_) {
+    const Slot &slot = slots_[s];
+    if (slot.hash == hash && slot.length == length &&
+        std::memcmp(bytes_ + slot.offset, str, length) == 0) {
+      return &slot;
+    }
+  }
+  return nullptr;
+}
+
+int32_t HashPhraseIndex::ExactMatch(const char *key, size_t length) const {
+  if (length == 0) {
+    return -1;
+  }
+  const Slot *slot = Find(key, length, FnvExtend(kFnvBasis, key, length));
+  return slot != nullptr ? slot->value : -1;
+}
+
+void HashPhraseIndex::ForEachPrefix(const WordUnits &word, int32_t i,
+                                    int32_t max_end, MatchCallback f) const {
+  const int32_t *offsets = word.offsets;
+  uint32_t hash = kFnvBasis;
+  for (int32_t end = i + 1; end <= max_end; ++end) {
+    hash = FnvExtend(hash, word.str + offsets[end - 1],
+                     offsets[end] - offsets[end - 1]);
+    const Slot *slot =
+        Find(word.str + offsets[i], offsets[end] - offsets[i], hash);
+    if (slot == nullptr) {
+      return;
+    }
+    if (slot->value >= 0) {
+      f(end, slot->value);
+    }
+  }
+}
+
+void HashPhraseIndex::ByteTables(bool *key_bytes, bool *key_starts) const {
+  std::fill(key_bytes, key_bytes + 256, false);
+  std::fill(key_starts, key_starts + 256, false);
+  const uint8_t *bytes = reinterpret_cast<const uint8_t *>(bytes_);
+  for (size_t j = 0; j < num_bytes_; ++j) {
+    key_bytes[bytes[j]] = true;
+  }
+  // Every key starts with a one character prefix in the table.
+  for (uint32_t s = 0; s <= mask_; ++s) {
+    if (slots_[s].hash != 0 && slots_[s].offset < num_bytes_) {
+      key_starts[bytes[slots_[s].offset]] = true;
+    }
+  }
+}
+
+ArrayView<char> HashPhraseIndex::Data() const { return BytesOf(data_); }
+
+void HashPhraseIndex::Map(const char *data, size_t size) {
+  storage_.clear();
+  data_ = WordsOf(data, size);
+  Init();
+}
+
+void CodepointPhraseIndex::Build(size_t num_keys, const char *const *keys,
+                                 const size_t *lengths,
+                                 const int32_t *values) {
+  // The units of the keys, by SplitUtf8, as their code points or, for the
+  // other units, as (1 << 40 | size << 32 | packed bytes), which sort after
+  // the code points.
+  constexpr uint64_t kOther = uint64_t(1) << 40;
+  std::vector<uint64_t> units;
+  std::vector<size_t> key_units(1, 0);
+  std::vector<int32_t> offsets;
+  std::vector<int32_t> codepoints;
+  for (size_t k = 0; k < num_keys; ++k) {
+    SplitUtf8(keys[k], lengths[k], &offsets, &codepoints);
+    for (size_t u = 0; u < codepoints.size(); ++u) {
+      if (codepoints[u] >= 0) {
+        units.push_back(codepoints[u]);
+      } else {
+        size_t size = offsets[u + 1] - offsets[u];
+        units.push_back(kOther | uint64_t(size) << 32 |
+                        PackUnit(keys[k] + offsets[u], size));
+      }
+    }
+    key_units.push_back(units.size());
+  }
+  // The ids number the distinct units from 1 in increasing order.
+  std::vector<uint64_t> alphabet(units);
+  std::sort(alphabet.begin(), alphabet.end());
+  alphabet.erase(std::unique(alphabet.begin(), alphabet.end()),
+                 alphabet.end());
+  size_t num_codepoints =
+      std::lower_bound(alphabet.begin(), alphabet.end(), kOther) -
+      alphabet.begin();
+  std::vector<uint32_t> ids(units.size());
+  for (size_t j = 0; j < units.size(); ++j) {
+    ids[j] = 1 + std::lower_bound(alphabet.begin(), alphabet.end(), units[j]) -
+             alphabet.begin();
+  }
+  // The keys in the order of their ids, the byte order unless malformed
+  // units break it.
+  std::vector<uint32_t> order(num_keys);
+  for (size_t k = 0; k < num_keys; ++k) {
+    order[k] = k;
+  }
+  if (num_codepoints != alphabet.size()) {
+    std::sort(order.begin(), order.end(),
+              [&ids, &key_units](uint32_t a, uint32_t b) {
+                return std::lexicographical_compare(
+                    ids.data() + key_units[a], ids.data() + key_units[a + 1],
+                    ids.data() + key_units[b], ids.data() + key_units[b + 1]);
+              });
+  }
+  auto key_size = [&key_units, &order](size_t k) {
+    return key_units[order[k] + 1] - key_units[order[k]];
+  };
+
+  // The trie, breadth first: the nodes of each depth in the order of their
+  // keys, so that the children of a node follow each other. Each node of
+  // `ranges` stands for the keys order[lo, hi), which share the units up to
+  // it.
+  struct Range {
+    size_t lo;
+    size_t hi;
+  };
+  std::vector<Range> ranges(1, Range{0, num_keys});
+  std::vector<Node> nodes(1, Node{0, -1});
+  std::vector<uint32_t> labels(1, 0);
+  for (size_t node = 0, depth = 0, depth_end = 1; node < ranges.size();
+       ++node) {
+    if (node == depth_end) {
+      depth += 1;
+      depth_end = ranges.size();
+    }
+    nodes[node].first_child = ranges.size();
+    size_t k = ranges[node].lo;
+    // The key ending at the node comes first.
+    if (k < ranges[node].hi && key_size(k) == depth) {
+      ++k;
+    }
+    while (k < ranges[node].hi) {
+      uint32_t c = ids[key_units[order[k]] + depth];
+      size_t end = k + 1;
+      while (end < ranges[node].hi && ids[key_units[order[end]] + depth] == c) {
+        ++end;
+      }
+      ranges.push_back(Range{k, end});
+      labels.push_back(c);
+      nodes.push_back(
+          Node{0, key_size(k) == depth + 1 ? values[order[k]] : -1});
+      k = end;
+    }
+  }
+  nodes.push_back(Node{static_cast<uint32_t>(ranges.size()), -1});
+  // The children of the root by id.
+  std::vector<uint32_t> root(alphabet.size() + 1, 0);
+  for (uint32_t n = nodes[0].first_child; n < nodes[1].first_child; ++n) {
+    root[labels[n]] = n;
+  }
+
+  // The pages of the code points with ids.
+  std::vector<uint32_t> page_index(kNumPages, 0);
+  std::vector<uint32_t> pages(kPageSize, 0);
+  for (size_t j = 0; j < num_codepoints; ++j) {
+    uint32_t page = alphabet[j] >> kPageBits;
+    if (page_index[page] == 0) {
+      page_index[page] = pages.size() / kPageSize;
+      pages.resize(pages.size() + kPageSize, 0);
+    }
+    pages[page_index[page] * kPageSize + (alphabet[j] & (kPageSize - 1))] =
+        j + 1;
+  }
+  storage_ = {static_cast<uint32_t>(num_codepoints),
+              static_cast<uint32_t>(alphabet.size() - num_codepoints),
+              static_cast<uint32_t>(pages.size() / kPageSize),
+              static_cast<uint32_t>(ranges.size())};
+  storage_.insert(storage_.end(), page_index.begin(), page_index.end());
+  storage_.insert(storage_.end(), pages.begin(), pages.end());
+  storage_.insert(storage_.end(), alphabet.begin(),
+                  alphabet.begin() + num_codepoints);
+  for (size_t j = num_codepoints; j < alphabet.size(); ++j) {
+    storage_.push_back((alphabet[j] >> 32) & 0xFF);
+    storage_.push_back(alphabet[j] & 0xFFFFFFFF);
+  }
+  storage_.insert(storage_.end(), root.begin(), root.end());
+  AppendBytes(reinterpret_cast<const char *>(nodes.data()),
+              nodes.size() * sizeof(Node), &storage_);
+  storage_.insert(storage_.end(), labels.begin(), labels.end());
+  data_ = ArrayView<uint32_t>(storage_);
+  Init();
+}
+
+void CodepointPhraseIndex::Init() {
+  static_assert(sizeof(Node) == 8, "Node must be 8 bytes");
+  CPY_ASSERT(data_.size() >= 4, "Truncated phrase index");
+  size_t num_codepoints = data_[0];
+  size_t num_others = data_[1];
+  size_t num_pages = data_[2];
+  size_t num_nodes = data_[3];
+  size_t num_ids = num_codepoints + num_others;
+  CPY_ASSERT(num_pages != 0 && num_nodes != 0 &&
+                 data_.size() == 4 + kNumPages + num_pages * kPageSize +
+                                     num_codepoints + 2 * num_others +
+                                     num_ids + 1 + (num_nodes + 1) * 2 +
+                                     num_nodes,
+             "Invalid phrase index");
+  const uint32_t *p = data_.data() + 4;
+  auto next = [&p](size_t size) {
+    ArrayView<uint32_t> view(p, size);
+    p += size;
+    return view;
+  };
+  page_index_ = next(kNumPages);
+  pages_ = next(num_pages * kPageSize);
+  codepoints_ = next(num_codepoints);
+  others_ = next(2 * num_others);
+  root_ = next(num_ids + 1);
+  nodes_ = reinterpret_cast<const Node *>(next((num_nodes + 1) * 2).data());
+  labels_ = next(num_nodes);
+  // The walks trust the ids and the children they find.
+  for (uint32_t page : page_index_) {
+    CPY_ASSERT(page < num_pages, "Invalid phrase index");
+  }
+  for (uint32_t id : pages_) {
+    CPY_ASSERT(id <= num_ids, "Invalid phrase index");
+  }
+  for (uint32_t node : root_) {
+    CPY_ASSERT(node < num_nodes, "Invalid phrase index");
+  }
+  for (size_t n = 0; n < num_nodes; ++n) {
+    CPY_ASSERT(nodes_[n].first_child <= nodes_[n + 1].first_child,
+               "Invalid phrase index");
+  }
+  CPY_ASSERT(nodes_[num_nodes].first_child <= num_nodes,
+             "Invalid phrase index");
+}
+
+uint32_t CodepointPhraseIndex::OtherId(const char *str, size_t size) const {
+  if (size > 4) {
+    return 0;
+  }
+  // The first unit not less than (size, packed).
+  uint32_t packed = PackUnit(str, size);
+  size_t lo = 0;
+  size_t hi = others_.size() / 2;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (others_[2 * mid] < size ||
+        (others_[2 * mid] == size && others_[2 * mid + 1] < packed)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == others_.size() / 2 || others_[2 * lo] != size ||
+      others_[2 * lo + 1] != packed) {
+    return 0;
+  }
+  return codepoints_.size() + 1 + lo;
+}
+
+uint32_t CodepointPhraseIndex::Child(uint32_t node, uint32_t id) const {
+  if (node == 0) {
+    return root_[id];
+  }
+  // A branchless binary search of the first child of id >= `id`.
+  uint32_t first = nodes_[node].first_child;
+  uint32_t count = nodes_[node + 1].first_child - first;
+  if (count == 0) {
+    return 0;
+  }
+  const uint32_t *labels = labels_.data() + first;
+  while (count > 1) {
+    uint32_t half = count / 2;
+    labels = labels[half - 1] < id ? labels + half : labels;
+    count -= half;
+  }
+  return *labels == id ? labels - labels_.data() : 0;
+}
+
+int32_t CodepointPhraseIndex::ExactMatch(const char *key,
+                                         size_t length) const {
+  if (length == 0) {
+    return -1;
+  }
+  uint32_t node = 0;
+  size_t j = 0;
+  while (j < length) {
+    size_t end = j + Utf8CharLen(key + j, length - j);
+    uint32_t id = Id(key + j, end - j, DecodeUtf8(key + j, end - j));
+    node = id == 0 ? 0 : Child(node, id);
+    if (node == 0) {
+      return -1;
+    }
+    j = end;
+  }
+  return nodes_[node].value;
+}
+
+void CodepointPhraseIndex::ForEachPrefix(const WordUnits &word, int32_t i,
+                                         int32_t max_end,
+                                         MatchCallback f) const {
+  uint32_t node = 0;
+  for (int32_t end = i + 1; end <= max_end; ++end) {
+    int32_t begin = word.offsets[end - 1];
+    uint32_t id = Id(word.str + begin, word.offsets[end] - begin,
+                     word.codepoints[end - 1]);
+    node = id == 0 ? 0 : Child(node, id);
+    if (node == 0) {
+      return;
+    }
+    if (nodes_[node].value >= 0) {
+      f(end, nodes_[node].value);
+    }
+  }
+}
+
+void CodepointPhraseIndex::ByteTables(bool *key_bytes,
+                                      bool *key_starts) const {
+  std::fill(key_bytes, key_bytes + 256, false);
+  std::fill(key_starts, key_starts + 256, false);
+  // The bytes of the unit of each id, and of the first units of the keys,
+  // the children of the root.
+  std::string bytes;
+  for (size_t id = 1; id < root_.size(); ++id) {
+    bytes.clear();
+    if (id <= codepoints_.size()) {
+      EncodeUtf8(codepoints_[id - 1], &bytes);
+    } else {
+      size_t j = 2 * (id - 1 - codepoints_.size());
+      for (uint32_t b = 0; b < others_[j]; ++b) {
+        bytes.push_back(
+            static_cast<char>(others_[j + 1] >> (8 * (others_[j] - 1 - b))));
+      }
+    }
+    for (char c : bytes) {
+      key_bytes[static_cast<uint8_t>(c)] = true;
+    }
+    if (root_[id] != 0) {
+      key_starts[static_cast<uint8_t>(bytes[0])] = true;
+    }
+  }
+}
+
+ArrayView<char> CodepointPhraseIndex::Data() const { return BytesOf(data_); }
+
+void CodepointPhraseIndex::Map(const char *data, size_t size) {
+  storage_.clear();
+  data_ = WordsOf(data, size);
+  Init();
+}
+
+std::unique_ptr<PhraseIndex> NewPhraseIndex(const std::string &name) {
+  if (name == "darts") {
+    return std::make_unique<DartsPhraseIndex>();
+  } else if (name == "sorted") {
+    return std::make_unique<SortedPhraseIndex>();
+  } else if (name == "hash") {
+    return std::make_unique<HashPhraseIndex>();
+  } else if (name == "codepoint") {
+    return std::make_unique<CodepointPhraseIndex>();
+  }
+  return nullptr;
+}
+
+std::vector<std::string> PhraseIndexNames() {
+  return {"darts", "sorted", "hash", "codepoint"};
+}
+
+} // namespace cppinyin
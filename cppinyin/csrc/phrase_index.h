@@ -0,0 +1,326 @@
+/**
+ * Copyright      2024    Wei Kang (wkang@pku.edu.cn)
+ *
+ * See LICENSE for clarification regarding multiple authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CPPINYIN_CSRC_PHRASE_INDEX_H_
+#define CPPINYIN_CSRC_PHRASE_INDEX_H_
+
+#include "cppinyin/csrc/darts.h"
+#include "cppinyin/csrc/utils.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace cppinyin {
+
+// A reference to a callable taking (int32_t end, int32_t value), given to
+// PhraseIndex::ForEachPrefix. It does not own the callable, which must
+// outlive it, and unlike std::function never allocates.
+class MatchCallback {
+public:
+  template <typename F,
+            typename = std::enable_if_t<
+                !std::is_same<std::decay_t<F>, MatchCallback>::value>>
+  MatchCallback(F &f) // NOLINT
+      : object_(&f), call_([](void *object, int32_t end, int32_t value) {
+          (*static_cast<F *>(object))(end, value);
+        }) {}
+
+  void operator()(int32_t end, int32_t value) const {
+    call_(object_, end, value);
+  }
+
+private:
+  void *object_;
+  void (*call_)(void *, int32_t, int32_t);
+};
+
+// The units of a word, as PhraseIndex::ForEachPrefix walks them: unit u is
+// the bytes [offsets[u], offsets[u + 1]) of `str`, and codepoints[u] is
+// their DecodeUtf8. The units are decoded once per word, by
+// PinyinEncoder::SplitWord or SplitUtf8, for all the walks of the word, and
+// only if an index walking it UsesCodepoints: codepoints may be invalid
+// otherwise.
+struct WordUnits {
+  const char *str;
+  const int32_t *offsets;
+  const int32_t *codepoints;
+};
+
+// An index of the keys of a dictionary, UTF-8 strings with an int32 value
+// each, for the trie walk of the route computation. PinyinEncoder looks the
+// keys up through this interface only, so that the layout of the index can
+// be chosen per deployment, see NewPhraseIndex and phrase_index_benchmark.
+class PhraseIndex {
+public:
+  virtual ~PhraseIndex() = default;
+
+  // The name NewPhraseIndex creates the index by.
+  virtual const char *Name() const = 0;
+
+  // Builds the index of `num_keys` distinct keys sorted in byte order, key i
+  // being the lengths[i] bytes at keys[i] and having the value
+  // values[i] >= 0.
+  virtual void Build(size_t num_keys, const char *const *keys,
+                     const size_t *lengths, const int32_t *values) = 0;
+
+  // Returns the value of the key made of the `length` bytes at `key`, -1 if
+  // there is none.
+  virtual int32_t ExactMatch(const char *key, size_t length) const = 0;
+
+  // Calls f(end, value) for each key made of the units [i, end) of `word`,
+  // for end <= max_end, in increasing order of end. Keys are only looked for
+  // at unit boundaries.
+  virtual void ForEachPrefix(const WordUnits &word, int32_t i,
+                             int32_t max_end, MatchCallback f) const = 0;
+
+  // Sets key_starts[c], whether a key starts with byte c, and key_bytes[c],
+  // whether c may appear in a key: key_bytes may be set for bytes in no key,
+  // which only makes SplitWord cut ASCII runs finer.
+  virtual void ByteTables(bool *key_bytes, bool *key_starts) const = 0;
+
+  // Whether ForEachPrefix reads WordUnits::codepoints.
+  virtual bool UsesCodepoints() const { return false; }
+
+  // The bytes of memory the arrays of the index take, owned or mapped.
+  virtual size_t MemoryUsage() const = 0;
+
+  // The arrays of the index, as saved in a model. They are 4 bytes aligned
+  // and Map can use them in place.
+  virtual ArrayView<char> Data() const = 0;
+
+  // Uses the `size` bytes at `data`, the Data of an index of the same name,
+  // in place. They must be 4 bytes aligned and outlive the index. Aborts if
+  // they are not valid.
+  virtual void Map(const char *data, size_t size) = 0;
+};
+
+// A double array over the bytes of the keys, the index of the models of
+// format v1 and the default one.
+class DartsPhraseIndex : public PhraseIndex {
+public:
+  const char *Name() const override { return "darts"; }
+
+  void Build(size_t num_keys, const char *const *keys, const size_t *lengths,
+             const int32_t *values) override;
+
+  int32_t ExactMatch(const char *key, size_t length) const override;
+
+  void ForEachPrefix(const WordUnits &word, int32_t i, int32_t max_end,
+                     MatchCallback f) const override;
+
+  void ByteTables(bool *key_bytes, bool *key_starts) const override;
+
+  size_t MemoryUsage() const override { return da_.total_size(); }
+
+  ArrayView<char> Data() const override;
+
+  void Map(const char *data, size_t size) override;
+
+  // The double array, e.g. to read it from a model of format v1.
+  Darts::DoubleArray &darts() { return da_; }
+
+private:
+  Darts::DoubleArray da_;
+};
+
+// The keys sorted in byte order, in one array. A prefix is looked up by
+// narrowing the range of keys starting with it, with two binary searches per
+// byte. It is compact and quick to build.
+class SortedPhraseIndex : public PhraseIndex {
+public:
+  const char *Name() const override { return "sorted"; }
+
+  void Build(size_t num_keys, const char *const *keys, const size_t *lengths,
+             const int32_t *values) override;
+
+  int32_t ExactMatch(const char *key, size_t length) const override;
+
+  void ForEachPrefix(const WordUnits &word, int32_t i, int32_t max_end,
+                     MatchCallback f) const override;
+
+  void ByteTables(bool *key_bytes, bool *key_starts) const override;
+
+  size_t MemoryUsage() const override { return data_.size() * 4; }
+
+  ArrayView<char> Data() const override;
+
+  void Map(const char *data, size_t size) override;
+
+private:
+  // Points the views at data_.
+  void Init();
+
+  // The number of keys, the num_keys + 1 byte offsets of the keys in bytes_,
+  // the values of the keys and then bytes_, padded.
+  std::vector<uint32_t> storage_;
+  ArrayView<uint32_t> data_;
+  ArrayView<uint32_t> key_offsets_;
+  ArrayView<uint32_t> values_;
+  const uint8_t *bytes_ = nullptr;
+};
+
+// A hash table of the keys and of their proper prefixes ending on UTF-8
+// character boundaries, the prefixes telling the walk to go on. A prefix is
+// looked up with one probe per unit, in the common case, whatever its
+// length, at the cost of the memory of the prefixes.
+class HashPhraseIndex : public PhraseIndex {
+public:
+  const char *Name() const override { return "hash"; }
+
+  void Build(size_t num_keys, const char *const *keys, const size_t *lengths,
+             const int32_t *values) override;
+
+  int32_t ExactMatch(const char *key, size_t length) const override;
+
+  void ForEachPrefix(const WordUnits &word, int32_t i, int32_t max_end,
+                     MatchCallback f) const override;
+
+  void ByteTables(bool *key_bytes, bool *key_starts) const override;
+
+  size_t MemoryUsage() const override { return data_.size() * 4; }
+
+  ArrayView<char> Data() const override;
+
+  void Map(const char *data, size_t size) override;
+
+private:
+  struct Slot {
+    // The hash of the string, 0 for an empty slot.
+    uint32_t hash;
+    // The string is the `length` bytes at offset `offset` of bytes_.
+    uint32_t offset;
+    uint32_t length;
+    // The value of the key, -1 for a prefix of keys only.
+    int32_t value;
+  };
+
+  // Returns the slot of the `length` bytes at `str`, whose hash is `hash`,
+  // nullptr if there is none.
+  const Slot *Find(const char *str, uint32_t length, uint32_t hash) const;
+
+  // Points the views at data_.
+  void Init();
+
+  // The number of slots, a power of 2, the slots and then bytes_, the keys
+  // one after the other, padded.
+  std::vector<uint32_t> storage_;
+  ArrayView<uint32_t> data_;
+  const Slot *slots_ = nullptr;
+  uint32_t mask_ = 0;
+  const char *bytes_ = nullptr;
+  size_t num_bytes_ = 0;
+};
+
+// A trie whose alphabet is the characters of the keys rather than their
+// bytes, so that a key of k characters takes k transitions instead of one
+// per UTF-8 byte, 3 per CJK character. The code points of the keys are
+// numbered densely in increasing order at build time, the CJK ones making
+// one compact range, and a unit of the input is mapped to its id through
+// two table lookups on the code point the encoder decoded. The children of
+// the root are found in a table indexed by id, those of the other nodes,
+// stored breadth first, by a search of their ids. The units that are not
+// one well formed character, which SplitUtf8 makes of malformed keys, get
+// the ids after those of the code points.
+class CodepointPhraseIndex : public PhraseIndex {
+public:
+  const char *Name() const override { return "codepoint"; }
+
+  void Build(size_t num_keys, const char *const *keys, const size_t *lengths,
+             const int32_t *values) override;
+
+  int32_t ExactMatch(const char *key, size_t length) const override;
+
+  void ForEachPrefix(const WordUnits &word, int32_t i, int32_t max_end,
+                     MatchCallback f) const override;
+
+  void ByteTables(bool *key_bytes, bool *key_starts) const override;
+
+  bool UsesCodepoints() const override { return true; }
+
+  size_t MemoryUsage() const override { return data_.size() * 4; }
+
+  ArrayView<char> Data() const override;
+
+  void Map(const char *data, size_t size) override;
+
+private:
+  // The code points are mapped by pages of kPageSize.
+  static constexpr int32_t kPageBits = 8;
+  static constexpr int32_t kPageSize = 1 << kPageBits;
+  static constexpr int32_t kNumPages = 0x110000 >> kPageBits;
+
+  struct Node {
+    // The children of node n are the nodes [nodes_[n].first_child,
+    // nodes_[n + 1].first_child), by increasing id.
+    uint32_t first_child;
+    // The value of the key ending at the node, -1 if none does.
+    int32_t value;
+  };
+
+  // Returns the id of the unit of `size` bytes at `str`, whose DecodeUtf8 is
+  // `codepoint`, 0 if no key has it.
+  uint32_t Id(const char *str, size_t size, int32_t codepoint) const {
+    if (codepoint >= 0) {
+      return pages_[page_index_[codepoint >> kPageBits] * kPageSize +
+                    (codepoint & (kPageSize - 1))];
+    }
+    return others_.empty() ? 0 : OtherId(str, size);
+  }
+
+  // Id for the units that are not one character.
+  uint32_t OtherId(const char *str, size_t size) const;
+
+  // Returns the child of `node` by the unit of id `id` > 0, 0 if it has none.
+  uint32_t Child(uint32_t node, uint32_t id) const;
+
+  // Points the views at data_.
+  void Init();
+
+  // A header of the numbers of code points, of other units, of pages and of
+  // nodes, then the arrays below in order.
+  std::vector<uint32_t> storage_;
+  ArrayView<uint32_t> data_;
+  // The page of pages_ of each page of code points, page 0 having no ids.
+  ArrayView<uint32_t> page_index_;
+  // The id of each code point of the pages, 0 for none.
+  ArrayView<uint32_t> pages_;
+  // The code point of each id from 1 on.
+  ArrayView<uint32_t> codepoints_;
+  // The other units by increasing id, as pairs of their size and of their
+  // bytes packed big endian, which sorts them.
+  ArrayView<uint32_t> others_;
+  // The child of the root by each id, 0 for none.
+  ArrayView<uint32_t> root_;
+  // The nodes, the root being node 0, and one more for the end of the
+  // children of the last one.
+  const Node *nodes_ = nullptr;
+  // The id of the unit leading to each node.
+  ArrayView<uint32_t> labels_;
+};
+
+// Creates an empty index of kind `name`, one of PhraseIndexNames(). Returns
+// nullptr for an unknown name.
+std::unique_ptr<PhraseIndex> NewPhraseIndex(const std::string &name);
+
+std::vector<std::string> PhraseIndexNames();
+
+} // namespace cppinyin
+
+#endif // CPPINYIN_CSRC_PHRASE_INDEX_H_
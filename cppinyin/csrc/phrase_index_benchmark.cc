@@ -0,0 +1,204 @@
+/**
+ * Copyright      2024    Wei Kang (wkang@pku.edu.cn)
+ *
+ * See LICENSE for clarification regarding multiple authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compares the PhraseIndex implementations on a dictionary and a corpus:
+// the time to build each index, the memory it takes, and the throughput of
+// the prefix matches the route computation runs at each character of the
+// corpus and of exact lookups of the keys.
+//
+// Usage: phrase_index_benchmark [text dictionary] [text file] [names...]
+//
+// Without a dictionary, or with "-", a synthetic one of two to four
+// character words is used. Without a text file, or with "-", the corpus is
+// made of the keys of the dictionary. The names, by default all of
+// PhraseIndexNames(), select the indexes to compare.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "cppinyin/csrc/phrase_index.h"
+#include "cppinyin/csrc/utils.h"
+
+namespace {
+
+using cppinyin::PhraseIndex;
+
+// The distinct keys of the dictionary, the first column of each line,
+// sorted in byte order.
+std::vector<std::string> LoadKeys(const char *path) {
+  std::vector<std::string> keys;
+  if (path != nullptr && std::string(path) != "-") {
+    std::ifstream is(path);
+    std::string line;
+    while (std::getline(is, line)) {
+      auto end = std::find_if(line.begin(), line.end(), cppinyin::IsSpace);
+      if (end != line.begin()) {
+        keys.emplace_back(line.begin(), end);
+      }
+    }
+  } else {
+    auto character = [](int32_t i) {
+      int32_t c = 0x4E00 + i;
+      std::string s;
+      s.push_back(static_cast<char>(0xE0 | (c >> 12)));
+      s.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+      s.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+      return s;
+    };
+    std::mt19937 rng(0);
+    for (int32_t i = 0; i < 5000; ++i) {
+      keys.push_back(character(i));
+    }
+    for (int32_t i = 0; i < 300000; ++i) {
+      std::string key;
+      for (int32_t j = 0; j < 2 + i % 3; ++j) {
+        key += character(rng() % 5000);
+      }
+      keys.push_back(key);
+    }
+  }
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+  return keys;
+}
+
+std::vector<std::string> LoadCorpus(const char *path,
+                                    const std::vector<std::string> &keys) {
+  std::vector<std::string> lines;
+  if (path != nullptr && std::string(path) != "-") {
+    std::ifstream is(path);
+    std::string line;
+    while (std::getline(is, line)) {
+      lines.push_back(line);
+    }
+    return lines;
+  }
+  // Lines of keys in a random order, so that most positions start keys.
+  std::mt19937 rng(1);
+  for (int32_t i = 0; i < 20000; ++i) {
+    std::string line;
+    for (int32_t j = 0; j < 10; ++j) {
+      line += keys[rng() % keys.size()];
+    }
+    lines.push_back(line);
+  }
+  return lines;
+}
+
+double Seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  std::vector<std::string> keys = LoadKeys(argc > 1 ? argv[1] : nullptr);
+  std::vector<std::string> corpus =
+      LoadCorpus(argc > 2 ? argv[2] : nullptr, keys);
+  std::vector<std::string> names;
+  for (int32_t i = 3; i < argc; ++i) {
+    names.push_back(argv[i]);
+  }
+  if (names.empty()) {
+    names = cppinyin::PhraseIndexNames();
+  }
+
+  std::vector<const char *> key_data;
+  std::vector<size_t> lengths;
+  std::vector<int32_t> values;
+  for (const auto &key : keys) {
+    key_data.push_back(key.data());
+    lengths.push_back(key.size());
+    values.push_back(values.size());
+  }
+  // The units of the corpus, characters as in a Chinese text, decoded once
+  // as the encoder does.
+  std::vector<std::vector<int32_t>> offsets(corpus.size());
+  std::vector<std::vector<int32_t>> codepoints(corpus.size());
+  size_t num_positions = 0;
+  for (size_t i = 0; i < corpus.size(); ++i) {
+    cppinyin::SplitUtf8(corpus[i].data(), corpus[i].size(), &offsets[i],
+                        &codepoints[i]);
+    num_positions += offsets[i].size() - 1;
+  }
+  std::cout << keys.size() << " keys, " << num_positions
+            << " corpus characters" << std::endl;
+  std::cout << std::left << std::setw(10) << "index" << std::right
+            << std::setw(12) << "build (s)" << std::setw(12) << "memory (MB)"
+            << std::setw(16) << "prefix (M/s)" << std::setw(16)
+            << "exact (M/s)" << std::setw(12) << "matches" << std::endl;
+
+  for (const auto &name : names) {
+    std::unique_ptr<PhraseIndex> index = cppinyin::NewPhraseIndex(name);
+    if (index == nullptr) {
+      std::cerr << "Unknown index " << name << std::endl;
+      return 1;
+    }
+    auto start = std::chrono::steady_clock::now();
+    index->Build(keys.size(), key_data.data(), lengths.data(), values.data());
+    double build_seconds = Seconds(start);
+
+    // The matches at every position, as CalcRoute looks them up. Their sum
+    // checks that all the indexes agree.
+    int64_t num_matches = 0;
+    auto count = [&num_matches](int32_t, int32_t value) {
+      num_matches += 1 + (value & 1);
+    };
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < corpus.size(); ++i) {
+      cppinyin::WordUnits word{corpus[i].data(), offsets[i].data(),
+                               codepoints[i].data()};
+      int32_t num_units = offsets[i].size() - 1;
+      for (int32_t u = 0; u < num_units; ++u) {
+        index->ForEachPrefix(word, u, num_units, count);
+      }
+    }
+    double prefix_seconds = Seconds(start);
+
+    int64_t found = 0;
+    start = std::chrono::steady_clock::now();
+    for (const auto &key : keys) {
+      found += index->ExactMatch(key.data(), key.size()) >= 0;
+    }
+    double exact_seconds = Seconds(start);
+    if (found != static_cast<int64_t>(keys.size())) {
+      std::cerr << name << " misses keys" << std::endl;
+      return 1;
+    }
+
+    std::cout << std::left << std::setw(10) << name << std::right
+              << std::fixed << std::setprecision(3) << std::setw(12)
+              << build_seconds << std::setw(12)
+              << index->MemoryUsage() / 1048576.0 << std::setw(16)
+              << num_positions / prefix_seconds / 1e6 << std::setw(16)
+              << keys.size() / exact_seconds / 1e6 << std::setw(12)
+              << num_matches << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,211 @@
+/**
+ * Copyright      2024    Wei Kang (wkang@pku.edu.cn)
+ *
+ * See LICENSE for clarification regarding multiple authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "cppinyin/csrc/phrase_index.h"
+#include "cppinyin/csrc/utils.h"
+
+namespace cppinyin {
+
+// Builds an index of `name` from `keys`, key i having the value 10 * i.
+std::unique_ptr<PhraseIndex> BuildIndex(const std::string &name,
+                                        std::vector<std::string> keys) {
+  std::sort(keys.begin(), keys.end());
+  std::vector<const char *> data;
+  std::vector<size_t> lengths;
+  std::vector<int32_t> values;
+  for (const auto &key : keys) {
+    data.push_back(key.data());
+    lengths.push_back(key.size());
+    values.push_back(10 * values.size());
+  }
+  auto index = NewPhraseIndex(name);
+  EXPECT_NE(index, nullptr);
+  index->Build(keys.size(), data.data(), lengths.data(), values.data());
+  return index;
+}
+
+// The (end, value) of the keys starting at character i of `str`.
+std::vector<std::pair<int32_t, int32_t>>
+Prefixes(const PhraseIndex &index, const std::string &str, int32_t i) {
+  std::vector<int32_t> offsets;
+  std::vector<int32_t> codepoints;
+  SplitUtf8(str.data(), str.size(), &offsets, &codepoints);
+  std::vector<std::pair<int32_t, int32_t>> matches;
+  auto add = [&](int32_t end, int32_t value) {
+    matches.emplace_back(end, value);
+  };
+  index.ForEachPrefix({str.data(), offsets.data(), codepoints.data()}, i,
+                      offsets.size() - 1, add);
+  return matches;
+}
+
+TEST(PhraseIndex, TestLookup) {
+  // Sorted: a, ab, abc, 中, 中国, 中国人, 人, 国
+  const std::vector<std::string> keys = {"中国", "中",   "中国人", "人",
+                                         "a",    "abc", "ab",     "国"};
+  for (const auto &name : PhraseIndexNames()) {
+    SCOPED_TRACE(name);
+    auto index = BuildIndex(name, keys);
+    EXPECT_STREQ(index->Name(), name.c_str());
+    EXPECT_EQ(index->ExactMatch("中国", std::strlen("中国")), 40);
+    EXPECT_EQ(index->ExactMatch("ab", 2), 10);
+    EXPECT_EQ(index->ExactMatch("abcd", 4), -1);
+    EXPECT_EQ(index->ExactMatch("中国人们", std::strlen("中国人们")), -1);
+    EXPECT_EQ(index->ExactMatch("", 0), -1);
+
+    using Matches = std::vector<std::pair<int32_t, int32_t>>;
+    EXPECT_EQ(Prefixes(*index, "中国人民", 0),
+              Matches({{1, 30}, {2, 40}, {3, 50}}));
+    EXPECT_EQ(Prefixes(*index, "中国人民", 1), Matches({{2, 70}}));
+    EXPECT_EQ(Prefixes(*index, "中国人民", 3), Matches());
+    EXPECT_EQ(Prefixes(*index, "abd", 0), Matches({{1, 0}, {2, 10}}));
+    EXPECT_EQ(Prefixes(*index, "b", 0), Matches());
+
+    bool key_bytes[256];
+    bool key_starts[256];
+    index->ByteTables(key_bytes, key_starts);
+    EXPECT_TRUE(key_bytes['a'] && key_bytes['c']);
+    EXPECT_TRUE(key_starts['a']);
+    EXPECT_FALSE(key_starts['b']);
+    // The lead byte of the CJK characters, and a continuation byte of 中.
+    EXPECT_TRUE(key_starts[0xE4]);
+    EXPECT_TRUE(key_bytes[0xB8] && !key_starts[0xB8]);
+  }
+}
+
+TEST(PhraseIndex, TestMalformed) {
+  // A truncated sequence, a continuation byte and an overlong sequence, units
+  // of SplitUtf8 of one byte but for the overlong one. Sorted: a\xc0\xaf,
+  // \x80, \xe4\xb8, 中\x80
+  const std::vector<std::string> keys = {"\xe4\xb8", "\x80", "a\xc0\xaf",
+                                         "中\x80"};
+  for (const auto &name : PhraseIndexNames()) {
+    SCOPED_TRACE(name);
+    auto index = BuildIndex(name, keys);
+    EXPECT_EQ(index->ExactMatch("\x80", 1), 10);
+    EXPECT_EQ(index->ExactMatch("\xe4\xb8", 2), 20);
+    EXPECT_EQ(index->ExactMatch("\xe4\xb8\xad", 3), -1);
+
+    using Matches = std::vector<std::pair<int32_t, int32_t>>;
+    EXPECT_EQ(Prefixes(*index, "a\xc0\xaf", 0), Matches({{2, 0}}));
+    EXPECT_EQ(Prefixes(*index, "a\xc0\xae", 0), Matches());
+    EXPECT_EQ(Prefixes(*index, "\x80中", 0), Matches({{1, 10}}));
+    EXPECT_EQ(Prefixes(*index, "中\x80", 0), Matches({{2, 30}}));
+    // The bytes of the truncated key start 中, a unit of its own.
+    EXPECT_EQ(Prefixes(*index, "中", 0), Matches());
+    EXPECT_EQ(Prefixes(*index, "中\xe4\xb8", 1), Matches({{3, 20}}));
+    EXPECT_EQ(Prefixes(*index, "\xe4\xb8中", 0), Matches({{2, 20}}));
+  }
+}
+
+TEST(PhraseIndex, TestDecodeUtf8) {
+  EXPECT_EQ(DecodeUtf8("a", 1), 'a');
+  EXPECT_EQ(DecodeUtf8("é", 2), 0xE9);
+  EXPECT_EQ(DecodeUtf8("中", 3), 0x4E2D);
+  EXPECT_EQ(DecodeUtf8("\xf0\x9f\x98\x80", 4), 0x1F600);
+  // A run of ASCII bytes, a truncated, a continuation byte, overlong, a
+  // surrogate and beyond U+10FFFF.
+  EXPECT_EQ(DecodeUtf8("ab", 2), -1);
+  EXPECT_EQ(DecodeUtf8("\xe4\xb8", 2), -1);
+  EXPECT_EQ(DecodeUtf8("\x80", 1), -1);
+  EXPECT_EQ(DecodeUtf8("\xc0\xaf", 2), -1);
+  EXPECT_EQ(DecodeUtf8("\xed\xa0\x80", 3), -1);
+  EXPECT_EQ(DecodeUtf8("\xf4\x90\x80\x80", 4), -1);
+
+  std::vector<int32_t> offsets;
+  std::vector<int32_t> codepoints;
+  SplitUtf8("a中\x80\xe4", 6, &offsets, &codepoints);
+  EXPECT_EQ(offsets, std::vector<int32_t>({0, 1, 4, 5, 6}));
+  EXPECT_EQ(codepoints, std::vector<int32_t>({'a', 0x4E2D, -1, -1}));
+  // A lead byte is a unit of its own when its continuation bytes are missing,
+  // the characters after it are kept whole.
+  SplitUtf8("\xe4中\xf0\x9f\x98", 7, &offsets, &codepoints);
+  EXPECT_EQ(offsets, std::vector<int32_t>({0, 1, 4, 5, 6, 7}));
+  EXPECT_EQ(codepoints, std::vector<int32_t>({-1, 0x4E2D, -1, -1, -1}));
+}
+
+TEST(PhraseIndex, TestMap) {
+  const std::vector<std::string> keys = {"我", "我们", "是", "中国", "人"};
+  for (const auto &name : PhraseIndexNames()) {
+    SCOPED_TRACE(name);
+    auto built = BuildIndex(name, keys);
+    // A copy of the data, as a model file would hold it.
+    ArrayView<char> data = built->Data();
+    std::vector<uint32_t> copy((data.size() + 3) / 4);
+    std::memcpy(copy.data(), data.data(), data.size());
+    auto mapped = NewPhraseIndex(name);
+    mapped->Map(reinterpret_cast<const char *>(copy.data()), data.size());
+    EXPECT_EQ(mapped->MemoryUsage(), built->MemoryUsage());
+    for (const std::string str : {"我们是中国人", "我是人"}) {
+      std::vector<int32_t> offsets;
+      SplitUtf8(str.data(), str.size(), &offsets);
+      for (size_t i = 0; i + 1 < offsets.size(); ++i) {
+        EXPECT_EQ(Prefixes(*mapped, str, i), Prefixes(*built, str, i));
+      }
+    }
+  }
+  EXPECT_EQ(NewPhraseIndex("unknown"), nullptr);
+}
+
+TEST(PhraseIndexDeathTest, TestMapInvalid) {
+  const std::vector<std::string> keys = {"我", "我们", "是", "中国", "人"};
+  // Returns the Data of the index of `name`, with word `i` set to `word` if
+  // `i` >= 0, or with the length of its first used hash slot set to `word`.
+  auto corrupted = [&keys](const std::string &name, int32_t i,
+                           uint32_t word) {
+    auto index = BuildIndex(name, keys);
+    ArrayView<char> data = index->Data();
+    std::vector<uint32_t> copy(data.size() / 4);
+    std::memcpy(copy.data(), data.data(), data.size());
+    if (i < 0) {
+      i = 1;
+      while (copy[i] == 0) {
+        i += 4;
+      }
+      i += 2;
+    }
+    copy[i] = word;
+    return copy;
+  };
+  auto map = [](const std::string &name, const std::vector<uint32_t> &data) {
+    NewPhraseIndex(name)->Map(reinterpret_cast<const char *>(data.data()),
+                              data.size() * 4);
+  };
+  // A unit whose children are out of the array, the end of the first key
+  // after the start of the second, and a slot past the end of the bytes.
+  EXPECT_DEATH(map("darts", corrupted("darts", 0, 0x7FFFFC00)),
+               "Invalid phrase index");
+  EXPECT_DEATH(map("sorted", corrupted("sorted", 2, 0xFFFFFF)),
+               "Invalid phrase index");
+  EXPECT_DEATH(map("hash", corrupted("hash", -1, 0xFFFFFF)),
+               "Invalid phrase index");
+  // A number of slots whose words overflow 32 bits.
+  EXPECT_DEATH(map("hash", corrupted("hash", 0, 1u << 30)),
+               "Invalid phrase index");
+}
+
+} // namespace cppinyin
@@ -0,0 +1,110 @@
+/**
+ * Copyright      2024    Wei Kang (wkang@pku.edu.cn)
+ *
+ * See LICENSE for clarification regarding multiple authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "cppinyin/csrc/rcu.h"
+#include "cppinyin/csrc/utils.h"
+#include <iostream>
+#include <limits>
+#include <thread>
+
+namespace cppinyin {
+
+namespace internal {
+
+// The state of a reader thread. Slots are reused by later threads once
+// theirs exits, and never freed.
+struct RcuReaderSlot {
+  // The epoch the outermost guard of the thread started in, the maximum
+  // value out of any guard.
+  std::atomic<uint64_t> epoch{std::numeric_limits<uint64_t>::max()};
+  std::atomic<bool> in_use{true};
+  // The number of guards the thread holds, only used by the thread itself.
+  int32_t depth = 0;
+  RcuReaderSlot *next = nullptr;
+};
+
+} // namespace internal
+
+namespace {
+
+using internal::RcuReaderSlot;
+
+constexpr uint64_t kIdle = std::numeric_limits<uint64_t>::max();
+
+std::atomic<uint64_t> global_epoch{0};
+// All the slots ever created, new ones are pushed at the front.
+std::atomic<RcuReaderSlot *> slots{nullptr};
+
+RcuReaderSlot *AcquireSlot() {
+  for (auto *slot = slots.load(); slot != nullptr; slot = slot->next) {
+    bool in_use = false;
+    if (!slot->in_use.load(std::memory_order_relaxed) &&
+        slot->in_use.compare_exchange_strong(in_use, true)) {
+      return slot;
+    }
+  }
+  auto *slot = new RcuReaderSlot;
+  slot->next = slots.load();
+  while (!slots.compare_exchange_weak(slot->next, slot)) {
+  }
+  return slot;
+}
+
+// Holds the slot of a thread, and releases it when the thread exits.
+struct ThreadSlot {
+  ThreadSlot() : slot(AcquireSlot()) {}
+  ~ThreadSlot() { slot->in_use.store(false); }
+
+  RcuReaderSlot *slot;
+};
+
+RcuReaderSlot *CurrentSlot() {
+  thread_local ThreadSlot thread_slot;
+  return thread_slot.slot;
+}
+
+} // namespace
+
+RcuReadGuard::RcuReadGuard() : slot_(CurrentSlot()) {
+  if (slot_->depth++ == 0) {
+    // Sequentially consistent, so that the pointers the reader loads next are
+    // loaded after the store, which a writer waiting for the epoch sees.
+    slot_->epoch.store(global_epoch.load());
+  }
+}
+
+RcuReadGuard::~RcuReadGuard() {
+  if (--slot_->depth == 0) {
+    slot_->epoch.store(kIdle, std::memory_order_release);
+  }
+}
+
+void RcuSynchronize() {
+  CPY_ASSERT(CurrentSlot()->depth == 0,
+             "RcuSynchronize called while holding an RcuReadGuard");
+  // The readers starting from now on see the pointers stored before, only
+  // the readers of an earlier epoch may hold the old ones.
+  uint64_t epoch = global_epoch.fetch_add(1);
+  for (auto *slot = slots.load(); slot != nullptr; slot = slot->next) {
+    while (slot->epoch.load() <= epoch) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+} // namespace cppinyin
@@ -0,0 +1,59 @@
+/**
+ * Copyright      2024    Wei Kang (wkang@pku.edu.cn)
+ *
+ * See LICENSE for clarification regarding multiple authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CPPINYIN_CSRC_RCU_H_
+#define CPPINYIN_CSRC_RCU_H_
+
+#include <atomic>
+#include <cstdint>
+
+namespace cppinyin {
+
+// Epoch based read-copy-update, shared by the whole process. Readers load
+// pointers to published data while they hold an RcuReadGuard, which costs
+// them a store to a slot of their own thread and takes no lock. A writer
+// replaces the pointer, calls RcuSynchronize, which waits for the readers
+// that may still hold the old pointer, and then frees the old data.
+//
+// The guards nest. A thread holding one must not call RcuSynchronize, it
+// would wait for itself.
+
+namespace internal {
+
+struct RcuReaderSlot;
+
+} // namespace internal
+
+class RcuReadGuard {
+public:
+  RcuReadGuard();
+  ~RcuReadGuard();
+
+  RcuReadGuard(const RcuReadGuard &) = delete;
+  RcuReadGuard &operator=(const RcuReadGuard &) = delete;
+
+private:
+  internal::RcuReaderSlot *slot_;
+};
+
+// Returns once every read guard held when it was called has been released.
+void RcuSynchronize();
+
+} // namespace cppinyin
+
+#endif // CPPINYIN_CSRC_RCU_H_
@@ -0,0 +1,247 @@
+/**
+ * Copyright      2024    Wei Kang (wkang@pku.edu.cn)
+ *
+ * See LICENSE for clarification regarding multiple authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "cppinyin/csrc/streaming_encoder.h"
+#include "cppinyin/csrc/rcu.h"
+#include "cppinyin/csrc/utils.h"
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace cppinyin {
+
+namespace {
+
+// The number of characters PinyinEncoder counts in the `size` bytes at `str`,
+// which end on a character boundary.
+int32_t CountChars(const char *str, size_t size) {
+  int32_t num_chars = 0;
+  size_t i = 0;
+  while (i < size) {
+    if (IsSpace(str[i])) {
+      ++i;
+      ++num_chars;
+      continue;
+    }
+    size_t end = i;
+    while (end < size && !IsSpace(str[end])) {
+      ++end;
+    }
+    // The characters of the word as PinyinEncoder::SplitWord splits them.
+    while (i < end) {
+      i += Utf8CharLen(str + i, end - i);
+      ++num_chars;
+    }
+  }
+  return num_chars;
+}
+
+// Returns the size of `str` (of `size` bytes) without its trailing bytes if
+// they are an incomplete UTF-8 sequence: appended text may complete it, when
+// SplitWord would make one character of the bytes it now splits apart.
+size_t CompleteSize(const char *str, size_t size) {
+  for (size_t j = 1; j <= 3 && j <= size; ++j) {
+    uint8_t c = static_cast<uint8_t>(str[size - j]);
+    if ((c & 0xC0) != 0x80) {
+      bool lead = c >= 0xC0 && c < 0xF8;
+      size_t len = c < 0xE0 ? 2 : (c < 0xF0 ? 3 : 4);
+      return lead && j < len ? size - j : size;
+    }
+  }
+  return size;
+}
+
+} // namespace
+
+StreamingEncoder::StreamingEncoder(const PinyinEncoder *encoder,
+                                   const EncodeOptions &options)
+    : encoder_(encoder), options_(options) {}
+
+void StreamingEncoder::Append(const std::string &chunk,
+                              std::vector<std::string> *ostrs,
+                              std::vector<Segment> *segs /*=nullptr*/) {
+  pending_.append(chunk);
+  // Whitespace ends words, all the words before the last one are stable.
+  size_t size = pending_.size();
+  while (size > 0 && !IsSpace(pending_[size - 1])) {
+    --size;
+  }
+  if (size > 0) {
+    EmitWords(size, ostrs, segs);
+  }
+  if (!pending_.empty()) {
+    EmitStablePrefix(ostrs, segs);
+  }
+}
+
+void StreamingEncoder::Tentative(
+    std::vector<std::string> *ostrs,
+    std::vector<Segment> *segs /*=nullptr*/) const {
+  encoder_->Encode(pending_.data(), pending_.size(), options_, nullptr, ostrs,
+                   segs);
+  if (segs != nullptr) {
+    for (auto &seg : *segs) {
+      seg.begin += Base();
+      seg.end += Base();
+      seg.token += num_tokens_;
+    }
+  }
+}
+
+void StreamingEncoder::Finish(std::vector<std::string> *ostrs,
+                              std::vector<Segment> *segs /*=nullptr*/) {
+  if (!pending_.empty()) {
+    EmitWords(pending_.size(), ostrs, segs);
+  }
+  Reset();
+}
+
+void StreamingEncoder::Reset() {
+  pending_.clear();
+  byte_base_ = 0;
+  char_base_ = 0;
+  num_tokens_ = 0;
+  ClearUnits();
+}
+
+void StreamingEncoder::EmitWords(size_t size, std::vector<std::string> *ostrs,
+                                 std::vector<Segment> *segs) {
+  encoder_->Encode(pending_.data(), size, options_, &ws_, &tokens_,
+                   segs != nullptr ? &segments_ : nullptr);
+  Output(ostrs, segs);
+  Consume(size);
+  ClearUnits();
+}
+
+void StreamingEncoder::EmitStablePrefix(std::vector<std::string> *ostrs,
+                                        std::vector<Segment> *segs) {
+  const char *str = pending_.data();
+  size_t size = CompleteSize(str, pending_.size());
+  if (size == 0) {
+    return;
+  }
+  RcuReadGuard guard;
+  auto snapshot = encoder_->CurrentSnapshot();
+  UpdateUnits(size, snapshot);
+  encoder_->CalcRoute(snapshot, matches_, &ws_.route);
+  int32_t num_units =
+      encoder_->StablePrefix(snapshot, ws_.route, matches_, &anchors_);
+  if (num_units == 0) {
+    return;
+  }
+  // Cut stops at the end of the offsets it is given.
+  offsets_.assign(units_.begin(), units_.begin() + num_units + 1);
+  tokens_.clear();
+  segments_.clear();
+  encoder_->CutWord(str, offsets_, ws_.route, snapshot, options_, 0,
+                    &tokens_, segs != nullptr ? &segments_ : nullptr);
+  Output(ostrs, segs);
+  DropUnits(num_units);
+  Consume(offsets_[num_units]);
+}
+
+void StreamingEncoder::UpdateUnits(size_t size,
+                                   const PinyinEncoder::Snapshot &snapshot) {
+  uint64_t layers_version = snapshot.layers->version;
+  uint64_t user_version =
+      snapshot.user != nullptr ? snapshot.user->version : 0;
+  if (layers_version != layers_version_ || user_version != user_version_) {
+    ClearUnits();
+    layers_version_ = layers_version;
+    user_version_ = user_version;
+  }
+  // Appended text may extend the last unit, a run of ASCII bytes, so the
+  // word is split again from the start of the last unit.
+  size_t keep = units_.size() < 2 ? 0 : units_.size() - 2;
+  int32_t start = keep < units_.size() ? units_[keep] : 0;
+  units_.resize(keep);
+  codepoints_.resize(std::min(codepoints_.size(), keep));
+  const char *str = pending_.data();
+  encoder_->SplitWord(str + start, size - start, snapshot, &ws_.offsets,
+                      &ws_.codepoints);
+  for (int32_t offset : ws_.offsets) {
+    units_.push_back(start + offset);
+  }
+  codepoints_.insert(codepoints_.end(), ws_.codepoints.begin(),
+                     ws_.codepoints.end());
+
+  int32_t num_units = units_.size() - 1;
+  int32_t max_key_len = snapshot.layers->max_key_len;
+  if (snapshot.user != nullptr) {
+    max_key_len = std::max(max_key_len, snapshot.user->max_key_len);
+  }
+  // The keys of the later units may reach the last unit, they are looked up
+  // again.
+  matches_.begins.resize(num_fixed_ + 1);
+  matches_.keys.resize(matches_.begins.back());
+  const WordUnits word{str, units_.data(), codepoints_.data()};
+  encoder_->MatchUnits(word, num_units, snapshot, num_fixed_, num_units,
+                       &matches_);
+  num_fixed_ = num_units - std::min(std::max(max_key_len, 1), num_units);
+}
+
+void StreamingEncoder::DropUnits(int32_t num_units) {
+  int32_t byte_offset = units_[num_units];
+  units_.erase(units_.begin(), units_.begin() + num_units);
+  for (auto &offset : units_) {
+    offset -= byte_offset;
+  }
+  codepoints_.erase(codepoints_.begin(),
+                    codepoints_.begin() +
+                        std::min<size_t>(codepoints_.size(), num_units));
+  auto &begins = matches_.begins;
+  int32_t first_key = begins[num_units];
+  matches_.keys.erase(matches_.keys.begin(),
+                      matches_.keys.begin() + first_key);
+  for (auto &key : matches_.keys) {
+    key.first -= num_units;
+  }
+  begins.erase(begins.begin(), begins.begin() + num_units);
+  for (auto &begin : begins) {
+    begin -= first_key;
+  }
+  num_fixed_ = std::max(num_fixed_ - num_units, 0);
+}
+
+void StreamingEncoder::ClearUnits() {
+  units_.clear();
+  codepoints_.clear();
+  matches_.keys.clear();
+  matches_.begins.assign(1, 0);
+  num_fixed_ = 0;
+}
+
+void StreamingEncoder::Output(std::vector<std::string> *ostrs,
+                              std::vector<Segment> *segs) {
+  if (segs != nullptr) {
+    for (const auto &seg : segments_) {
+      segs->push_back(
+          {seg.begin + Base(), seg.end + Base(), seg.token + num_tokens_});
+    }
+  }
+  ostrs->insert(ostrs->end(), tokens_.begin(), tokens_.end());
+  num_tokens_ += tokens_.size();
+}
+
+void StreamingEncoder::Consume(size_t size) {
+  char_base_ += CountChars(pending_.data(), size);
+  byte_base_ += size;
+  pending_.erase(0, size);
+}
+
+} // namespace cppinyin
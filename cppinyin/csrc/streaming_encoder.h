@@ -0,0 +1,140 @@
+/**
+ * Copyright      2024    Wei Kang (wkang@pku.edu.cn)
+ *
+ * See LICENSE for clarification regarding multiple authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CPPINYIN_CSRC_STREAMING_ENCODER_H_
+#define CPPINYIN_CSRC_STREAMING_ENCODER_H_
+
+#include "cppinyin/csrc/cppinyin.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace cppinyin {
+
+// Encodes a text given chunk by chunk, e.g. the growing partial transcript of
+// a streaming ASR, without encoding it again from the start for every chunk.
+//
+// Each Append outputs the tokens that become stable: PinyinEncoder::Encode
+// outputs them for the whole text whatever is appended later. The words
+// before a whitespace are stable. In the last word, the tokens are stable up
+// to the first dictionary decision that appended text could still overturn.
+// The rest of the text is pending and Tentative outputs its tokens as they
+// would be if the text ended there.
+//
+// The keys found in the pending text are kept, so an Append walks the tries
+// only from its last units. The route is still recomputed over the whole
+// pending text, which usually spans a few keys but grows along a chain of
+// overlapping keys. A model of format v1 does not record its longest key,
+// and then nothing is output before a whitespace.
+//
+// Concatenating the outputs of all the Append calls and of Finish gives the
+// output of Encode for the whole text, segments included: their offsets are
+// counted from the start of the text and their tokens from the first token
+// output.
+//
+// The encoder must outlive the StreamingEncoder. Its model may be reloaded
+// and its user words changed during a text, the tokens output before the
+// change then stay as they were. A StreamingEncoder must not be
+// shared by concurrent calls.
+class StreamingEncoder {
+public:
+  explicit StreamingEncoder(const PinyinEncoder *encoder,
+                            const EncodeOptions &options = EncodeOptions());
+
+  // Appends a chunk of UTF-8 text, which may end in the middle of a
+  // character, and appends the tokens which became stable to `ostrs`, and
+  // their segments to `segs` if it is not nullptr.
+  void Append(const std::string &chunk, std::vector<std::string> *ostrs,
+              std::vector<Segment> *segs = nullptr);
+
+  // The tokens of the pending text, as Encode outputs them if the text ends
+  // here. They replace the content of `ostrs` and `segs`.
+  void Tentative(std::vector<std::string> *ostrs,
+                 std::vector<Segment> *segs = nullptr) const;
+
+  // Ends the text, appends the tokens of the pending text to `ostrs` and
+  // `segs`, then resets the stream.
+  void Finish(std::vector<std::string> *ostrs,
+              std::vector<Segment> *segs = nullptr);
+
+  // Drops the pending text and starts a new text.
+  void Reset();
+
+  // The text not output yet.
+  const std::string &Pending() const { return pending_; }
+
+private:
+  // Outputs the tokens of the first `size` bytes of pending_, a sequence of
+  // whole words, and removes them from pending_.
+  void EmitWords(size_t size, std::vector<std::string> *ostrs,
+                 std::vector<Segment> *segs);
+
+  // Outputs the stable tokens of pending_, which is a part of a word.
+  void EmitStablePrefix(std::vector<std::string> *ostrs,
+                        std::vector<Segment> *segs);
+
+  // Updates units_, codepoints_ and matches_ for the first `size` bytes of
+  // pending_, which end on a character boundary.
+  void UpdateUnits(size_t size, const PinyinEncoder::Snapshot &snapshot);
+
+  // Drops the first `num_units` units of units_, codepoints_ and matches_.
+  void DropUnits(int32_t num_units);
+
+  // Forgets the units, when the word they split is consumed.
+  void ClearUnits();
+
+  // Appends tokens_ and segments_, whose offsets are relative to pending_,
+  // to the output.
+  void Output(std::vector<std::string> *ostrs, std::vector<Segment> *segs);
+
+  // Removes the first `size` bytes of pending_.
+  void Consume(size_t size);
+
+  // The offset, in the unit given by options_.char_offset, of pending_ in the
+  // whole text.
+  int32_t Base() const {
+    return options_.char_offset ? char_base_ : byte_base_;
+  }
+
+  const PinyinEncoder *encoder_;
+  EncodeOptions options_;
+  std::string pending_;
+  int32_t byte_base_ = 0;
+  int32_t char_base_ = 0;
+  // The number of tokens output since the start of the text.
+  int32_t num_tokens_ = 0;
+
+  EncodeWorkspace ws_;
+  std::vector<int32_t> offsets_;
+  std::vector<int32_t> anchors_;
+
+  // The units of the complete characters of pending_ and their keys, found
+  // with the versions below. Appended text never changes the first num_fixed_.
+  std::vector<int32_t> units_;
+  std::vector<int32_t> codepoints_;
+  PinyinEncoder::WordMatches matches_;
+  int32_t num_fixed_ = 0;
+  uint64_t layers_version_ = 0;
+  uint64_t user_version_ = 0;
+  std::vector<std::string> tokens_;
+  std::vector<Segment> segments_;
+};
+
+} // namespace cppinyin
+
+#endif // CPPINYIN_CSRC_STREAMING_ENCODER_H_
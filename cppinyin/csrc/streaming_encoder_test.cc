@@ -0,0 +1,181 @@
+/**
+ * Copyright      2024  Wei Kang (wkang@pku.edu.cn)
+ *
+ * See LICENSE for clarification regarding multiple authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "gtest/gtest.h"
+
+#include <string>
+#include <vector>
+
+#include "cppinyin/csrc/cppinyin.h"
+#include "cppinyin/csrc/streaming_encoder.h"
+
+namespace cppinyin {
+
+void ExpectSegmentsEq(const std::vector<Segment> &segs,
+                      const std::vector<Segment> &expected) {
+  ASSERT_EQ(segs.size(), expected.size());
+  for (size_t i = 0; i < segs.size(); ++i) {
+    EXPECT_EQ(segs[i].begin, expected[i].begin);
+    EXPECT_EQ(segs[i].end, expected[i].end);
+    EXPECT_EQ(segs[i].token, expected[i].token);
+  }
+}
+
+TEST(StreamingEncoder, TestSameAsEncode) {
+  std::string vocab_path = "cppinyin/python/cppinyin/resources/pinyin.raw";
+  PinyinEncoder processor(vocab_path);
+
+  std::vector<std::string> texts(
+      {"我是中国人我爱我的祖国银行行长一切重庆长大",
+       "我是中国人 love you 祖国，儿子长大了\xe4",
+       "中国人民银行行长是中国人", "中\xe5\x9b我\xe4是 \xe4", "   ", ""});
+  // The user words are looked up along with the dictionary, the longer keys
+  // delaying the stable tokens.
+  for (bool user_words : {false, true}) {
+    if (user_words) {
+      ASSERT_TRUE(processor.AddUserWord("行长是中国人", -10.0,
+                                        {"hang2", "zhang3", "shi4", "zhong1",
+                                         "guo2", "ren2"}));
+      ASSERT_TRUE(processor.AddUserWord("长大", -5.0, {"zhang3", "da4"}));
+    }
+    for (bool char_offset : {false, true}) {
+      EncodeOptions options;
+      options.tone = Tone::kNormal;
+      options.partial = true;
+      options.char_offset = char_offset;
+      StreamingEncoder stream(&processor, options);
+      for (const auto &text : texts) {
+        std::vector<std::string> expected;
+        std::vector<Segment> expected_segs;
+        processor.Encode(text.data(), text.size(), options, nullptr, &expected,
+                         &expected_segs);
+        // Chunks of every size, splitting characters.
+        for (size_t chunk = 1; chunk <= 7; ++chunk) {
+          std::vector<std::string> pieces;
+          std::vector<Segment> segs;
+          for (size_t i = 0; i < text.size(); i += chunk) {
+            stream.Append(text.substr(i, chunk), &pieces, &segs);
+
+            // The stable tokens followed by the tentative ones are the tokens
+            // of the text so far.
+            std::vector<std::string> tentative;
+            std::vector<Segment> tentative_segs;
+            stream.Tentative(&tentative, &tentative_segs);
+            std::vector<std::string> all(pieces);
+            all.insert(all.end(), tentative.begin(), tentative.end());
+            std::vector<Segment> all_segs(segs);
+            all_segs.insert(all_segs.end(), tentative_segs.begin(),
+                            tentative_segs.end());
+            std::string prefix = text.substr(0, i + chunk);
+            std::vector<std::string> prefix_pieces;
+            std::vector<Segment> prefix_segs;
+            processor.Encode(prefix.data(), prefix.size(), options, nullptr,
+                             &prefix_pieces, &prefix_segs);
+            EXPECT_EQ(all, prefix_pieces);
+            ExpectSegmentsEq(all_segs, prefix_segs);
+          }
+          stream.Finish(&pieces, &segs);
+          EXPECT_EQ(pieces, expected);
+          ExpectSegmentsEq(segs, expected_segs);
+          EXPECT_TRUE(stream.Pending().empty());
+        }
+      }
+    }
+  }
+}
+
+TEST(StreamingEncoder, TestStablePrefix) {
+  std::string vocab_path = "cppinyin/python/cppinyin/resources/pinyin.raw";
+  PinyinEncoder processor(vocab_path);
+
+  StreamingEncoder stream(&processor);
+  std::vector<std::string> pieces;
+  // The words before a whitespace are stable.
+  stream.Append("我是 中", &pieces);
+  EXPECT_EQ(pieces, std::vector<std::string>({"wo3", "shi4"}));
+  EXPECT_EQ(stream.Pending(), "中");
+  pieces.clear();
+  // Inside a word, the text a key may still extend stays pending.
+  std::string word = "我是中国人我爱我的祖国";
+  for (int32_t i = 0; i < 20; ++i) {
+    stream.Append(word, &pieces);
+  }
+  EXPECT_GT(pieces.size(), 100);
+  EXPECT_LT(stream.Pending().size(), word.size());
+}
+
+TEST(StreamingEncoder, TestGrowingWord) {
+  std::string vocab_path = "cppinyin/python/cppinyin/resources/pinyin.raw";
+  PinyinEncoder processor(vocab_path);
+
+  // An unspaced text, as a streaming ASR gives it, is output as it grows and
+  // only the last few characters stay pending.
+  std::string text;
+  for (int32_t i = 0; i < 300; ++i) {
+    text += "我是中国人我爱我的祖国银行行长一切重庆长大";
+  }
+  std::vector<std::string> expected;
+  processor.Encode(text, &expected);
+  for (size_t chunk : {1, 5, 64}) {
+    StreamingEncoder stream(&processor);
+    std::vector<std::string> pieces;
+    for (size_t i = 0; i < text.size(); i += chunk) {
+      stream.Append(text.substr(i, chunk), &pieces);
+      EXPECT_LT(stream.Pending().size(), 16 + chunk);
+    }
+    EXPECT_GT(pieces.size(), expected.size() - 8);
+    stream.Finish(&pieces);
+    EXPECT_EQ(pieces, expected);
+  }
+
+  // With overlapping keys, no decision is stable before the chain of keys
+  // ends. A user word added in the middle of the chain applies to the pending
+  // text, whose keys were found before.
+  ASSERT_TRUE(processor.AddUserWord("国中", -1.0, {"guo2", "zhong1"}));
+  text.clear();
+  for (int32_t i = 0; i < 30; ++i) {
+    text += "中国";
+  }
+  size_t chain = text.size();
+  for (int32_t i = 0; i < 10; ++i) {
+    text += "我是";
+  }
+  for (size_t split = 0; split <= chain; split += 3) {
+    StreamingEncoder stream(&processor);
+    std::vector<std::string> pieces;
+    for (size_t i = 0; i < split; i += 3) {
+      stream.Append(text.substr(i, 3), &pieces);
+    }
+    EXPECT_EQ(stream.Pending(), text.substr(0, split));
+    ASSERT_TRUE(
+        processor.AddUserWord("中国中", -0.5, {"zhong4", "guo2", "zhong4"}));
+    std::vector<std::string> rest;
+    processor.Encode(stream.Pending() + text.substr(split), &rest);
+    expected = pieces;
+    expected.insert(expected.end(), rest.begin(), rest.end());
+    for (size_t i = split; i < text.size(); i += 3) {
+      stream.Append(text.substr(i, 3), &pieces);
+    }
+    EXPECT_GT(pieces.size(), 2 * 30);
+    stream.Finish(&pieces);
+    EXPECT_EQ(pieces, expected);
+    ASSERT_TRUE(processor.RemoveUserWord("中国中"));
+  }
+}
+
+} // namespace cppinyin
@@ -1,5 +1,6 @@
 // The code is taken from
 // https://github.com/progschj/ThreadPool/blob/master/ThreadPool.h
+// and altered: parallel_for and size() were added.
 
 /*
  Copyright (c) 2012 Jakob Progsch, Václav Zeman
@@ -27,7 +28,10 @@ freely, subject to the following restrictions:
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
+#include <algorithm>
+#include <atomic>
 #include <condition_variable>
+#include <exception>
 #include <functional>
 #include <future>
 #include <memory>
@@ -35,14 +39,73 @@ freely, subject to the following restrictions:
 #include <queue>
 #include <stdexcept>
 #include <thread>
+#include <type_traits>
 #include <vector>
 
+// The state of a parallel_for call, shared by the calling thread and the
+// tasks it enqueues, see ThreadPool::parallel_for. Tasks starting after the
+// call returned find no chunk left and never touch `f`.
+template <class F> struct ParallelForState {
+  ParallelForState(size_t begin, size_t end, size_t grain, F *f)
+      : next(begin), end(end), grain(grain), f(f),
+        pending((end - begin + grain - 1) / grain) {}
+
+  // Claims and runs chunks until there is none left.
+  void run() {
+    for (;;) {
+      size_t first = next.fetch_add(grain, std::memory_order_relaxed);
+      if (first >= end)
+        return;
+      size_t last = std::min(end, first + grain);
+      try {
+        for (size_t i = first; i < last; ++i)
+          (*f)(i);
+      } catch (...) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!error)
+          error = std::current_exception();
+      }
+      if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.notify_all();
+      }
+    }
+  }
+
+  // Blocks until all the chunks are done.
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock,
+              [this] { return pending.load(std::memory_order_acquire) == 0; });
+  }
+
+  std::atomic<size_t> next;
+  const size_t end;
+  const size_t grain;
+  F *f;
+  // The latch, counts the chunks not done yet.
+  std::atomic<size_t> pending;
+  std::mutex mutex;
+  std::condition_variable done;
+  std::exception_ptr error;
+};
+
 class ThreadPool {
 public:
   ThreadPool(size_t);
   template <class F, class... Args>
   auto enqueue(F &&f, Args &&...args)
       -> std::future<typename std::result_of<F(Args...)>::type>;
+  // Calls f(i) for each i in [begin, end). The range is cut into chunks of
+  // `grain` indexes, claimed in turn by the workers and by the calling thread
+  // through an atomic counter, so scheduling costs one task per worker and
+  // one atomic increment per chunk instead of a future per index. Returns once
+  // every chunk is done and rethrows the first exception thrown by f. As the
+  // calling thread works too, it may be called from a task of this pool.
+  template <class F>
+  void parallel_for(size_t begin, size_t end, size_t grain, F &&f);
+  // the number of worker threads
+  size_t size() const { return workers.size(); }
   ~ThreadPool();
 
 private:
@@ -102,6 +165,42 @@ auto ThreadPool::enqueue(F &&f, Args &&...args)
   return res;
 }
 
+template <class F>
+void ThreadPool::parallel_for(size_t begin, size_t end, size_t grain, F &&f) {
+  if (begin >= end)
+    return;
+  if (grain == 0)
+    grain = 1;
+  using State =
+      ParallelForState<typename std::remove_reference<F>::type>;
+  auto state = std::make_shared<State>(begin, end, grain, &f);
+
+  // The calling thread takes a chunk itself, so one chunk needs no helper.
+  size_t num_helpers =
+      std::min(workers.size(), (end - begin + grain - 1) / grain - 1);
+  if (num_helpers > 0) {
+    {
+      std::unique_lock<std::mutex> lock(queue_mutex);
+
+      // don't allow enqueueing after stopping the pool
+      if (stop)
+        throw std::runtime_error("parallel_for on stopped ThreadPool");
+
+      for (size_t i = 0; i < num_helpers; ++i)
+        tasks.emplace([state]() { state->run(); });
+    }
+    if (num_helpers == 1)
+      condition.notify_one();
+    else
+      condition.notify_all();
+  }
+
+  state->run();
+  state->wait();
+  if (state->error)
+    std::rethrow_exception(state->error);
+}
+
 // the destructor joins all threads
 inline ThreadPool::~ThreadPool() {
   {
@@ -0,0 +1,139 @@
+/**
+ * Copyright      2024    Wei Kang (wkang@pku.edu.cn)
+ *
+ * See LICENSE for clarification regarding multiple authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures how the throughput of batch encoding scales with the number of
+// threads, for ThreadPool and WorkStealingThreadPool.
+//
+// Usage: threadpool_benchmark <vocab or model> [text file] [max threads]
+//
+// Each line of the text file is one string of the batch. Without a text
+// file, or with "-", a batch of short synthetic strings is used. Each pool
+// runs the batch with one future per string through enqueue, and in chunks
+// through parallel_for.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cppinyin/csrc/cppinyin.h"
+#include "cppinyin/csrc/threadpool.h"
+#include "cppinyin/csrc/work_stealing_pool.h"
+
+namespace {
+
+std::vector<std::string> LoadBatch(const char *path) {
+  std::vector<std::string> strs;
+  if (path != nullptr && std::string(path) != "-") {
+    std::ifstream is(path);
+    std::string line;
+    while (std::getline(is, line)) {
+      strs.push_back(line);
+    }
+    return strs;
+  }
+  const std::vector<std::string> words = {
+      "我", "是", "中国", "人", "我爱", "祖国", "银行", "行长", "重庆", "love"};
+  for (int32_t i = 0; i < 200000; ++i) {
+    std::string s;
+    for (int32_t j = 0; j < 1 + i % 6; ++j) {
+      s += words[(i * 7 + j * 3) % words.size()];
+    }
+    strs.push_back(s);
+  }
+  return strs;
+}
+
+// Returns the number of strings encoded per second.
+template <typename Pool>
+double Run(Pool &pool, const cppinyin::PinyinEncoder &encoder,
+           const std::vector<std::string> &strs, bool chunked) {
+  std::vector<std::vector<std::string>> ostrs(strs.size());
+  auto start = std::chrono::steady_clock::now();
+  if (chunked) {
+    size_t grain =
+        std::max<size_t>(1, strs.size() / ((pool.size() + 1) * 4));
+    pool.parallel_for(0, strs.size(), grain, [&](size_t i) {
+      encoder.Encode(strs[i], &ostrs[i]);
+    });
+  } else {
+    std::vector<std::future<void>> results;
+    results.reserve(strs.size());
+    for (size_t i = 0; i < strs.size(); ++i) {
+      results.emplace_back(pool.enqueue(
+          [&, i] { encoder.Encode(strs[i], &ostrs[i]); }));
+    }
+    for (auto &result : results) {
+      result.get();
+    }
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return strs.size() / elapsed.count();
+}
+
+template <typename Pool>
+void Benchmark(const char *name, int32_t num_threads,
+               const cppinyin::PinyinEncoder &encoder,
+               const std::vector<std::string> &strs) {
+  Pool pool(num_threads);
+  // Warm up the thread local workspaces.
+  Run(pool, encoder, strs, true);
+  double enqueue = Run(pool, encoder, strs, false);
+  double chunked = Run(pool, encoder, strs, true);
+  std::cout << std::setw(24) << name << std::setw(8) << num_threads
+            << std::setw(16) << static_cast<int64_t>(enqueue) << std::setw(16)
+            << static_cast<int64_t>(chunked) << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0]
+              << " <vocab or model> [text file] [max threads]" << std::endl;
+    return 1;
+  }
+  cppinyin::PinyinEncoder encoder(argv[1], 1);
+  std::vector<std::string> strs = LoadBatch(argc > 2 ? argv[2] : nullptr);
+  int32_t max_threads = argc > 3 ? std::atoi(argv[3])
+                                 : std::thread::hardware_concurrency();
+  max_threads = std::max(1, max_threads);
+
+  std::cout << "Batch of " << strs.size() << " strings, strings per second"
+            << std::endl;
+  std::cout << std::setw(24) << "pool" << std::setw(8) << "threads"
+            << std::setw(16) << "enqueue" << std::setw(16) << "parallel_for"
+            << std::endl;
+  for (int32_t n = 1;; n = std::min(n * 2, max_threads)) {
+    Benchmark<ThreadPool>("ThreadPool", n, encoder, strs);
+    Benchmark<cppinyin::WorkStealingThreadPool>("WorkStealingThreadPool", n,
+                                                encoder, strs);
+    if (n == max_threads) {
+      break;
+    }
+  }
+  return 0;
+}
@@ -1,10 +1,27 @@
 #include "cppinyin/csrc/utils.h"
+#include <algorithm>
+#include <cmath>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <string>
 #include <vector>
 
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define CPPINYIN_HAVE_SSE2 1
+#endif
+
 namespace cppinyin {
 
 std::string RemoveNumberTone(const std::string &s) {
@@ -15,6 +32,24 @@ std::string RemoveNumberTone(const std::string &s) {
   }
 }
 
+void SplitUtf8(const char *str, size_t size, std::vector<int32_t> *offsets,
+               std::vector<int32_t> *codepoints /*= nullptr*/) {
+  offsets->clear();
+  if (codepoints != nullptr) {
+    codepoints->clear();
+  }
+  size_t i = 0;
+  while (i < size) {
+    offsets->push_back(i);
+    size_t end = i + Utf8CharLen(str + i, size - i);
+    if (codepoints != nullptr) {
+      codepoints->push_back(DecodeUtf8(str + i, end - i));
+    }
+    i = end;
+  }
+  offsets->push_back(size);
+}
+
 size_t ReadUint32(std::istream &ifile, uint32_t *data) {
   ifile.read(reinterpret_cast<char *>(data), sizeof(uint32_t));
   return sizeof(uint32_t);
@@ -57,10 +92,248 @@ size_t ReadHeader(std::istream &ifile, std::string *data) {
   return header.size();
 }
 
-size_t WriteHeader(std::ofstream &ofile) {
-  std::string header(HEADER);
-  ofile.write(&header[0], header.size());
-  return header.size();
+size_t WriteHeader(std::ofstream &ofile, const char *header /*=HEADER*/) {
+  size_t size = std::strlen(header);
+  ofile.write(header, size);
+  return size;
+}
+
+size_t AsciiPrefixLength(const char *str, size_t size) {
+  size_t i = 0;
+  // The vector loops stop at the block holding the first non ASCII byte, the
+  // scalar loop at the end locates it.
+#if defined(__AVX2__)
+  for (; i + 32 <= size; i += 32) {
+    __m256i block =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(str + i));
+    if (_mm256_movemask_epi8(block) != 0) {
+      break;
+    }
+  }
+#endif
+#if defined(CPPINYIN_HAVE_SSE2)
+  for (; i + 16 <= size; i += 16) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(str + i));
+    if (_mm_movemask_epi8(block) != 0) {
+      break;
+    }
+  }
+#endif
+  for (; i + 8 <= size; i += 8) {
+    uint64_t block;
+    std::memcpy(&block, str + i, sizeof(block));
+    if ((block & 0x8080808080808080ULL) != 0) {
+      break;
+    }
+  }
+  while (i < size && static_cast<uint8_t>(str[i]) < 0x80) {
+    ++i;
+  }
+  return i;
+}
+
+bool ParseFloat(const char *begin, const char *end, float *value) {
+  // The powers of ten that are exact in a float.
+  static const float kPow10[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f,
+                                 1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+  const char *p = begin;
+  bool negative = p != end && *p == '-';
+  if (p != end && (*p == '-' || *p == '+')) {
+    ++p;
+  }
+  uint32_t mantissa = 0;
+  int32_t num_digits = 0;
+  int32_t exponent = 0;
+  bool any_digit = false;
+  for (; p != end && *p >= '0' && *p <= '9'; ++p, any_digit = true) {
+    if (mantissa != 0 || *p != '0') {
+      mantissa = mantissa * 10 + (*p - '0');
+      ++num_digits;
+    }
+    if (num_digits > 7) {
+      break;
+    }
+  }
+  if (p != end && *p == '.' && num_digits <= 7) {
+    for (++p; p != end && *p >= '0' && *p <= '9'; ++p, any_digit = true) {
+      if (mantissa != 0 || *p != '0') {
+        mantissa = mantissa * 10 + (*p - '0');
+        ++num_digits;
+      }
+      --exponent;
+      if (num_digits > 7) {
+        break;
+      }
+    }
+  }
+  if (any_digit && num_digits <= 7 && p != end && (*p == 'e' || *p == 'E')) {
+    const char *q = p + 1;
+    bool negative_exponent = q != end && *q == '-';
+    if (q != end && (*q == '-' || *q == '+')) {
+      ++q;
+    }
+    int32_t e = 0;
+    const char *digits = q;
+    for (; q != end && *q >= '0' && *q <= '9' && e < 100; ++q) {
+      e = e * 10 + (*q - '0');
+    }
+    if (q != digits) {
+      exponent += negative_exponent ? -e : e;
+      p = q;
+    }
+  }
+  // A mantissa of at most 7 digits is exact in a float, and so are the powers
+  // of ten up to 1e10, so the result of the single multiplication or division
+  // is correctly rounded.
+  if (any_digit && p == end && num_digits <= 7 && exponent >= -10 &&
+      exponent <= 10) {
+    float f = static_cast<float>(mantissa);
+    f = exponent < 0 ? f / kPow10[-exponent] : f * kPow10[exponent];
+    *value = negative ? -f : f;
+    return true;
+  }
+  // The other numbers must still be decimal, as `std::istream >> float`
+  // reads them: no whitespace, infinity, NaN or hexadecimal float.
+  p = begin;
+  if (p != end && (*p == '-' || *p == '+')) {
+    ++p;
+  }
+  any_digit = false;
+  for (; p != end && *p >= '0' && *p <= '9'; ++p) {
+    any_digit = true;
+  }
+  if (p != end && *p == '.') {
+    for (++p; p != end && *p >= '0' && *p <= '9'; ++p) {
+      any_digit = true;
+    }
+  }
+  if (any_digit && p != end && (*p == 'e' || *p == 'E')) {
+    ++p;
+    if (p != end && (*p == '-' || *p == '+')) {
+      ++p;
+    }
+    const char *digits = p;
+    for (; p != end && *p >= '0' && *p <= '9'; ++p) {
+    }
+    any_digit = p != digits;
+  }
+  if (!any_digit || p != end) {
+    return false;
+  }
+  std::string text(begin, end);
+  float f = std::strtof(text.c_str(), nullptr);
+  if (!std::isfinite(f)) {
+    return false;
+  }
+  *value = f;
+  return true;
+}
+
+namespace {
+
+// The tables of the slicing-by-8 CRC32C: table[k][b] is the CRC of byte b
+// followed by k zero bytes.
+struct Crc32cTables {
+  uint32_t table[8][256];
+
+  Crc32cTables() {
+    // The reversed Castagnoli polynomial.
+    const uint32_t poly = 0x82F63B78;
+    for (uint32_t b = 0; b < 256; ++b) {
+      uint32_t crc = b;
+      for (int32_t k = 0; k < 8; ++k) {
+        crc = (crc >> 1) ^ (crc & 1 ? poly : 0);
+      }
+      table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; ++b) {
+      for (int32_t k = 1; k < 8; ++k) {
+        uint32_t prev = table[k - 1][b];
+        table[k][b] = (prev >> 8) ^ table[0][prev & 0xFF];
+      }
+    }
+  }
+};
+
+} // namespace
+
+uint32_t Crc32c(const char *data, size_t size, uint32_t crc /*=0*/) {
+  const auto *p = reinterpret_cast<const uint8_t *>(data);
+  crc = ~crc;
+#if defined(__SSE4_2__)
+  uint64_t crc64 = crc;
+  for (; size >= 8; size -= 8, p += 8) {
+    uint64_t word;
+    std::memcpy(&word, p, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = static_cast<uint32_t>(crc64);
+  for (; size > 0; --size, ++p) {
+    crc = _mm_crc32_u8(crc, *p);
+  }
+#else
+  static const Crc32cTables tables;
+  const auto &t = tables.table;
+  for (; size >= 8; size -= 8, p += 8) {
+    // The bytes are combined in little endian order.
+    uint32_t lo = (p[0] | p[1] << 8 | p[2] << 16 |
+                   static_cast<uint32_t>(p[3]) << 24) ^
+                  crc;
+    crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^
+          t[4][lo >> 24] ^ t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+  }
+  for (; size > 0; --size, ++p) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xFF];
+  }
+#endif
+  return ~crc;
+}
+
+MappedFile::MappedFile(const std::string &path, bool sequential /*=false*/) {
+#if !defined(_WIN32)
+  int fd = open(path.c_str(), O_RDONLY);
+  CPY_ASSERT(fd != -1, "Failed to open " << path);
+  struct stat st;
+  CPY_ASSERT(fstat(fd, &st) == 0, "Failed to stat " << path);
+  size_ = st.st_size;
+  // Empty files can not be mapped, and neither can pipes and other files of
+  // unknown size, which are read instead.
+  if (size_ > 0 && S_ISREG(st.st_mode)) {
+    void *addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr != MAP_FAILED) {
+      if (sequential) {
+        madvise(addr, size_, MADV_SEQUENTIAL);
+      }
+      data_ = static_cast<const char *>(addr);
+      mapped_ = true;
+    }
+  }
+  close(fd);
+  if (mapped_) {
+    return;
+  }
+#endif
+  std::ifstream is(path, std::ios::binary);
+  CPY_ASSERT(is.good(), "Failed to open " << path);
+  buffer_.assign(std::istreambuf_iterator<char>(is),
+                 std::istreambuf_iterator<char>());
+  data_ = buffer_.data();
+  size_ = buffer_.size();
+}
+
+MappedFile::MappedFile(std::istream &is) {
+  buffer_.assign(std::istreambuf_iterator<char>(is),
+                 std::istreambuf_iterator<char>());
+  data_ = buffer_.data();
+  size_ = buffer_.size();
+}
+
+MappedFile::~MappedFile() {
+#if !defined(_WIN32)
+  if (mapped_) {
+    munmap(const_cast<char *>(data_), size_);
+  }
+#endif
 }
 
 } // namespace cppinyin
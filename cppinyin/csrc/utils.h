@@ -20,7 +20,13 @@ namespace cppinyin {
     }                                                                          \
   } while (0)
 
+// The magic of the binary models of format v1: the scores, the readings and
+// the double array units, written one after the other.
 constexpr auto HEADER = "__kcppinyinw__";
+// The magic of the binary models of format v2, made of aligned and checksummed
+// sections that can be used in place from a memory mapped file, see
+// PinyinEncoder::Save. It is as long as HEADER.
+constexpr auto HEADER_V2 = "__kcppinyin2__";
 
 size_t ReadUint32(std::istream &ifile, uint32_t *data);
 
@@ -36,10 +42,153 @@ size_t WriteString(std::ofstream &ofile, const std::string &data);
 
 size_t ReadHeader(std::istream &ifile, std::string *data);
 
-size_t WriteHeader(std::ofstream &ofile);
+size_t WriteHeader(std::ofstream &ofile, const char *header = HEADER);
 
 std::string RemoveNumberTone(const std::string &s);
 
+// The whitespace characters of the "C" locale, which separate words in the
+// encoder input.
+inline bool IsSpace(char c) {
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Returns the number of bytes of the UTF-8 character at the start of the
+// `size` > 0 bytes at `str`: the length given by its lead byte if that many
+// bytes are left and all but the first are continuation bytes, 1 otherwise.
+// A stray continuation byte, an invalid lead byte or a lead byte missing
+// some of its continuation bytes is thus a single byte character, so that
+// malformed input still advances and the characters after it are kept whole.
+inline size_t Utf8CharLen(const char *str, size_t size) {
+  uint8_t c = static_cast<uint8_t>(str[0]);
+  size_t len = 1;
+  if (c < 0x80) {
+    return 1;
+  } else if ((c & 0xE0) == 0xC0) {
+    len = 2;
+  } else if ((c & 0xF0) == 0xE0) {
+    len = 3;
+  } else if ((c & 0xF8) == 0xF0) {
+    len = 4;
+  }
+  if (len > size) {
+    return 1;
+  }
+  for (size_t j = 1; j < len; ++j) {
+    if ((static_cast<uint8_t>(str[j]) & 0xC0) != 0x80) {
+      return 1;
+    }
+  }
+  return len;
+}
+
+// Returns the code point of the unit of `size` > 0 bytes at `str`, a unit
+// of SplitUtf8 or of PinyinEncoder::SplitWord, or -1 if it is not exactly
+// one well formed UTF-8 character: a truncated, overlong or invalid sequence,
+// a surrogate, or a run of ASCII bytes.
+inline int32_t DecodeUtf8(const char *str, size_t size) {
+  const uint8_t *s = reinterpret_cast<const uint8_t *>(str);
+  auto continuation = [s](size_t j) { return (s[j] & 0xC0) == 0x80; };
+  int32_t c = 0;
+  switch (size) {
+  case 1:
+    return s[0] < 0x80 ? s[0] : -1;
+  case 2:
+    if ((s[0] & 0xE0) != 0xC0 || !continuation(1)) {
+      return -1;
+    }
+    c = (s[0] & 0x1F) << 6 | (s[1] & 0x3F);
+    return c >= 0x80 ? c : -1;
+  case 3:
+    if ((s[0] & 0xF0) != 0xE0 || !continuation(1) || !continuation(2)) {
+      return -1;
+    }
+    c = (s[0] & 0x0F) << 12 | (s[1] & 0x3F) << 6 | (s[2] & 0x3F);
+    return c >= 0x800 && (c < 0xD800 || c >= 0xE000) ? c : -1;
+  case 4:
+    if ((s[0] & 0xF8) != 0xF0 || !continuation(1) || !continuation(2) ||
+        !continuation(3)) {
+      return -1;
+    }
+    c = (s[0] & 0x07) << 18 | (s[1] & 0x3F) << 12 | (s[2] & 0x3F) << 6 |
+        (s[3] & 0x3F);
+    return c >= 0x10000 && c <= 0x10FFFF ? c : -1;
+  default:
+    return -1;
+  }
+}
+
+// Splits `str` (of `size` bytes) into UTF-8 characters. On return,
+// (*offsets)[i] is the byte offset of the i-th character and the last element
+// is `size`, so there are offsets->size() - 1 characters. If `codepoints` is
+// not nullptr, (*codepoints)[i] is the DecodeUtf8 of the i-th character.
+void SplitUtf8(const char *str, size_t size, std::vector<int32_t> *offsets,
+               std::vector<int32_t> *codepoints = nullptr);
+
+// Returns the length of the longest prefix of the `size` bytes at `str` made
+// of ASCII bytes only. The bytes are checked 32 or 16 at a time with AVX2 or
+// SSE2 when the compiler targets them, 8 at a time otherwise.
+size_t AsciiPrefixLength(const char *str, size_t size);
+
+// Parses the whole of [begin, end) as a finite decimal float and returns
+// whether it is one, like `std::istream >> float` in the "C" locale but
+// without copying the text or allocating. Numbers of at most 7 significant
+// digits and a small exponent, e.g. the scores of a dictionary, are parsed
+// exactly by the fast path, the others by std::strtof.
+bool ParseFloat(const char *begin, const char *end, float *value);
+
+// Extends `crc`, the CRC32C (Castagnoli) of some data, with the `size` bytes
+// at `data`. Crc32c(data, size) is the checksum of the bytes alone. Uses the
+// SSE4.2 crc32 instruction when the compiler targets it.
+uint32_t Crc32c(const char *data, size_t size, uint32_t crc = 0);
+
+// A read only view of `size` elements at `data`, which may be owned by a
+// vector or lie in a memory mapped file.
+template <typename T> class ArrayView {
+public:
+  ArrayView() = default;
+  ArrayView(const T *data, size_t size) : data_(data), size_(size) {}
+  explicit ArrayView(const std::vector<T> &v)
+      : data_(v.data()), size_(v.size()) {}
+
+  const T &operator[](size_t i) const { return data_[i]; }
+  const T *data() const { return data_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const T *begin() const { return data_; }
+  const T *end() const { return data_ + size_; }
+
+private:
+  const T *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// A read only view of a whole file. The file is memory mapped where mmap is
+// available and read into memory otherwise. Aborts if the file can not be
+// opened.
+class MappedFile {
+public:
+  // `sequential` hints the kernel that the file is read once from start to
+  // end, so it reads ahead and drops the pages already read.
+  explicit MappedFile(const std::string &path, bool sequential = false);
+
+  // Reads the rest of `is` into memory, for data given as a stream.
+  explicit MappedFile(std::istream &is);
+  ~MappedFile();
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *Data() const { return data_; }
+  size_t Size() const { return size_; }
+
+private:
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+  bool mapped_ = false;
+  // The content when the file is not mapped.
+  std::string buffer_;
+};
+
 } // namespace cppinyin
 
 #endif // CPPINYIN_CSRC_UTILS_H_
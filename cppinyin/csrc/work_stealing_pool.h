@@ -0,0 +1,409 @@
+/**
+ * Copyright      2024    Wei Kang (wkang@pku.edu.cn)
+ *
+ * See LICENSE for clarification regarding multiple authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CPPINYIN_CSRC_WORK_STEALING_POOL_H_
+#define CPPINYIN_CSRC_WORK_STEALING_POOL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "cppinyin/csrc/threadpool.h"
+
+namespace cppinyin {
+
+// The deque of Chase and Lev, in the C11 formulation of "Correct and
+// Efficient Work-Stealing for Weak Memory Models" (Le et al., 2013). Only the
+// owner calls Push and Pop, on the bottom end, any thread may call Steal, on
+// the top end. None of them takes a lock.
+template <typename T> class WorkStealingDeque {
+public:
+  explicit WorkStealingDeque(int64_t capacity = 256)
+      : array_(new Array(capacity)) {}
+
+  ~WorkStealingDeque() { delete array_.load(std::memory_order_relaxed); }
+
+  WorkStealingDeque(const WorkStealingDeque &) = delete;
+  WorkStealingDeque &operator=(const WorkStealingDeque &) = delete;
+
+  void Push(T *item) {
+    int64_t b = bottom_.load(std::memory_order_relaxed);
+    int64_t t = top_.load(std::memory_order_acquire);
+    Array *a = array_.load(std::memory_order_relaxed);
+    if (b - t > a->capacity - 1) {
+      a = Grow(a, t, b);
+    }
+    a->Put(b, item);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(b + 1, std::memory_order_relaxed);
+  }
+
+  // Returns nullptr if the deque is empty.
+  T *Pop() {
+    int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+    Array *a = array_.load(std::memory_order_relaxed);
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top_.load(std::memory_order_relaxed);
+    if (t > b) {
+      bottom_.store(b + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    T *item = a->Get(b);
+    if (t == b) {
+      // The last item, race the thieves for it.
+      if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                        std::memory_order_relaxed)) {
+        item = nullptr;
+      }
+      bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+    return item;
+  }
+
+  // Returns nullptr if the deque is empty or another thread won the race for
+  // its top item.
+  T *Steal() {
+    int64_t t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom_.load(std::memory_order_acquire);
+    if (t >= b) {
+      return nullptr;
+    }
+    Array *a = array_.load(std::memory_order_acquire);
+    T *item = a->Get(t);
+    if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+      return nullptr;
+    }
+    return item;
+  }
+
+  bool Empty() const {
+    int64_t b = bottom_.load(std::memory_order_relaxed);
+    int64_t t = top_.load(std::memory_order_relaxed);
+    return t >= b;
+  }
+
+private:
+  struct Array {
+    explicit Array(int64_t capacity)
+        : capacity(capacity), mask(capacity - 1),
+          items(new std::atomic<T *>[capacity]) {}
+
+    T *Get(int64_t i) const {
+      return items[i & mask].load(std::memory_order_relaxed);
+    }
+
+    void Put(int64_t i, T *item) {
+      items[i & mask].store(item, std::memory_order_relaxed);
+    }
+
+    const int64_t capacity;
+    const int64_t mask;
+    std::unique_ptr<std::atomic<T *>[]> items;
+  };
+
+  // Thieves may still read the old array, it is kept until the deque is
+  // destroyed.
+  Array *Grow(Array *a, int64_t t, int64_t b) {
+    Array *bigger = new Array(a->capacity * 2);
+    for (int64_t i = t; i != b; ++i) {
+      bigger->Put(i, a->Get(i));
+    }
+    retired_.emplace_back(a);
+    array_.store(bigger, std::memory_order_release);
+    return bigger;
+  }
+
+  std::atomic<int64_t> top_{0};
+  std::atomic<int64_t> bottom_{0};
+  std::atomic<Array *> array_;
+  std::vector<std::unique_ptr<Array>> retired_;
+};
+
+// A thread pool with the interface of ThreadPool, where each worker owns a
+// WorkStealingDeque instead of all the workers sharing one locked queue.
+// Tasks enqueued by a worker go to its own deque. Tasks enqueued by other
+// threads are dealt round robin into small per worker inboxes, which their
+// owner moves into its deque. An idle worker steals from the other deques
+// and inboxes, spins for a while and only then parks on a condition
+// variable.
+class WorkStealingThreadPool {
+public:
+  explicit WorkStealingThreadPool(size_t threads);
+  ~WorkStealingThreadPool();
+
+  template <class F, class... Args>
+  auto enqueue(F &&f, Args &&...args)
+      -> std::future<typename std::result_of<F(Args...)>::type>;
+
+  // See ThreadPool::parallel_for.
+  template <class F>
+  void parallel_for(size_t begin, size_t end, size_t grain, F &&f);
+
+  // The number of worker threads.
+  size_t size() const { return workers_.size(); }
+
+private:
+  using Task = std::function<void()>;
+
+  // The number of times an idle worker looks for a task before parking.
+  static constexpr int32_t kSpinRounds = 64;
+
+  struct Queue {
+    WorkStealingDeque<Task> deque;
+    std::mutex inbox_mutex;
+    std::deque<Task *> inbox;
+    // The size of inbox, read without the lock to skip empty inboxes.
+    std::atomic<size_t> inbox_size{0};
+  };
+
+  struct WorkerSlot {
+    const WorkStealingThreadPool *pool;
+    size_t index;
+  };
+
+  // The pool and the index of the worker running on this thread, if any.
+  static WorkerSlot &CurrentWorker() {
+    static thread_local WorkerSlot slot{nullptr, 0};
+    return slot;
+  }
+
+  void Submit(Task *task);
+
+  // Takes a task from the own deque, the own inbox, then from the other
+  // workers. Returns nullptr if there is none.
+  Task *FindTask(size_t index);
+
+  Task *TakeFromInbox(size_t index, bool drain);
+
+  // Blocks until there is a task or the pool stops, returns nullptr in the
+  // latter case.
+  Task *Park(size_t index);
+
+  void WorkerLoop(size_t index);
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+  // Where the next task enqueued from outside the pool goes.
+  std::atomic<size_t> next_inbox_{0};
+
+  std::mutex sleep_mutex_;
+  std::condition_variable sleep_condition_;
+  std::atomic<size_t> num_sleepers_{0};
+  // Bumped by Submit when workers are parked, under sleep_mutex_.
+  std::atomic<uint64_t> wake_epoch_{0};
+  std::atomic<bool> stop_{false};
+};
+
+inline WorkStealingThreadPool::WorkStealingThreadPool(size_t threads) {
+  for (size_t i = 0; i < threads; ++i) {
+    queues_.emplace_back(new Queue());
+  }
+  for (size_t i = 0; i < threads; ++i) {
+    workers_.emplace_back([this, i] { WorkerLoop(i); });
+  }
+}
+
+inline WorkStealingThreadPool::~WorkStealingThreadPool() {
+  {
+    std::unique_lock<std::mutex> lock(sleep_mutex_);
+    stop_.store(true);
+  }
+  sleep_condition_.notify_all();
+  for (auto &worker : workers_) {
+    worker.join();
+  }
+}
+
+template <class F, class... Args>
+auto WorkStealingThreadPool::enqueue(F &&f, Args &&...args)
+    -> std::future<typename std::result_of<F(Args...)>::type> {
+  using return_type = typename std::result_of<F(Args...)>::type;
+
+  auto task = std::make_shared<std::packaged_task<return_type()>>(
+      std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+  std::future<return_type> res = task->get_future();
+  Submit(new Task([task]() { (*task)(); }));
+  return res;
+}
+
+template <class F>
+void WorkStealingThreadPool::parallel_for(size_t begin, size_t end,
+                                          size_t grain, F &&f) {
+  if (begin >= end) {
+    return;
+  }
+  if (grain == 0) {
+    grain = 1;
+  }
+  using State = ParallelForState<typename std::remove_reference<F>::type>;
+  auto state = std::make_shared<State>(begin, end, grain, &f);
+
+  size_t num_helpers =
+      std::min(workers_.size(), (end - begin + grain - 1) / grain - 1);
+  for (size_t i = 0; i < num_helpers; ++i) {
+    Submit(new Task([state]() { state->run(); }));
+  }
+
+  state->run();
+  state->wait();
+  if (state->error) {
+    std::rethrow_exception(state->error);
+  }
+}
+
+inline void WorkStealingThreadPool::Submit(Task *task) {
+  std::unique_ptr<Task> owned(task);
+  if (stop_.load()) {
+    throw std::runtime_error("enqueue on stopped WorkStealingThreadPool");
+  }
+  if (workers_.empty()) {
+    throw std::runtime_error("enqueue on WorkStealingThreadPool of 0 threads");
+  }
+  WorkerSlot &slot = CurrentWorker();
+  if (slot.pool == this) {
+    queues_[slot.index]->deque.Push(owned.release());
+  } else {
+    size_t index =
+        next_inbox_.fetch_add(1, std::memory_order_relaxed) % queues_.size();
+    Queue &queue = *queues_[index];
+    std::unique_lock<std::mutex> lock(queue.inbox_mutex);
+    queue.inbox.push_back(owned.release());
+    queue.inbox_size.store(queue.inbox.size(), std::memory_order_relaxed);
+  }
+  // Pairs with the fence in Park: either the parking worker sees the task or
+  // this thread sees the worker parking.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (num_sleepers_.load(std::memory_order_relaxed) > 0) {
+    {
+      std::unique_lock<std::mutex> lock(sleep_mutex_);
+      wake_epoch_.fetch_add(1, std::memory_order_release);
+    }
+    sleep_condition_.notify_one();
+  }
+}
+
+inline WorkStealingThreadPool::Task *
+WorkStealingThreadPool::TakeFromInbox(size_t index, bool drain) {
+  Queue &queue = *queues_[index];
+  if (queue.inbox_size.load(std::memory_order_relaxed) == 0) {
+    return nullptr;
+  }
+  std::unique_lock<std::mutex> lock(queue.inbox_mutex);
+  if (queue.inbox.empty()) {
+    return nullptr;
+  }
+  Task *task = queue.inbox.front();
+  queue.inbox.pop_front();
+  if (drain) {
+    // The owner moves the rest into its deque, where thieves take them
+    // without locking.
+    for (auto *t : queue.inbox) {
+      queue.deque.Push(t);
+    }
+    queue.inbox.clear();
+  }
+  queue.inbox_size.store(queue.inbox.size(), std::memory_order_relaxed);
+  return task;
+}
+
+inline WorkStealingThreadPool::Task *
+WorkStealingThreadPool::FindTask(size_t index) {
+  Task *task = queues_[index]->deque.Pop();
+  if (task != nullptr) {
+    return task;
+  }
+  task = TakeFromInbox(index, true);
+  if (task != nullptr) {
+    return task;
+  }
+  size_t n = queues_.size();
+  for (size_t k = 1; k < n; ++k) {
+    task = queues_[(index + k) % n]->deque.Steal();
+    if (task != nullptr) {
+      return task;
+    }
+  }
+  for (size_t k = 1; k < n; ++k) {
+    task = TakeFromInbox((index + k) % n, false);
+    if (task != nullptr) {
+      return task;
+    }
+  }
+  return nullptr;
+}
+
+inline WorkStealingThreadPool::Task *
+WorkStealingThreadPool::Park(size_t index) {
+  num_sleepers_.fetch_add(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  Task *task = nullptr;
+  for (;;) {
+    // The queues are searched without the lock. A task submitted after the
+    // search bumps the epoch read before it, so the wait returns at once.
+    uint64_t epoch = wake_epoch_.load(std::memory_order_acquire);
+    task = FindTask(index);
+    if (task != nullptr || stop_.load()) {
+      break;
+    }
+    std::unique_lock<std::mutex> lock(sleep_mutex_);
+    sleep_condition_.wait(lock, [this, epoch] {
+      return wake_epoch_.load(std::memory_order_relaxed) != epoch ||
+             stop_.load();
+    });
+  }
+  num_sleepers_.fetch_sub(1, std::memory_order_relaxed);
+  return task;
+}
+
+inline void WorkStealingThreadPool::WorkerLoop(size_t index) {
+  CurrentWorker() = {this, index};
+  for (;;) {
+    Task *task = FindTask(index);
+    for (int32_t i = 0; task == nullptr && i < kSpinRounds; ++i) {
+      std::this_thread::yield();
+      task = FindTask(index);
+    }
+    if (task == nullptr) {
+      // The remaining tasks are run before the pool stops.
+      task = Park(index);
+      if (task == nullptr) {
+        return;
+      }
+    }
+    std::unique_ptr<Task> owned(task);
+    (*owned)();
+  }
+}
+
+} // namespace cppinyin
+
+#endif // CPPINYIN_CSRC_WORK_STEALING_POOL_H_
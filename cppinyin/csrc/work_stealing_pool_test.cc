@@ -0,0 +1,156 @@
+/**
+ * Copyright      2024  Wei Kang (wkang@pku.edu.cn)
+ *
+ * See LICENSE for clarification regarding multiple authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "gtest/gtest.h"
+
+#include <atomic>
+#include <future>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "cppinyin/csrc/work_stealing_pool.h"
+
+namespace cppinyin {
+
+TEST(WorkStealingDeque, TestPushPopSteal) {
+  WorkStealingDeque<int32_t> deque(2);
+  std::vector<int32_t> items(10);
+  for (size_t i = 0; i < items.size(); ++i) {
+    items[i] = i;
+    // Grows past the initial capacity.
+    deque.Push(&items[i]);
+  }
+  EXPECT_EQ(*deque.Steal(), 0);
+  EXPECT_EQ(*deque.Pop(), 9);
+  EXPECT_EQ(*deque.Steal(), 1);
+  for (int32_t i = 8; i >= 2; --i) {
+    EXPECT_EQ(*deque.Pop(), i);
+  }
+  EXPECT_EQ(deque.Pop(), nullptr);
+  EXPECT_EQ(deque.Steal(), nullptr);
+  EXPECT_TRUE(deque.Empty());
+}
+
+TEST(WorkStealingDeque, TestConcurrentSteal) {
+  const int32_t num_items = 100000;
+  WorkStealingDeque<int32_t> deque;
+  std::vector<int32_t> items(num_items, 0);
+  std::vector<std::atomic<int32_t>> taken(num_items);
+  for (auto &t : taken) {
+    t.store(0);
+  }
+  std::atomic<bool> done(false);
+  std::vector<std::thread> thieves;
+  for (int32_t i = 0; i < 3; ++i) {
+    thieves.emplace_back([&] {
+      while (!done.load() || !deque.Empty()) {
+        int32_t *item = deque.Steal();
+        if (item != nullptr) {
+          taken[item - items.data()].fetch_add(1);
+        }
+      }
+    });
+  }
+  for (int32_t i = 0; i < num_items; ++i) {
+    deque.Push(&items[i]);
+    if (i % 3 == 0) {
+      int32_t *item = deque.Pop();
+      if (item != nullptr) {
+        taken[item - items.data()].fetch_add(1);
+      }
+    }
+  }
+  done.store(true);
+  for (auto &thief : thieves) {
+    thief.join();
+  }
+  // Each item is taken exactly once.
+  for (int32_t i = 0; i < num_items; ++i) {
+    EXPECT_EQ(taken[i].load(), 1) << i;
+  }
+}
+
+TEST(WorkStealingThreadPool, TestEnqueue) {
+  WorkStealingThreadPool pool(4);
+  std::vector<std::future<int32_t>> results;
+  for (int32_t i = 0; i < 1000; ++i) {
+    results.emplace_back(pool.enqueue([](int32_t x) { return x * x; }, i));
+  }
+  for (int32_t i = 0; i < 1000; ++i) {
+    EXPECT_EQ(results[i].get(), i * i);
+  }
+}
+
+TEST(WorkStealingThreadPool, TestEnqueueFromTask) {
+  WorkStealingThreadPool pool(4);
+  std::atomic<int32_t> count(0);
+  auto outer = pool.enqueue([&] {
+    // Tasks enqueued by a worker go to its own deque and are stolen by the
+    // others.
+    std::vector<std::future<void>> inner;
+    for (int32_t i = 0; i < 100; ++i) {
+      inner.emplace_back(pool.enqueue([&] { count.fetch_add(1); }));
+    }
+    return inner;
+  });
+  for (auto &f : outer.get()) {
+    f.get();
+  }
+  EXPECT_EQ(count.load(), 100);
+}
+
+TEST(WorkStealingThreadPool, TestParallelFor) {
+  WorkStealingThreadPool pool(3);
+  for (size_t grain : {0, 1, 7, 1000}) {
+    std::vector<int32_t> visits(1000, 0);
+    pool.parallel_for(0, visits.size(), grain,
+                      [&](size_t i) { visits[i] += 1; });
+    for (auto v : visits) {
+      EXPECT_EQ(v, 1);
+    }
+  }
+  // Nested calls do not deadlock, the calling worker does the work if no one
+  // else is free.
+  std::atomic<int32_t> count(0);
+  pool.parallel_for(0, 8, 1, [&](size_t) {
+    pool.parallel_for(0, 100, 10, [&](size_t) { count.fetch_add(1); });
+  });
+  EXPECT_EQ(count.load(), 800);
+
+  EXPECT_THROW(pool.parallel_for(0, 100, 1,
+                                 [](size_t i) {
+                                   if (i == 50) {
+                                     throw std::runtime_error("error");
+                                   }
+                                 }),
+               std::runtime_error);
+}
+
+TEST(WorkStealingThreadPool, TestDestructorRunsPendingTasks) {
+  std::atomic<int32_t> count(0);
+  {
+    WorkStealingThreadPool pool(2);
+    for (int32_t i = 0; i < 1000; ++i) {
+      pool.enqueue([&] { count.fetch_add(1); });
+    }
+  }
+  EXPECT_EQ(count.load(), 1000);
+}
+
+} // namespace cppinyin
@@ -1 +1 @@
-from .cppinyin import Encoder
+from .cppinyin import Encoder, StreamingEncoder
@@ -11,6 +11,7 @@ except ImportError:
 
 import importlib_resources
 from pathlib import Path
+from typing import Tuple
 from cppinyin import Encoder
 
 
@@ -126,6 +127,13 @@ def build(output: Path, dict_path: Path, user_dict_path: Path):
 @click.option(
     "--user-dict-path", type=Path, help="The path to user customized dict."
 )
+@click.option(
+    "--layer-dict-path",
+    type=Path,
+    multiple=True,
+    help="The path to a dictionary (text or built) looked up on top of the "
+    "dictionary, may be repeated, the later ones having higher priorities.",
+)
 @click.option(
     "--no-tone",
     is_flag=True,
@@ -144,6 +152,7 @@ def encode(
     input: str,
     dict_path: Path,
     user_dict_path: Path,
+    layer_dict_path: Tuple[Path, ...],
     no_tone: bool,
     partial: bool,
 ):
@@ -154,21 +163,31 @@ def encode(
     The input could be a string or a file path.
 
     Note:
-      The user_dict has a higher priority than dict (also default dict).
+      The user_dict has a higher priority than the layer dicts, which have
+      higher priorities than dict (also default dict).
     """
-    encoder = Encoder(get_dict_path(dict_path, user_dict_path))
+    encoder = Encoder(None if dict_path is None else str(dict_path))
+    for i, path in enumerate(layer_dict_path):
+        assert path.is_file(), f"File not exists, filename : {path}"
+        encoder.add_layer(str(path), str(path), priority=i + 1)
+    if user_dict_path is not None:
+        # User words replace the dictionary entries of the same keys, without
+        # building a merged dictionary.
+        assert (
+            user_dict_path.is_file()
+        ), f"File not exists, filename : {user_dict_path}"
+        encoder.load_user_words(str(user_dict_path))
+    tone = "none" if no_tone else "number"
     if Path(input).is_file():
         with open(input, "r") as fi:
             for line in fi:
                 pinyin = " ".join(
-                    encoder.encode(
-                        line.strip(), tone=not no_tone, partial=partial
-                    )
+                    encoder.encode(line.strip(), tone=tone, partial=partial)
                 )
                 click.echo(f"{line.strip()}\t{pinyin}")
     else:
         click.echo(
             " ".join(
-                encoder.encode(input.strip(), tone=not no_tone, partial=partial)
+                encoder.encode(input.strip(), tone=tone, partial=partial)
             )
         )
@@ -22,9 +22,19 @@ import importlib_resources
 
 
 class Encoder:
-    def __init__(self, vocab: str = None, num_threads: int = os.cpu_count()):
+    def __init__(
+        self,
+        vocab: str = None,
+        num_threads: int = os.cpu_count(),
+        shared_pool: bool = False,
+    ):
         """
         Construct a cppinyin Encoder object.
+
+        The batch calls run on a private pool of num_threads threads, started
+        by the first of them. If shared_pool is True, they run on a pool
+        shared by all the encoders of the process instead, and num_threads is
+        ignored.
         """
         if vocab is None:
             ref = (
@@ -33,7 +43,7 @@ class Encoder:
             with importlib_resources.as_file(ref) as path:
                 vocab = str(path)
 
-        self.encoder = _cppinyin.Encoder(vocab, num_threads)
+        self.encoder = _cppinyin.Encoder(vocab, num_threads, shared_pool)
 
     def encode(
         self,
@@ -44,6 +54,44 @@ class Encoder:
     ):
         return self.encoder.encode(data, tone, partial, return_seg)
 
+    def encode_offsets(
+        self,
+        data: str,
+        tone: str = "number",
+        partial: bool = False,
+        char_offset: bool = True,
+    ):
+        """
+        Like encode, but also return the segments as (begin, end, token)
+        tuples, where [begin, end) is the segment in data (in characters if
+        char_offset is True, otherwise in UTF-8 bytes) and token is the index
+        of its first pinyin.
+        """
+        return self.encoder.encode_offsets(data, tone, partial, char_offset)
+
+    def encode_ids(
+        self,
+        data: Union[str, List[str]],
+        tone: str = "number",
+        partial: bool = False,
+    ):
+        """
+        Like encode, but return the ids of the pinyins in
+        syllable_inventory(tone, partial), -1 for the tokens not in it.
+        """
+        return self.encoder.encode_ids(data, tone, partial)
+
+    def syllable_inventory(self, tone: str = "number", partial: bool = False):
+        """
+        The id to pinyin table used by encode_ids.
+        """
+        return self.encoder.syllable_inventory(tone, partial)
+
+    def pinyin_to_id(
+        self, pinyin: str, tone: str = "number", partial: bool = False
+    ):
+        return self.encoder.pinyin_to_id(pinyin, tone, partial)
+
     def to_initials(self, data: Union[str, List[str]]):
         """
         Convert Chinese characters to their initials.
@@ -68,8 +116,134 @@ class Encoder:
     def valid_pinyin(self, pinyin: str, tone: str = ""):
         return self.encoder.valid_pinyin(pinyin, tone)
 
-    def load(self, path: str):
-        self.encoder.load(path)
+    def load(self, path: str, verify_checksums: bool = True):
+        self.encoder.load(path, verify_checksums)
+
+    def reload(self, path: str, verify_checksums: bool = True):
+        """
+        Replace the model with the one at `path` while other threads keep
+        encoding, each call sees either the old model or the new one.
+        """
+        self.encoder.reload(path, verify_checksums)
 
     def save(self, path: str):
         self.encoder.save(path)
+
+    def enable_cache(self, capacity: int, num_shards: int = 16):
+        self.encoder.enable_cache(capacity, num_shards)
+
+    def enable_route_cache(self, capacity: int, num_shards: int = 16):
+        self.encoder.enable_route_cache(capacity, num_shards)
+
+    def clear_cache(self):
+        self.encoder.clear_cache()
+
+    def cache_stats(self) -> dict:
+        return self.encoder.cache_stats()
+
+    def route_cache_stats(self) -> dict:
+        return self.encoder.route_cache_stats()
+
+    def add_user_word(
+        self, word: str, score: float, pinyins: List[str]
+    ) -> bool:
+        """
+        Add a user word, or replace the user word of the same key. User words
+        take priority over the dictionary: a user word replaces the dictionary
+        entry of the same key. They may be changed while other threads
+        encode, and are seen by the encode calls starting after the change.
+
+        Return False, adding nothing, if the word is empty or contains
+        whitespace, or if a pinyin is not a syllable.
+        """
+        return self.encoder.add_user_word(word, score, pinyins)
+
+    def load_user_words(self, path: str):
+        """
+        Add the entries of a text dictionary as user words, in one change.
+        """
+        self.encoder.load_user_words(path)
+
+    def remove_user_word(self, word: str) -> bool:
+        return self.encoder.remove_user_word(word)
+
+    def clear_user_words(self):
+        self.encoder.clear_user_words()
+
+    def num_user_words(self) -> int:
+        return self.encoder.num_user_words()
+
+    def add_layer(
+        self,
+        name: str,
+        path: str,
+        priority: int,
+        score_offset: float = 0.0,
+        verify_checksums: bool = True,
+    ) -> bool:
+        """
+        Look up the dictionary or model at `path` too, as the layer `name`.
+        Where several layers have the same word, the layer of the highest
+        priority wins, its scores shifted by `score_offset`. The dictionary
+        of the encoder is the layer of priority 0.
+        """
+        return self.encoder.add_layer(
+            name, path, priority, score_offset, verify_checksums
+        )
+
+    def remove_layer(self, name: str) -> bool:
+        return self.encoder.remove_layer(name)
+
+    def clear_layers(self):
+        self.encoder.clear_layers()
+
+    def num_layers(self) -> int:
+        return self.encoder.num_layers()
+
+    def set_phrase_index(self, name: str) -> bool:
+        """
+        Index the text dictionaries loaded from now on (by reload and
+        add_layer) with the phrase index `name`: "darts", "sorted", "hash"
+        or "codepoint". Binary models keep the index they were saved with.
+
+        Return False, changing nothing, if name is not a known index.
+        """
+        return self.encoder.set_phrase_index(name)
+
+
+class StreamingEncoder:
+    def __init__(
+        self, encoder: Encoder, tone: str = "number", partial: bool = False
+    ):
+        """
+        Encode a text given chunk by chunk, e.g. the partial transcript of a
+        streaming ASR, without encoding it again from the start every time.
+        """
+        self.stream = _cppinyin.StreamingEncoder(encoder.encoder, tone, partial)
+
+    def append(self, chunk: str) -> List[str]:
+        """
+        Append a chunk of text and return the tokens which became stable, i.e.
+        which no text appended later can change.
+        """
+        return self.stream.append(chunk)
+
+    def tentative(self) -> List[str]:
+        """
+        Return the tokens of the text not output yet, as they would be if the
+        text ended here.
+        """
+        return self.stream.tentative()
+
+    def finish(self) -> List[str]:
+        """
+        End the text, return the remaining tokens and start a new text.
+        """
+        return self.stream.finish()
+
+    def reset(self):
+        self.stream.reset()
+
+    @property
+    def pending(self) -> str:
+        return self.stream.pending
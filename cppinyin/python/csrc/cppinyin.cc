@@ -18,12 +18,24 @@
 
 #include "cppinyin/python/csrc/cppinyin.h"
 #include "cppinyin/csrc/cppinyin.h"
+#include "cppinyin/csrc/streaming_encoder.h"
 #include <memory>
 #include <string>
 #include <vector>
 
 namespace cppinyin {
 
+static py::dict CacheStatsToDict(const CacheStats &stats) {
+  py::dict d;
+  d["hits"] = stats.hits;
+  d["misses"] = stats.misses;
+  d["evictions"] = stats.evictions;
+  d["entries"] = stats.entries;
+  d["bytes"] = stats.bytes;
+  d["hit_ratio"] = stats.HitRatio();
+  return d;
+}
+
 void PybindCppinyin(py::module &m) {
   using PyClass = PinyinEncoder;
   py::class_<PyClass>(m, "Encoder")
@@ -35,26 +47,104 @@ void PybindCppinyin(py::module &m) {
           py::arg("num_threads") = std::thread::hardware_concurrency(),
           py::call_guard<py::gil_scoped_release>())
       .def(
-          py::init([](const std::string &vocab_path,
-                      int32_t num_threads = std::thread::hardware_concurrency())
-                       -> std::unique_ptr<PyClass> {
+          py::init([](const std::string &vocab_path, int32_t num_threads,
+                      bool shared_pool) -> std::unique_ptr<PyClass> {
+            if (shared_pool) {
+              return std::make_unique<PyClass>(vocab_path, DefaultExecutor());
+            }
             return std::make_unique<PyClass>(vocab_path, num_threads);
           }),
           py::arg("vocab_path"),
           py::arg("num_threads") = std::thread::hardware_concurrency(),
+          py::arg("shared_pool") = false,
           py::call_guard<py::gil_scoped_release>())
       .def(
           "load",
-          [](PyClass &self, const std::string &vocab_path) {
-            self.Load(vocab_path);
+          [](PyClass &self, const std::string &vocab_path,
+             bool verify_checksums) {
+            self.Load(vocab_path, verify_checksums);
           },
-          py::arg("vocab_path"), py::call_guard<py::gil_scoped_release>())
+          py::arg("vocab_path"), py::arg("verify_checksums") = true,
+          py::call_guard<py::gil_scoped_release>())
+      .def(
+          "reload",
+          [](PyClass &self, const std::string &vocab_path,
+             bool verify_checksums) {
+            self.Reload(vocab_path, verify_checksums);
+          },
+          py::arg("vocab_path"), py::arg("verify_checksums") = true,
+          py::call_guard<py::gil_scoped_release>())
       .def(
           "save",
           [](PyClass &self, const std::string &vocab_path) {
             self.Save(vocab_path);
           },
           py::arg("vocab_path"), py::call_guard<py::gil_scoped_release>())
+      .def(
+          "enable_cache",
+          [](PyClass &self, size_t capacity, int32_t num_shards) {
+            self.EnableCache(capacity, num_shards);
+          },
+          py::arg("capacity"), py::arg("num_shards") = 16)
+      .def(
+          "enable_route_cache",
+          [](PyClass &self, size_t capacity, int32_t num_shards) {
+            self.EnableRouteCache(capacity, num_shards);
+          },
+          py::arg("capacity"), py::arg("num_shards") = 16)
+      .def("clear_cache", &PyClass::ClearCache)
+      .def("cache_stats",
+           [](const PyClass &self) -> py::dict {
+             return CacheStatsToDict(self.GetCacheStats());
+           })
+      .def("route_cache_stats",
+           [](const PyClass &self) -> py::dict {
+             return CacheStatsToDict(self.GetRouteCacheStats());
+           })
+      .def(
+          "add_user_word",
+          [](PyClass &self, const std::string &word, float score,
+             const std::vector<std::string> &pinyins) -> bool {
+            return self.AddUserWord(word, score, pinyins);
+          },
+          py::arg("word"), py::arg("score"), py::arg("pinyins"),
+          py::call_guard<py::gil_scoped_release>())
+      .def(
+          "load_user_words",
+          [](PyClass &self, const std::string &path) {
+            self.LoadUserWords(path);
+          },
+          py::arg("path"), py::call_guard<py::gil_scoped_release>())
+      .def(
+          "remove_user_word",
+          [](PyClass &self, const std::string &word) -> bool {
+            return self.RemoveUserWord(word);
+          },
+          py::arg("word"), py::call_guard<py::gil_scoped_release>())
+      .def("clear_user_words", &PyClass::ClearUserWords,
+           py::call_guard<py::gil_scoped_release>())
+      .def("num_user_words", &PyClass::NumUserWords)
+      .def(
+          "add_layer",
+          [](PyClass &self, const std::string &name, const std::string &path,
+             int32_t priority, float score_offset,
+             bool verify_checksums) -> bool {
+            return self.AddLayer(name, path, priority, score_offset,
+                                 verify_checksums);
+          },
+          py::arg("name"), py::arg("path"), py::arg("priority"),
+          py::arg("score_offset") = 0, py::arg("verify_checksums") = true,
+          py::call_guard<py::gil_scoped_release>())
+      .def(
+          "remove_layer",
+          [](PyClass &self, const std::string &name) -> bool {
+            return self.RemoveLayer(name);
+          },
+          py::arg("name"), py::call_guard<py::gil_scoped_release>())
+      .def("clear_layers", &PyClass::ClearLayers,
+           py::call_guard<py::gil_scoped_release>())
+      .def("num_layers", &PyClass::NumLayers)
+      .def("set_phrase_index", &PyClass::SetPhraseIndex, py::arg("name"))
       .def(
           "encode",
           [](PyClass &self, const std::string &str, const std::string &tone,
@@ -92,6 +182,62 @@ void PybindCppinyin(py::module &m) {
           },
           py::arg("strs"), py::arg("tone") = "number",
           py::arg("partial") = false, py::arg("return_seg") = false)
+      .def(
+          "encode_offsets",
+          [](PyClass &self, const std::string &str, const std::string &tone,
+             bool partial, bool char_offset) -> py::object {
+            std::vector<std::string> ostrs;
+            std::vector<Segment> segs;
+            {
+              py::gil_scoped_release release;
+              self.Encode(str, &ostrs, &segs, tone, partial, char_offset);
+            }
+            py::list osegs;
+            for (const auto &seg : segs) {
+              osegs.append(py::make_tuple(seg.begin, seg.end, seg.token));
+            }
+            return py::make_tuple(py::cast(ostrs), osegs);
+          },
+          py::arg("str"), py::arg("tone") = "number",
+          py::arg("partial") = false, py::arg("char_offset") = true)
+      .def(
+          "encode_ids",
+          [](PyClass &self, const std::string &str, const std::string &tone,
+             bool partial) -> std::vector<int32_t> {
+            std::vector<int32_t> ids;
+            py::gil_scoped_release release;
+            self.EncodeIds(str, &ids, tone, partial);
+            return ids;
+          },
+          py::arg("str"), py::arg("tone") = "number",
+          py::arg("partial") = false)
+      .def(
+          "encode_ids",
+          [](PyClass &self, const std::vector<std::string> &strs,
+             const std::string &tone,
+             bool partial) -> std::vector<std::vector<int32_t>> {
+            std::vector<std::vector<int32_t>> ids;
+            py::gil_scoped_release release;
+            self.EncodeIds(strs, &ids, tone, partial);
+            return ids;
+          },
+          py::arg("strs"), py::arg("tone") = "number",
+          py::arg("partial") = false)
+      .def(
+          "syllable_inventory",
+          [](PyClass &self, const std::string &tone,
+             bool partial) -> std::vector<std::string> {
+            return self.SyllableInventory(tone, partial);
+          },
+          py::arg("tone") = "number", py::arg("partial") = false)
+      .def(
+          "pinyin_to_id",
+          [](PyClass &self, const std::string &str, const std::string &tone,
+             bool partial) -> int32_t {
+            return self.PinyinToId(str, tone, partial);
+          },
+          py::arg("str"), py::arg("tone") = "number",
+          py::arg("partial") = false)
       .def(
           "to_initials",
           [](PyClass &self, const std::string &str) -> std::string {
@@ -161,6 +307,45 @@ void PybindCppinyin(py::module &m) {
             return ostrs;
           },
           py::arg("tone") = "number");
+
+  py::class_<StreamingEncoder>(m, "StreamingEncoder")
+      .def(py::init([](const PyClass *encoder, const std::string &tone,
+                       bool partial) -> std::unique_ptr<StreamingEncoder> {
+             EncodeOptions options;
+             options.tone = ParseTone(tone);
+             options.partial = partial;
+             return std::make_unique<StreamingEncoder>(encoder, options);
+           }),
+           py::arg("encoder"), py::arg("tone") = "number",
+           py::arg("partial") = false, py::keep_alive<1, 2>())
+      .def(
+          "append",
+          [](StreamingEncoder &self,
+             const std::string &chunk) -> std::vector<std::string> {
+            py::gil_scoped_release release;
+            std::vector<std::string> ostrs;
+            self.Append(chunk, &ostrs);
+            return ostrs;
+          },
+          py::arg("chunk"))
+      .def("tentative",
+           [](StreamingEncoder &self) -> std::vector<std::string> {
+             py::gil_scoped_release release;
+             std::vector<std::string> ostrs;
+             self.Tentative(&ostrs);
+             return ostrs;
+           })
+      .def("finish",
+           [](StreamingEncoder &self) -> std::vector<std::string> {
+             py::gil_scoped_release release;
+             std::vector<std::string> ostrs;
+             self.Finish(&ostrs);
+             return ostrs;
+           })
+      .def("reset", [](StreamingEncoder &self) { self.Reset(); })
+      .def_property_readonly("pending", [](const StreamingEncoder &self) {
+        return self.Pending();
+      });
 }
 
 PYBIND11_MODULE(_cppinyin, m) {
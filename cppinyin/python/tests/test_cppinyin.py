@@ -21,10 +21,34 @@
 #  ctest --verbose -R cppinyin_test_py
 
 
+import os
+import tempfile
+import threading
 import unittest
 
 import cppinyin as cp
 
+try:
+    from click.testing import CliRunner
+
+    from cppinyin.cli import cli
+except ImportError:
+    cli = None
+
+
+def write_dict(path, lines):
+    with open(path, "w") as fo:
+        for line in lines:
+            fo.write(line + "\n")
+
+
+DICT = [
+    "银行 -8.7 yín háng",
+    "行 -5.0 xíng",
+    "长 -5.0 cháng",
+    "中国 -7.0 zhōng guó",
+]
+
 
 class TestEncode(unittest.TestCase):
     def test_encode_decode(self):
@@ -49,5 +73,250 @@ class TestEncode(unittest.TestCase):
         assert pinyins == res, (pinyins, res)
 
 
+class TestUserWords(unittest.TestCase):
+    def test_user_words(self):
+        with tempfile.TemporaryDirectory() as tmp:
+            dict_path = os.path.join(tmp, "dict.raw")
+            write_dict(dict_path, DICT)
+            cpp = cp.Encoder(dict_path)
+            base = ["yin2", "hang2", "xing2", "chang2"]
+            assert cpp.encode("银行行长") == base, cpp.encode("银行行长")
+            assert cpp.num_user_words() == 0
+
+            # A user word adds a key, in normal or number tone.
+            assert cpp.add_user_word("行长", -1.0, ["háng", "zhang3"])
+            assert cpp.num_user_words() == 1
+            res = cpp.encode("银行行长")
+            assert res == ["yin2", "hang2", "hang2", "zhang3"], res
+            # Nothing is added for whitespace or a pinyin not a syllable.
+            assert not cpp.add_user_word("行 长", -1.0, ["hang2", "zhang3"])
+            assert not cpp.add_user_word("行长", -1.0, ["hang2", "zhangg3"])
+            assert cpp.num_user_words() == 1
+            assert cpp.remove_user_word("行长")
+            assert not cpp.remove_user_word("行长")
+            assert cpp.encode("银行行长") == base, cpp.encode("银行行长")
+
+            # A user word replaces the dictionary entry of the same key.
+            user_path = os.path.join(tmp, "user.raw")
+            write_dict(
+                user_path, ["行长 -1.0 hang2 zhang3", "中国 -7.0 zhong4 guo2"]
+            )
+            cpp.load_user_words(user_path)
+            assert cpp.num_user_words() == 2
+            res = cpp.encode("银行行长中国")
+            assert res == [
+                "yin2",
+                "hang2",
+                "hang2",
+                "zhang3",
+                "zhong4",
+                "guo2",
+            ], res
+            cpp.clear_user_words()
+            assert cpp.num_user_words() == 0
+            res = cpp.encode("中国")
+            assert res == ["zhong1", "guo2"], res
+
+    @unittest.skipIf(cli is None, "click is not installed")
+    def test_cli_user_dict(self):
+        with tempfile.TemporaryDirectory() as tmp:
+            dict_path = os.path.join(tmp, "dict.raw")
+            write_dict(dict_path, DICT)
+            user_path = os.path.join(tmp, "user.raw")
+            write_dict(user_path, ["行长 -1.0 hang2 zhang3"])
+            result = CliRunner().invoke(
+                cli,
+                [
+                    "encode",
+                    "银行行长",
+                    "--dict-path",
+                    dict_path,
+                    "--user-dict-path",
+                    user_path,
+                ],
+            )
+            assert result.exit_code == 0, result.output
+            assert result.output == "yin2 hang2 hang2 zhang3\n", result.output
+
+
+class TestReload(unittest.TestCase):
+    def test_reload(self):
+        with tempfile.TemporaryDirectory() as tmp:
+            dict_path = os.path.join(tmp, "dict.raw")
+            write_dict(dict_path, DICT)
+            other_path = os.path.join(tmp, "other.raw")
+            write_dict(other_path, DICT[:3] + ["中国 -7.0 zhòng guó"])
+            model_path = os.path.join(tmp, "other.dict")
+            cp.Encoder(other_path).save(model_path)
+
+            cpp = cp.Encoder(dict_path)
+            old = ["zhong1", "guo2"]
+            new = ["zhong4", "guo2"]
+            assert cpp.encode("中国") == old, cpp.encode("中国")
+            cpp.reload(other_path)
+            assert cpp.encode("中国") == new, cpp.encode("中国")
+            cpp.reload(dict_path)
+            assert cpp.encode("中国") == old, cpp.encode("中国")
+            cpp.reload(model_path, verify_checksums=False)
+            assert cpp.encode("中国") == new, cpp.encode("中国")
+
+            # Each encode call sees either the old model or the new one.
+            results = []
+
+            def encode():
+                for _ in range(200):
+                    results.append(cpp.encode("中国"))
+
+            threads = [threading.Thread(target=encode) for _ in range(4)]
+            for t in threads:
+                t.start()
+            for i in range(20):
+                cpp.reload(dict_path if i % 2 == 0 else model_path)
+            for t in threads:
+                t.join()
+            assert len(results) == 800, len(results)
+            for res in results:
+                assert res in (old, new), res
+
+
+class TestLayers(unittest.TestCase):
+    def write_layers(self, tmp):
+        domain_path = os.path.join(tmp, "domain.raw")
+        write_dict(
+            domain_path, ["行长 -1.0 hang2 zhang3", "中国 -7.0 zhong3 guo2"]
+        )
+        custom_path = os.path.join(tmp, "custom.raw")
+        write_dict(custom_path, ["中国 -7.0 zhong4 guo2"])
+        return domain_path, custom_path
+
+    def test_layers(self):
+        with tempfile.TemporaryDirectory() as tmp:
+            dict_path = os.path.join(tmp, "dict.raw")
+            write_dict(dict_path, DICT)
+            domain_path, custom_path = self.write_layers(tmp)
+            # A layer compiled on its own, mapped when added.
+            custom_model_path = os.path.join(tmp, "custom.dict")
+            cp.Encoder(custom_path).save(custom_model_path)
+
+            cpp = cp.Encoder(dict_path)
+            text = "银行行长中国"
+            base = ["yin2", "hang2", "xing2", "chang2", "zhong1", "guo2"]
+            assert cpp.encode(text) == base, cpp.encode(text)
+            assert not cpp.add_layer("", domain_path, 1)
+
+            # Above the model, the layer hides its 中国 and adds 行长.
+            assert cpp.add_layer("domain", domain_path, 1)
+            assert cpp.num_layers() == 1
+            res = cpp.encode(text)
+            assert res == [
+                "yin2",
+                "hang2",
+                "hang2",
+                "zhang3",
+                "zhong3",
+                "guo2",
+            ], res
+
+            # Below the model, the layer only adds 行长.
+            assert cpp.add_layer("domain", domain_path, -1)
+            assert cpp.num_layers() == 1
+            res = cpp.encode(text)
+            assert res == [
+                "yin2",
+                "hang2",
+                "hang2",
+                "zhang3",
+                "zhong1",
+                "guo2",
+            ], res
+
+            # The score offset applies to the keys of the layer.
+            assert cpp.add_layer("domain", domain_path, -1, score_offset=-100)
+            assert cpp.encode(text) == base, cpp.encode(text)
+
+            assert cpp.add_layer("domain", domain_path, 1)
+            assert cpp.add_layer("custom", custom_model_path, 2)
+            assert cpp.num_layers() == 2
+            res = cpp.encode(text)
+            assert res == [
+                "yin2",
+                "hang2",
+                "hang2",
+                "zhang3",
+                "zhong4",
+                "guo2",
+            ], res
+
+            assert not cpp.remove_layer("other")
+            assert cpp.remove_layer("custom")
+            assert cpp.num_layers() == 1
+            res = cpp.encode(text)
+            assert res == [
+                "yin2",
+                "hang2",
+                "hang2",
+                "zhang3",
+                "zhong3",
+                "guo2",
+            ], res
+            cpp.clear_layers()
+            assert cpp.num_layers() == 0
+            assert cpp.encode(text) == base, cpp.encode(text)
+
+    @unittest.skipIf(cli is None, "click is not installed")
+    def test_cli_layer_dicts(self):
+        with tempfile.TemporaryDirectory() as tmp:
+            dict_path = os.path.join(tmp, "dict.raw")
+            write_dict(dict_path, DICT)
+            domain_path, custom_path = self.write_layers(tmp)
+            # The later layer has the higher priority.
+            result = CliRunner().invoke(
+                cli,
+                [
+                    "encode",
+                    "银行行长中国",
+                    "--dict-path",
+                    dict_path,
+                    "--layer-dict-path",
+                    domain_path,
+                    "--layer-dict-path",
+                    custom_path,
+                ],
+            )
+            assert result.exit_code == 0, result.output
+            expected = "yin2 hang2 hang2 zhang3 zhong4 guo2\n"
+            assert result.output == expected, result.output
+
+
+class TestPhraseIndex(unittest.TestCase):
+    def test_set_phrase_index(self):
+        with tempfile.TemporaryDirectory() as tmp:
+            dict_path = os.path.join(tmp, "dict.raw")
+            write_dict(dict_path, DICT)
+            domain_path = os.path.join(tmp, "domain.raw")
+            write_dict(domain_path, ["行长 -1.0 hang2 zhang3"])
+            model_path = os.path.join(tmp, "dict.dict")
+            text = "银行行长中国"
+            base = ["yin2", "hang2", "xing2", "chang2", "zhong1", "guo2"]
+            layered = ["yin2", "hang2", "hang2", "zhang3", "zhong1", "guo2"]
+
+            cpp = cp.Encoder(dict_path)
+            assert not cpp.set_phrase_index("unknown")
+            for name in ["darts", "sorted", "hash", "codepoint"]:
+                # The index applies to the dictionaries loaded afterwards.
+                assert cpp.set_phrase_index(name), name
+                cpp.reload(dict_path)
+                assert cpp.encode(text) == base, (name, cpp.encode(text))
+                assert cpp.add_layer("domain", domain_path, 1)
+                assert cpp.encode(text) == layered, (name, cpp.encode(text))
+                cpp.clear_layers()
+
+                # A saved model keeps its index.
+                cpp.save(model_path)
+                loaded = cp.Encoder(model_path)
+                res = loaded.encode(text)
+                assert res == base, (name, res)
+
+
 if __name__ == "__main__":
     unittest.main()